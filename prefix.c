@@ -15,13 +15,56 @@
 #include <stdio.h>
 #include "postgres.h"
 
+#include "access/genam.h"
 #include "access/gist.h"
+#include "access/gist_private.h"
+#include "access/heapam.h"
+#include "access/nbtree.h"
 #include "access/skey.h"
+#include "catalog/pg_am.h"
+#include "catalog/pg_type.h"
+#include "commands/trigger.h"
+#include "executor/spi.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "storage/bufmgr.h"
+#include "storage/fd.h"
+#include "nodes/execnodes.h"
+#include "nodes/nodes.h"
+#include "nodes/pg_list.h"
+#include "nodes/primnodes.h"
+#include "utils/acl.h"
 #include "utils/elog.h"
 #include "utils/palloc.h"
 #include "utils/builtins.h"
+#include "utils/array.h"
+#include "utils/fmgroids.h"
+#include "utils/inval.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+#include "utils/typcache.h"
 #include "libpq/pqformat.h"
+#include "mb/pg_wchar.h"
+#include <ctype.h>
 #include <math.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if PG_VERSION_NUM >= 80400
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/guc.h"
+#include "utils/snapmgr.h"
+#endif
+
+#if PG_VERSION_NUM < 80300
+#include "storage/lmgr.h"
+#endif
 
 /**
  * We use those DEBUG defines in the code, uncomment them to get very
@@ -75,28 +118,41 @@ PG_MODULE_MAGIC;
 #define PREFIX_VARDATA(x)        (VARDATA(x))
 #define PREFIX_PG_GETARG_TEXT(x) (PG_GETARG_TEXT_P(x))
 #define PREFIX_SET_VARSIZE(p, s) (VARATT_SIZEP(p) = s)
+#define PREFIX_DETOAST_DATUM(x)  (PG_DETOAST_DATUM(x))
 
 #else
 #define PREFIX_VARSIZE(x)        (VARSIZE_ANY_EXHDR(x))
 #define PREFIX_VARDATA(x)        (VARDATA_ANY(x))
 #define PREFIX_PG_GETARG_TEXT(x) (PG_GETARG_TEXT_PP(x))
 #define PREFIX_SET_VARSIZE(p, s) (SET_VARSIZE(p, s))
+#define PREFIX_DETOAST_DATUM(x)  (PG_DETOAST_DATUM_PACKED(x))
 #endif
 
 /**
- * prefix_range datatype, varlena structure
+ * index_open() and index_close() only take the lock mode from 8.3 on,
+ * before that the caller locks the index.
  */
-typedef struct {
-  char first;
-  char last;
-  char prefix[1]; /* this is a varlena structure, data follows */
-} prefix_range;
+#if PG_MAJOR_VERSION >= 803
+#define pr_index_open(oid, mode)    (index_open(oid, mode))
+#define pr_index_close(index, mode) (index_close(index, mode))
+
+#else
+static inline
+Relation pr_index_open(Oid indexoid, LOCKMODE mode) {
+  Relation index = index_open(indexoid);
+
+  LockRelation(index, mode);
+  return index;
+}
+
+static inline
+void pr_index_close(Relation index, LOCKMODE mode) {
+  UnlockRelation(index, mode);
+  index_close(index);
+}
+#endif
 
-enum pr_delimiters_t {
-  PR_OPEN   = '[',
-  PR_CLOSE  = ']',
-  PR_SEP    = '-'
-} pr_delimiters;
+#include "prefix.h"
 
 /**
  * prefix_range input/output functions and operators
@@ -125,107 +181,14 @@ Datum prefix_range_contained_by(PG_FUNCTION_ARGS);
 Datum prefix_range_contained_by_strict(PG_FUNCTION_ARGS);
 Datum prefix_range_union(PG_FUNCTION_ARGS);
 Datum prefix_range_inter(PG_FUNCTION_ARGS);
+Datum prefix_range_lower(PG_FUNCTION_ARGS);
+Datum prefix_range_upper(PG_FUNCTION_ARGS);
 
 #define DatumGetPrefixRange(X)	          ((prefix_range *) PREFIX_VARDATA(DatumGetPointer(X)) )
 #define PrefixRangeGetDatum(X)	          PointerGetDatum(make_varlena(X))
-#define PG_GETARG_PREFIX_RANGE_P(n)	  DatumGetPrefixRange(PG_DETOAST_DATUM(PG_GETARG_DATUM(n)))
+#define PG_GETARG_PREFIX_RANGE_P(n)	  DatumGetPrefixRange(PREFIX_DETOAST_DATUM(PG_GETARG_DATUM(n)))
 #define PG_RETURN_PREFIX_RANGE_P(x)	  return PrefixRangeGetDatum(x)
 
-/**
- * Used by prefix_contains_internal and pr_contains_prefix.
- *
- * plen is the length of string p, qlen the length of string q, the
- * caller are dealing with either text * or char * and its their
- * responsabolity to use either strlen() or PREFIX_VARSIZE()
- */
-static inline
-bool __prefix_contains(char *p, char *q, int plen, int qlen) {
-  if(qlen < plen )
-    return false;
-
-  return memcmp(p, q, plen) == 0;
-}
-
-static inline
-char *__greater_prefix(char *a, char *b, int alen, int blen)
-{
-  int i = 0;
-  char *result = NULL;
-
-  for(i=0; i<alen && i<blen && a[i] == b[i]; i++);
-  
-  /* i is the last common char position in a, or 0 */
-  if( i == 0 ) {
-    /**
-     * return ""
-     */
-    result = (char *)palloc(sizeof(char));
-  }
-  else {
-    result = (char *)palloc((i+1) * sizeof(char));
-    memcpy(result, a, i);
-  }
-  result[i] = 0;
-    
-  return result;
-}
-
-/**
- * Helper function which builds a prefix_range from a prefix, a first
- * and a last component, making a copy of the prefix string. 
- */
-static inline
-prefix_range *build_pr(const char *prefix, char first, char last) {
-  int s = strlen(prefix) + 1;
-  prefix_range *pr = palloc(sizeof(prefix_range) + s);
-  memcpy(pr->prefix, prefix, s);
-  pr->first = first;
-  pr->last  = last;
-
-#ifdef DEBUG_PR_IN
-  elog(NOTICE,
-       "build_pr: pr->prefix = '%s', pr->first = %d, pr->last = %d", 
-       pr->prefix, pr->first, pr->last);
-#endif
-
-  return pr;
-}
-
-/**
- * Normalize a prefix_range. Two cases are handled:
- *
- *  abc[x-x] is rewritten abcx
- *  abc[x-y] is rewritten abc[y-x] when y < x
- */
-static inline
-prefix_range *pr_normalize(prefix_range *a) {
-  char tmpswap;
-  char *prefix;
-
-  prefix_range *pr = build_pr(a->prefix, a->first, a->last);
-
-  if( pr->first == pr->last ) {
-    int s = strlen(pr->prefix)+2;
-    prefix = (char *)palloc(s);
-    memcpy(prefix, pr->prefix, s-2);
-    prefix[s-2] = pr->first;
-    prefix[s-1] = 0;
-
-#ifdef DEBUG_PR_NORMALIZE
-    elog(NOTICE, "prefix_range %s %s %s", str, pr->prefix, prefix);
-#endif
-
-    pfree(pr);    
-    pr = build_pr(prefix, 0, 0);
-  }
-  else if( pr->first > pr->last ) {
-    tmpswap   = pr->first;
-    pr->first = pr->last;
-    pr->last  = tmpswap;
-  }
-  return pr;
-}
-
 /*
  * Init a prefix value from the prefix_range(text, text, text)
  * function
@@ -254,84 +217,79 @@ prefix_range *make_prefix_range(char *str, char first, char last) {
  *
  * examples : 123[4-6], [1-3], 234, 01[] --- last one not covered by
  * regexp.
+ *
+ * The input needs not be NUL terminated, so that text values are parsed
+ * in place. We parse straight into the varlena we return, allocated for
+ * the whole input length, then normalize it in place: no scratch buffer
+ * and no copy. NULL is returned when the input is not a prefix_range.
  */
-
 static inline
-prefix_range *pr_from_str(char *str) {
-  prefix_range *pr = NULL;
-  char *prefix = (char *)palloc(strlen(str)+1);
+struct varlena *pr_varlena_from_str(const char *str, int len) {
+  struct varlena *vdat =
+    (struct varlena *) palloc(VARHDRSZ + sizeof(prefix_range) + len + 1);
+  prefix_range *pr = (prefix_range *) VARDATA(vdat);
   char current = 0, previous = 0;
   bool opened = false;
   bool closed = false;
   bool sawsep = false;
-  char *ptr, *prefix_ptr = prefix;
+  const char *ptr, *end = str + len;
+  char *prefix_ptr = pr->prefix;
 
-  bzero(prefix, strlen(str)+1);
+  pr->first = 0;
+  pr->last  = 0;
 
-  for(ptr=str; *ptr != 0; ptr++) {
+  for(ptr=str; ptr < end; ptr++) {
     previous = current;
     current = *ptr;
 
-    if( !opened && current != PR_OPEN )
-      *prefix_ptr++ = current;
-
-#ifdef DEBUG_PR_IN
-    elog(NOTICE, "prefix_range previous='%c' current='%c' prefix='%s'", 
-	 (previous?previous:' '), current, prefix);
-#endif
-
     switch( current ) {
 
     case PR_OPEN:
       if( opened ) {
 #ifdef DEBUG_PR_IN
 	elog(ERROR,
-	     "prefix_range %s contains several %c", str, PR_OPEN);
+	     "prefix_range %.*s contains several %c", len, str, PR_OPEN);
 #endif
+	pfree(vdat);
 	return NULL;
       }
       opened = true;
-
-      pr = build_pr(prefix, 0, 0);
       break;
 
     case PR_SEP:
-      if( opened ) {
-	if( closed ) {
-#ifdef DEBUG_PR_IN
-	  elog(ERROR,
-	       "prefix_range %s contains trailing character", str);
-#endif
-	  return NULL;
-	}
-	sawsep = true;
+      if( !opened ) {
+	*prefix_ptr++ = current;
+	break;
+      }
 
-	if( previous == PR_OPEN ) {
+      if( closed ) {
 #ifdef DEBUG_PR_IN
-	  elog(ERROR,
-	       "prefix_range %s has separator following range opening, without data", str);
-#endif	  
-	  return NULL;
-	}
-
-	pr->first = previous;
+	elog(ERROR,
+	     "prefix_range %.*s contains trailing character", len, str);
+#endif
+	pfree(vdat);
+	return NULL;
       }
-      break;
+      sawsep = true;
 
-    case PR_CLOSE:
-      if( !opened ) {
+      if( previous == PR_OPEN ) {
 #ifdef DEBUG_PR_IN
 	elog(ERROR,
-	     "prefix_range %s closes a range which is not opened ", str);
-#endif
+	     "prefix_range %.*s has separator following range opening, without data", len, str);
+#endif	  
+	pfree(vdat);
 	return NULL;
       }
+      pr->first = previous;
+      break;
 
-      if( closed ) {
+    case PR_CLOSE:
+      if( !opened || closed ) {
 #ifdef DEBUG_PR_IN
 	elog(ERROR,
-	     "prefix_range %s contains several %c", str, PR_CLOSE);
+	     "prefix_range %.*s closes a range which is not opened, or twice", len, str);
 #endif
+	pfree(vdat);
 	return NULL;
       }
       closed = true;
@@ -340,20 +298,20 @@ prefix_range *pr_from_str(char *str) {
 	if( previous == PR_SEP ) {
 #ifdef DEBUG_PR_IN
 	  elog(ERROR,
-	       "prefix_range %s has a closed range without last bound", str);	  
+	       "prefix_range %.*s has a closed range without last bound", len, str);
 #endif
+	  pfree(vdat);
 	  return NULL;
 	}
 	pr->last = previous;
       }
-      else {
-	if( previous != PR_OPEN ) {
+      else if( previous != PR_OPEN ) {
 #ifdef DEBUG_PR_IN
-	  elog(ERROR,
-	       "prefix_range %s has a closing range without separator", str);
+	elog(ERROR,
+	     "prefix_range %.*s has a closing range without separator", len, str);
 #endif
-	  return NULL;
-	}
+	pfree(vdat);
+	return NULL;
       }
       break;
 
@@ -361,41 +319,43 @@ prefix_range *pr_from_str(char *str) {
       if( closed ) {
 #ifdef DEBUG_PR_IN
 	elog(ERROR,
-	     "prefix_range %s contains trailing characters", str);
+	     "prefix_range %.*s contains trailing characters", len, str);
 #endif
+	pfree(vdat);
 	return NULL;
       } 
+
+      if( !opened )
+	*prefix_ptr++ = current;
       break;
     }
   }
 
-  if( ! opened ) {
-    pr = build_pr(prefix, 0, 0);
-  }
-
   if( opened && !closed ) {
 #ifdef DEBUG_PR_IN
-    elog(ERROR, "prefix_range %s opens a range but does not close it", str);
+    elog(ERROR, "prefix_range %.*s opens a range but does not close it", len, str);
 #endif
+    pfree(vdat);
     return NULL;
   }
+  *prefix_ptr = 0;
 
-  pr = pr_normalize(pr);
+  pr_normalize(pr);
+  PREFIX_SET_VARSIZE(vdat,
+		     VARHDRSZ + sizeof(prefix_range) + strlen(pr->prefix) + 1);
 
 #ifdef DEBUG_PR_IN
-  if( pr != NULL ) {
-    if( pr->first && pr->last )
-      elog(NOTICE,
-	   "prefix_range %s: prefix = '%s', first = '%c', last = '%c'", 
-	   str, pr->prefix, pr->first, pr->last);
-    else
-      elog(NOTICE,
-	   "prefix_range %s: prefix = '%s', no first nor last", 
-	   str, pr->prefix);
-  }
+  if( pr->first && pr->last )
+    elog(NOTICE,
+	 "prefix_range %.*s: prefix = '%s', first = '%c', last = '%c'", 
+	 len, str, pr->prefix, pr->first, pr->last);
+  else
+    elog(NOTICE,
+	 "prefix_range %.*s: prefix = '%s', no first nor last", 
+	 len, str, pr->prefix);
 #endif
 
-  return pr;
+  return vdat;
 }
 
 static inline
@@ -428,149 +388,6 @@ struct varlena *make_varlena(prefix_range *pr) {
   return NULL;
 }
 
-/*
- * Allow users to use length(prefix) rather than length(prefix::text), and
- * while at it, provides an implementation which won't count the displaying
- * artifacts that are the [] and -.
- */
-static inline
-int pr_length(prefix_range *pr) {
-  int len = strlen(pr->prefix);
-  
-  if( pr->first != 0 )
-    len += 1;
-
-  if( pr->last != 0 )
-    len += 1;
-
-  return len;
-}
-
-static inline
-bool pr_eq(prefix_range *a, prefix_range *b) {
-  int sa = strlen(a->prefix);
-  int sb = strlen(b->prefix);
-
-  return sa == sb
-    && memcmp(a->prefix, b->prefix, sa) == 0
-    && a->first == b->first 
-    && a->last  == b->last;
-}
-
-/*
- * We invent a prefix_range ordering for convenience, but that's
- * dangerous. Use the BTree opclass at your own risk.
- *
- * On the other hand, when your routing table does contain pretty static
- * data and you test it carefully or know it will fit into the ordering
- * simplification, you're good to go.
- *
- * Baring bug, the constraint is to have non-overlapping data.
- */
-
-/*static inline
-bool pr_lt(prefix_range *a, prefix_range *b, bool eqval) {
-*/
-
-static inline
-int pr_cmp(prefix_range *a, prefix_range *b) {
-  int cmp = 0;
-  int alen = strlen(a->prefix);
-  int blen = strlen(b->prefix);
-  int mlen = alen; /* minimum length */
-  char *p  = a->prefix;
-  char *q  = b->prefix;
-
-  /*
-   * First case, common prefix length
-   */
-  if( alen == blen ) {
-    cmp = memcmp(p, q, alen);
-
-    /* Uncommon prefix, easy to compare */
-    if( cmp != 0 ) 
-      return cmp;
-
-    /* Common prefix, check for (sub)ranges */
-    else
-      return (a->first == b->first) ? (a->last - b->last) : (a->first - b->first);
-  }
-
-  /* For memcmp() safety, we need the minimum length */
-  if( mlen > blen )
-    mlen = blen;
-
-  /*
-   * Don't forget we may have [x-y] prefix style, that's empty prefix, only range.
-   */
-  if( alen == 0 && a->first != 0 ) {
-    /* return (eqval ? (a->first <= q[0]) : (a->first < q[0])); */
-    return a->first - q[0];
-  }
-  else if( blen == 0 && b->first != 0 ) {
-    /* return (eqval ? (p[0] <= b->first) : (p[0] < b->first)); */
-    return p[0] - b->first;
-  }
-
-  /*
-   * General case
-   *
-   * When memcmp() on the shorter of p and q returns 0, that means they
-   * share a common prefix: avoid to say that '93' < '9377' and '9377' <
-   * '93'.
-   */
-  cmp = memcmp(p, q, mlen);
-  
-  if( cmp == 0 )
-    /*
-     * we are comparing e.g. '1' and '12' (the shorter contains the
-     * smaller), so let's pretend '12' < '1' as it contains less elements.
-     */
-    return (alen == mlen) ? 1 : -1;
-
-  return cmp;
-}
-
-static inline
-bool pr_lt(prefix_range *a, prefix_range *b, bool eqval) {
-  int cmp = pr_cmp(a, b);
-  return eqval ? cmp <= 0 : cmp < 0;
-}
-
-static inline
-bool pr_gt(prefix_range *a, prefix_range *b, bool eqval) {
-  int cmp = pr_cmp(a, b);
-  return eqval ? cmp >= 0 : cmp > 0;
-}
-
-static inline
-bool pr_contains(prefix_range *left, prefix_range *right, bool eqval) {
-  int sl;
-  int sr;
-  bool left_prefixes_right;
-
-  if( pr_eq(left, right) )
-    return eqval;
-
-  sl = strlen(left->prefix);
-  sr = strlen(right->prefix);
-
-  if( sr < sl )
-    return false;
-
-  left_prefixes_right = memcmp(left->prefix, right->prefix, sl) == 0;
-
-  if( left_prefixes_right ) {
-    if( sl == sr )
-      return left->first == 0 ||
-	(left->first <= right->first && left->last >= right->last);
-
-    return left->first == 0 ||
-      (left->first <= right->prefix[sl] && right->prefix[sl] <= left->last);
-  }
-  return false;
-}
-
 /**
  * does a given prefix_range includes a given prefix?
  */
@@ -596,147 +413,6 @@ bool pr_contains_prefix(prefix_range *pr, text *query, bool eqval) {
   return false;
 }
 
-static 
-prefix_range *pr_union(prefix_range *a, prefix_range *b) {
-  prefix_range *res = NULL;
-  int alen = strlen(a->prefix);
-  int blen = strlen(b->prefix);
-  char *gp = NULL;
-  int gplen;
-  char min, max;
-
-  if( 0 == alen && 0 == blen ) {
-    res = build_pr("",
-		   a->first <= b->first ? a->first : b->first,
-		   a->last  >= b->last  ? a->last : b->last);
-    return pr_normalize(res);
-  }
-
-  gp = __greater_prefix(a->prefix, b->prefix, alen, blen);
-  gplen = strlen(gp);
-
-  if( gplen == 0 ) {
-    res = build_pr("", 0, 0);
-    if( alen > 0 && blen > 0 ) {
-      res->first = a->prefix[0];
-      res->last  = b->prefix[0];
-    }
-    else if( alen == 0 ) {
-      res->first = a->first <= b->prefix[0] ? a->first : b->prefix[0];
-      res->last  = a->last  >= b->prefix[0] ? a->last  : b->prefix[0];
-    }
-    else if( blen == 0 ) {
-      res->first = b->first <= a->prefix[0] ? b->first : a->prefix[0];
-      res->last  = b->last  >= a->prefix[0] ? b->last  : a->prefix[0];
-    }
-  }
-  else {
-    res = build_pr(gp, 0, 0);
-
-    if( gplen == alen && alen == blen ) {
-      res->first = a->first <= b->first ? a->first : b->first;
-      res->last  = a->last  >= b->last  ? a->last : b->last;
-    }
-    else if( gplen == alen ) {
-      Assert(alen < blen);
-      res->first = a->first <= b->prefix[alen] ? a->first : b->prefix[alen];
-      res->last  = a->last  >= b->prefix[alen] ? a->last  : b->prefix[alen];
-    }
-    else if( gplen == blen ) {
-      Assert(blen < alen);
-      res->first = b->first <= a->prefix[blen] ? b->first : a->prefix[blen];
-      res->last  = b->last  >= a->prefix[blen] ? b->last  : a->prefix[blen];
-    }
-    else {
-      Assert(gplen < alen && gplen < blen);
-      min = a->prefix[gplen];
-      max = b->prefix[gplen];
-
-      if( min > max ) {
-	min = b->prefix[gplen];
-	max = a->prefix[gplen];
-      }
-      res->first = min;
-      res->last  = max;
-#ifdef DEBUG_UNION
-    elog(NOTICE, "union a: %s %d %d", a->prefix, a->first, a->last);
-    elog(NOTICE, "union b: %s %d %d", b->prefix, b->first, b->last);
-    elog(NOTICE, "union r: %s %d %d", res->prefix, res->first, res->last);
-#endif
-    }
-  }
-  return pr_normalize(res);
-}
-
-static inline
-prefix_range *pr_inter(prefix_range *a, prefix_range *b) {
-  prefix_range *res = NULL;
-  int alen = strlen(a->prefix);
-  int blen = strlen(b->prefix);
-  char *gp = NULL;
-  int gplen;
-
-  if( 0 == alen && 0 == blen ) {
-    res = build_pr("",
-		   a->first > b->first ? a->first : b->first,
-		   a->last  < b->last  ? a->last  : b->last);
-    return pr_normalize(res);
-  }
-
-  gp = __greater_prefix(a->prefix, b->prefix, alen, blen);
-  gplen = strlen(gp);
-
-  if( gplen != alen && gplen != blen ) {
-    return build_pr("", 0, 0);
-  }
-
-  if( gplen == alen && 0 == alen ) {
-    if( a->first <= b->prefix[0] && b->prefix[0] <= a->last ) {      
-      res = build_pr(b->prefix, b->first, b->last);
-    }
-    else
-      res = build_pr("", 0, 0);
-  }
-  else if( gplen == blen && 0 == blen ) {
-    if( b->first <= a->prefix[0] && a->prefix[0] <= b->last ) {      
-      res = build_pr(a->prefix, a->first, a->last);
-    }
-    else
-      res = build_pr("", 0, 0);
-  }
-  else if( gplen == alen && alen == blen ) {
-    res = build_pr(gp,
-		   a->first > b->first ? a->first : b->first,
-		   a->last  > b->last  ? a->last  : b->last);
-
-#ifdef DEBUG_INTER
-    elog(NOTICE, "inter a: %s %d %d", a->prefix, a->first, a->last);
-    elog(NOTICE, "inter b: %s %d %d", b->prefix, b->first, b->last);
-    elog(NOTICE, "inter r: %s %d %d", res->prefix, res->first, res->last);
-#endif
-  }
-  else if( gplen == alen ) {
-    Assert(gplen < blen);
-    res = build_pr(b->prefix, b->first, b->last);
-  }
-  else if( gplen == blen ) {
-    Assert(gplen < alen);
-    res = build_pr(a->prefix, a->first, a->last);
-  }
-
-  return pr_normalize(res);
-}
-
-/**
- * true if ranges have at least one common element
- */
-static inline
-bool pr_overlaps(prefix_range *a, prefix_range *b) {
-  prefix_range *inter = pr_inter(a, b);
-
-  return strlen(inter->prefix) > 0 || (inter->first != 0 && inter->last != 0);
-}
-
 
 PG_FUNCTION_INFO_V1(prefix_range_init);
 Datum
@@ -776,10 +452,10 @@ Datum
 prefix_range_in(PG_FUNCTION_ARGS)
 {
     char *str = PG_GETARG_CSTRING(0);
-    prefix_range *pr = pr_from_str(str);
+    struct varlena *pr = pr_varlena_from_str(str, strlen(str));
 
     if (pr != NULL) {
-      PG_RETURN_PREFIX_RANGE_P(pr);
+      PG_RETURN_POINTER(pr);
     }
 
     ereport(ERROR,
@@ -793,18 +469,95 @@ PG_FUNCTION_INFO_V1(prefix_range_out);
 Datum
 prefix_range_out(PG_FUNCTION_ARGS)
 {
-  prefix_range *pr = PG_GETARG_PREFIX_RANGE_P(0);
-  char *out = NULL;
+  PG_RETURN_CSTRING(pr_to_str(PG_GETARG_PREFIX_RANGE_P(0)));
+}
 
-  if( pr->first ) {
-    out = (char *)palloc((strlen(pr->prefix)+6) * sizeof(char));
-    sprintf(out, "%s[%c-%c]", pr->prefix, pr->first, pr->last);
-  }
-  else {
-    out = (char *)palloc((strlen(pr->prefix)+1) * sizeof(char));
-    sprintf(out, "%s", pr->prefix);
-  }
-  PG_RETURN_CSTRING(out);
+/*
+ * Binary format, version 1:
+ *
+ *  byte   version
+ *  byte   first, 0 when there's no range
+ *  byte   last,  0 when there's no range
+ *  int32  prefix length
+ *  bytes  prefix, not NUL terminated
+ *
+ * The receive function validates what the input function would refuse
+ * and normalizes the value, so that a binary COPY can't insert anything
+ * a text COPY couldn't. As for a text value, the prefix is converted
+ * from the client encoding with pq_getmsgtext() and then verified, and
+ * so are the range bounds, which must each be a single character.
+ */
+#define PR_BINARY_VERSION 1
+
+static
+char pr_recv_bound(char c) {
+  char *s;
+
+  if( c == 0 )
+    return 0;
+
+  s = pg_client_to_server(&c, 1);
+
+  if( (s != &c && strlen(s) != 1) || !pg_verifymbstr(s, 1, true) )
+    ereport(ERROR,
+	    (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+	     errmsg("invalid prefix_range range bounds")));
+
+  return s[0];
+}
+
+/*
+ * Reads a prefix_range in the format above, after its version byte.
+ */
+static
+struct varlena *pr_recv(StringInfo buf) {
+    char first, last;
+    char *prefix;
+    int len;
+    struct varlena *vdat;
+    prefix_range *pr;
+
+    first = pr_recv_bound((char) pq_getmsgbyte(buf));
+    last  = pr_recv_bound((char) pq_getmsgbyte(buf));
+    len   = (int) pq_getmsgint(buf, 4);
+
+    if( len < 0 || len > buf->len - buf->cursor )
+      ereport(ERROR,
+	      (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+	       errmsg("invalid prefix_range prefix length %d", len)));
+
+    /* the length in the server encoding may differ */
+    prefix = pq_getmsgtext(buf, len, &len);
+    pg_verifymbstr(prefix, len, false);
+
+    if( memchr(prefix, 0, len) != NULL
+	|| memchr(prefix, PR_OPEN, len) != NULL
+	|| memchr(prefix, PR_CLOSE, len) != NULL )
+      ereport(ERROR,
+	      (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+	       errmsg("invalid character in prefix_range prefix")));
+
+    if( (first == 0) != (last == 0)
+	|| first == PR_OPEN || first == PR_CLOSE || first == PR_SEP
+	|| last  == PR_OPEN || last  == PR_CLOSE || last  == PR_SEP )
+      ereport(ERROR,
+	      (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+	       errmsg("invalid prefix_range range bounds")));
+
+    vdat = (struct varlena *) palloc(VARHDRSZ + sizeof(prefix_range) + len + 1);
+    pr   = (prefix_range *) VARDATA(vdat);
+
+    pr->first = first;
+    pr->last  = last;
+    memcpy(pr->prefix, prefix, len);
+    pr->prefix[len] = 0;
+    pfree(prefix);
+
+    pr_normalize(pr);
+    PREFIX_SET_VARSIZE(vdat,
+		       VARHDRSZ + sizeof(prefix_range) + strlen(pr->prefix) + 1);
+
+    return vdat;
 }
 
 PG_FUNCTION_INFO_V1(prefix_range_recv);
@@ -812,13 +565,46 @@ Datum
 prefix_range_recv(PG_FUNCTION_ARGS)
 {
     StringInfo buf = (StringInfo) PG_GETARG_POINTER(0);
-    const char *first = pq_getmsgbytes(buf, 1);
-    const char *last  = pq_getmsgbytes(buf, 1);
-    const char *prefix = pq_getmsgstring(buf);
-    prefix_range *pr = build_pr(prefix, *first, *last);
+    int version    = pq_getmsgbyte(buf);
+    struct varlena *vdat;
 
+    if( version != PR_BINARY_VERSION )
+      ereport(ERROR,
+	      (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+	       errmsg("unsupported prefix_range binary format version %d", version)));
+
+    vdat = pr_recv(buf);
     pq_getmsgend(buf);
-    PG_RETURN_PREFIX_RANGE_P(pr);
+
+    PG_RETURN_POINTER(vdat);
+}
+
+static
+char pr_send_bound(char c) {
+  char *s;
+
+  if( c == 0 )
+    return 0;
+
+  s = pg_server_to_client(&c, 1);
+
+  if( s != &c && strlen(s) != 1 )
+    ereport(ERROR,
+	    (errcode(ERRCODE_CHARACTER_NOT_IN_REPERTOIRE),
+	     errmsg("prefix_range range bound is not a single character in the client encoding")));
+
+  return s[0];
+}
+
+/*
+ * Writes a prefix_range in the format above, after its version byte,
+ * in the client encoding.
+ */
+static
+void pr_send(StringInfo buf, prefix_range *pr) {
+    pq_sendbyte(buf, pr_send_bound(pr->first));
+    pq_sendbyte(buf, pr_send_bound(pr->last));
+    pq_sendcountedtext(buf, pr->prefix, strlen(pr->prefix), false);
 }
 
 PG_FUNCTION_INFO_V1(prefix_range_send);
@@ -829,20 +615,33 @@ prefix_range_send(PG_FUNCTION_ARGS)
     StringInfoData buf;
 
     pq_begintypsend(&buf);
-    pq_sendbyte(&buf, pr->first);
-    pq_sendbyte(&buf, pr->last);
-    pq_sendstring(&buf, pr->prefix);
+    pq_sendbyte(&buf, PR_BINARY_VERSION);
+    pr_send(&buf, pr);
 
     PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
 }
 
-PG_FUNCTION_INFO_V1(prefix_range_cast_from_text);
+/*
+ * The casts don't go through cstring: we parse the text data in place,
+ * and format straight into the text value.
+ */
+PG_FUNCTION_INFO_V1(prefix_range_cast_from_text);
 Datum
 prefix_range_cast_from_text(PG_FUNCTION_ARGS)
 {
-  text *txt = PG_GETARG_TEXT_P(0);
-  Datum cstring = DirectFunctionCall1(textout, PointerGetDatum(txt));
-  return DirectFunctionCall1(prefix_range_in, cstring);
+  text *txt = PREFIX_PG_GETARG_TEXT(0);
+  int len   = PREFIX_VARSIZE(txt);
+  struct varlena *pr = pr_varlena_from_str(PREFIX_VARDATA(txt), len);
+
+  if( pr != NULL ) {
+    PG_RETURN_POINTER(pr);
+  }
+
+  ereport(ERROR,
+	  (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+	   errmsg("invalid prefix_range value: \"%.*s\"",
+		  len, PREFIX_VARDATA(txt))));
+  PG_RETURN_NULL();
 }
 
 PG_FUNCTION_INFO_V1(prefix_range_cast_to_text);
@@ -850,16 +649,14 @@ Datum
 prefix_range_cast_to_text(PG_FUNCTION_ARGS)
 {
   prefix_range *pr = PG_GETARG_PREFIX_RANGE_P(0);
-  Datum cstring;
-  text *out;
+  int plen  = strlen(pr->prefix);
+  int len   = pr_str_len(pr, plen);
+  text *out = (text *)palloc(VARHDRSZ + len);
 
-  if (pr != NULL) {
-    cstring = DirectFunctionCall1(prefix_range_out, PrefixRangeGetDatum(pr));
-    out = (text *)DirectFunctionCall1(textin, cstring);
+  PREFIX_SET_VARSIZE(out, VARHDRSZ + len);
+  pr_write_str(pr, plen, VARDATA(out));
 
-    PG_RETURN_TEXT_P(out);
-  }
-  PG_RETURN_NULL();
+  PG_RETURN_TEXT_P(out);
 }
 
 PG_FUNCTION_INFO_V1(prefix_range_length);
@@ -991,6 +788,61 @@ prefix_range_inter(PG_FUNCTION_ARGS)
 				     PG_GETARG_PREFIX_RANGE_P(1)) );
 }
 
+/**
+ * The strings a prefix_range contains are all the strings between its
+ * lower and upper bounds, in byte order: abc[x-y] contains the strings
+ * s with abcx <= s < abc(y+1). That allows to rewrite text ~<@~ prefix_range
+ * as a range scan on a btree index using the text_pattern_ops opclass.
+ *
+ * The upper bound is exclusive, incrementing the last byte which is not
+ * 0xFF. There's no upper bound when all bytes are 0xFF, or when the
+ * prefix_range is the empty one: we then return NULL.
+ */
+PG_FUNCTION_INFO_V1(prefix_range_lower);
+Datum
+prefix_range_lower(PG_FUNCTION_ARGS)
+{
+  prefix_range *pr = PG_GETARG_PREFIX_RANGE_P(0);
+  int plen = strlen(pr->prefix);
+  int len  = pr->first != 0 ? plen + 1 : plen;
+  text *out = (text *)palloc(VARHDRSZ + len);
+
+  PREFIX_SET_VARSIZE(out, VARHDRSZ + len);
+  memcpy(VARDATA(out), pr->prefix, plen);
+
+  if( pr->first != 0 )
+    VARDATA(out)[plen] = pr->first;
+
+  PG_RETURN_TEXT_P(out);
+}
+
+PG_FUNCTION_INFO_V1(prefix_range_upper);
+Datum
+prefix_range_upper(PG_FUNCTION_ARGS)
+{
+  prefix_range *pr = PG_GETARG_PREFIX_RANGE_P(0);
+  int plen = strlen(pr->prefix);
+  int len  = pr->first != 0 ? plen + 1 : plen;
+  text *out = (text *)palloc(VARHDRSZ + len);
+  unsigned char *bound = (unsigned char *) VARDATA(out);
+
+  memcpy(bound, pr->prefix, plen);
+
+  if( pr->first != 0 )
+    bound[plen] = (unsigned char) pr->last;
+
+  while( len > 0 && bound[len-1] == 0xFF )
+    len--;
+
+  if( len == 0 )
+    PG_RETURN_NULL();
+
+  bound[len-1]++;
+  PREFIX_SET_VARSIZE(out, VARHDRSZ + len);
+
+  PG_RETURN_TEXT_P(out);
+}
+
 /**
  * GiST support methods
  *
@@ -1007,6 +859,17 @@ Datum gpr_union(PG_FUNCTION_ARGS);
 Datum gpr_same(PG_FUNCTION_ARGS);
 Datum pr_penalty(PG_FUNCTION_ARGS);
 
+/**
+ * Index lookups sampling, see the hot prefixes section, pr_stats is only
+ * set when that's enabled.
+ */
+#if PG_MAJOR_VERSION >= 804
+static struct pr_stats_shared *pr_stats = NULL;
+
+static void pr_stats_sample(GISTENTRY *entry, Datum query,
+			    prefix_range *key, bool match);
+#endif
+
 /*
  * Internal implementation of consistent
  *
@@ -1070,6 +933,7 @@ gpr_consistent(PG_FUNCTION_ARGS)
     StrategyNumber strategy = (StrategyNumber) PG_GETARG_UINT16(2);
     prefix_range *key = DatumGetPrefixRange(entry->key);
     bool *recheck;
+    bool result;
 
     Assert( PG_NARGS() == 4 || PG_NARGS() == 5);
 
@@ -1084,7 +948,13 @@ gpr_consistent(PG_FUNCTION_ARGS)
       recheck  = (bool *) PG_GETARG_POINTER(4);
       *recheck = false;
     }
-    PG_RETURN_BOOL( pr_consistent(strategy, key, query, GIST_LEAF(entry)) );
+    result = pr_consistent(strategy, key, query, GIST_LEAF(entry));
+
+#if PG_MAJOR_VERSION >= 804
+    if( pr_stats != NULL )
+      pr_stats_sample(entry, PG_GETARG_DATUM(1), key, result);
+#endif
+    PG_RETURN_BOOL( result );
 }
 
 /*
@@ -1105,136 +975,6 @@ gpr_decompress(PG_FUNCTION_ARGS)
     PG_RETURN_POINTER(PG_GETARG_POINTER(0));
 }
 
-static
-float __pr_penalty(prefix_range *orig, prefix_range *new)
-{
-  float penalty;
-  char *gp;
-  int  nlen, olen, gplen, dist = 0;
-  char tmp;
-
-#ifdef DEBUG_PENALTY
-  if( orig->prefix[0] != 0 ) {
-    /**
-     * The prefix main test case deals with phone number data, hence
-     * containing only numbers...
-     */
-    if( orig->prefix[0] < '0' || orig->prefix[0] > '9' )
-      elog(NOTICE, "__pr_penalty(%s, %s) orig->first=%d orig->last=%d ", 
-	   DatumGetCString(DirectFunctionCall1(prefix_range_out,PrefixRangeGetDatum(orig))),
-	   DatumGetCString(DirectFunctionCall1(prefix_range_out,PrefixRangeGetDatum(new))),
-	   orig->first, orig->last);
-    Assert(orig->prefix[0] >= '0' && orig->prefix[0] <= '9');
-  }
-#endif
-
-  olen  = strlen(orig->prefix);
-  nlen  = strlen(new->prefix);
-  gp    = __greater_prefix(orig->prefix, new->prefix, olen, nlen);
-  gplen = strlen(gp);
-
-  dist  = 1;
-
-  if( 0 == olen && 0 == nlen ) {
-    if( orig->last >= new->first )
-      dist = 0;
-    else
-      dist = new->first - orig->last;
-  }
-  else if( 0 == olen ) {
-    /**
-     * penalty('[a-b]', 'xyz');
-     */
-    if( orig->first != 0 ) {
-      tmp = new->prefix[0];
-
-      if( orig->first <= tmp && tmp <= orig->last ) {
-	gplen = 1;
-
-	dist = 1 + (int)tmp - (int)orig->first;
-	if( (1 + (int)orig->last - (int)tmp) < dist )
-	  dist = 1 + (int)orig->last - (int)tmp;
-      }
-      else
-	dist = (orig->first > tmp ? orig->first - tmp  : tmp - orig->last );
-    }
-  }
-  else if( 0 == nlen ) {
-    /**
-     * penalty('abc', '[x-y]');
-     */
-    if( new->first != 0 ) {
-      tmp = orig->prefix[0];
-
-      if( new->first <= tmp && tmp <= new->last ) {
-	gplen = 1;
-
-	dist = 1 + (int)tmp - (int)new->first;
-	if( (1 + (int)new->last - (int)tmp) < dist )
-	  dist = 1 + (int)new->last - (int)tmp;
-      }
-      else
-	dist = (new->first > tmp ? new->first - tmp  : tmp - new->last );
-    }
-  }
-  else {
-    /**
-     * General case
-     */
-
-    if( gplen > 0 ) {
-      if( olen > gplen && nlen == gplen && new->first != 0 ) {
-	/**
-	 * gpr_penalty('abc[f-l]', 'ab[x-y]')
-	 */
-	if( new->first <= orig->prefix[gplen]
-	    && orig->prefix[gplen] <= new->last ) {
-
-	  dist   = 1 + (int)orig->prefix[gplen] - (int)new->first;	  
-	  if( (1 + (int)new->last - (int)orig->prefix[gplen]) < dist )
-	    dist = 1 + (int)new->last - (int)orig->prefix[gplen];
-
-	  gplen += 1;
-	}
-	else {
-	  dist += 1;
-	}
-      }
-      else if( nlen > gplen && olen == gplen && orig->first != 0 ) {
-	/**
-	 * gpr_penalty('ab[f-l]', 'abc[x-y]')
-	 */
-	if( orig->first <= new->prefix[gplen]
-	    && new->prefix[gplen] <= orig->last ) {
-
-	  dist   = 1 + (int)new->prefix[gplen] - (int)orig->first;
-	  if( (1 + (int)orig->last - (int)new->prefix[gplen]) < dist )
-	    dist = 1 + (int)orig->last - (int)new->prefix[gplen];
-
-	  gplen += 1;
-	}
-	else {
-	  dist += 1;
-	}
-      }	
-    }
-    /**
-     * penalty('abc[f-l]', 'xyz[g-m]'), nothing common
-     * dist = 1, gplen = 0, penalty = 1
-     */
-  }
-  penalty = (((float)dist) / powf(256, gplen));
-
-#ifdef DEBUG_PENALTY
-  elog(NOTICE, "__pr_penalty(%s, %s) == %d/(256^%d) == %g", 
-       DatumGetCString(DirectFunctionCall1(prefix_range_out,PrefixRangeGetDatum(orig))),
-       DatumGetCString(DirectFunctionCall1(prefix_range_out,PrefixRangeGetDatum(new))),
-       dist, gplen, penalty);
-#endif
-
-  return penalty;
-}
-
 PG_FUNCTION_INFO_V1(gpr_penalty);
 Datum
 gpr_penalty(PG_FUNCTION_ARGS)
@@ -1652,23 +1392,12 @@ Datum pr_picksplit(GistEntryVector *entryvec, GIST_SPLITVEC *v, bool presort) {
     OffsetNumber *sort  = NULL;
 
     int	nbytes;
-    OffsetNumber offl, offr;
     OffsetNumber *listL;
     OffsetNumber *listR;
-    prefix_range *curl, *curr, *tmp_union;
+    prefix_range **prs;
     prefix_range *unionL;
     prefix_range *unionR;
-    
-    /**
-     * Keeping track of penalties to insert into ListL or ListR, for
-     * both the leftmost and the rightmost element of the remaining
-     * list.
-     */
-    float pll, plr, prl, prr;
-
-#ifdef DEBUG_PICKSPLIT
     OffsetNumber i;
-#endif
 
     if( presort ) {
       sort = pr_presort(entryvec);
@@ -1680,144 +1409,19 @@ Datum pr_picksplit(GistEntryVector *entryvec, GIST_SPLITVEC *v, bool presort) {
 #endif
     }
 
+    prs = (prefix_range **) palloc((maxoff + 1) * sizeof(prefix_range *));
+    for(i = FirstOffsetNumber; i <= maxoff; i = OffsetNumberNext(i))
+      prs[i] = DatumGetPrefixRange(ent[i].key);
+
     nbytes = (maxoff + 1) * sizeof(OffsetNumber);
     listL = (OffsetNumber *) palloc(nbytes);
     listR = (OffsetNumber *) palloc(nbytes);
     v->spl_left  = listL;
     v->spl_right = listR;
-    v->spl_nleft = v->spl_nright = 0;
-
-    offl = FirstOffsetNumber;
-    offr = maxoff;
-
-    unionL = DatumGetPrefixRange(ent[offl].key);
-    unionR = DatumGetPrefixRange(ent[offr].key);
-
-    v->spl_left[v->spl_nleft++]   = offl;
-    v->spl_right[v->spl_nright++] = offr;
-    v->spl_left  = listL;
-    v->spl_right = listR;
-
-    offl = OffsetNumberNext(offl);
-    offr = OffsetNumberPrev(offr);
-
-    while( offl < offr ) {
-
-      if( presort ) {
-	curl = DatumGetPrefixRange(ent[sort[offl]].key);
-	curr = DatumGetPrefixRange(ent[sort[offr]].key);
-      }
-      else {
-	curl = DatumGetPrefixRange(ent[offl].key);
-	curr = DatumGetPrefixRange(ent[offr].key);
-      }
-
-#ifdef DEBUG_PICKSPLIT
-      elog(NOTICE, "gpr_picksplit: ent[%3d] = '%s' \tent[%3d] = '%s'",
-	   offl,
-	   DatumGetCString(DirectFunctionCall1(prefix_range_out, PrefixRangeGetDatum(curl))),
-	   offr,
-	   DatumGetCString(DirectFunctionCall1(prefix_range_out, PrefixRangeGetDatum(curr))));
-#endif
-
-      Assert(curl != NULL && curr != NULL);
-
-      pll = __pr_penalty(unionL, curl);
-      plr = __pr_penalty(unionR, curl);
-      prl = __pr_penalty(unionL, curr);
-      prr = __pr_penalty(unionR, curr);
-
-      if( pll <= plr && prl >= prr ) {
-	/**
-	 * curl should go to left and curr to right, unless they share
-	 * a non-empty common prefix, in which case we place both curr
-	 * and curl on the same side. Arbitrarily the left one.
-	 */
-	if( pll == plr && prl == prr ) {
-	  tmp_union = pr_union(curl, curr);
-
-	  if( strlen(tmp_union->prefix) > 0 ) {
-	    unionL = pr_union(unionL, tmp_union);
-	    v->spl_left[v->spl_nleft++] = offl;
-	    v->spl_left[v->spl_nleft++] = offr;
-
-	    offl = OffsetNumberNext(offl);
-	    offr = OffsetNumberPrev(offr);
-	    continue;
-	  }
-	}
-	/**
-	 * here pll <= plr and prl >= prr and (pll != plr || prl != prr)
-	 */
-	unionL = pr_union(unionL, curl);
-	unionR = pr_union(unionR, curr);
 
-	v->spl_left[v->spl_nleft++]   = offl;
-	v->spl_right[v->spl_nright++] = offr;
-
-	offl = OffsetNumberNext(offl);
-	offr = OffsetNumberPrev(offr);
-      }
-      else if( pll > plr && prl >= prr ) {
-	/**
-	 * Current rightmost entry is added to listL
-	 */
-	unionR = pr_union(unionR, curr);
-	v->spl_right[v->spl_nright++] = offr;
-	offr = OffsetNumberPrev(offr);
-      }
-      else if( pll <= plr && prl < prr ) {
-	/**
-	 * Current leftmost entry is added to listL
-	 */
-	unionL = pr_union(unionL, curl);
-	v->spl_left[v->spl_nleft++] = offl;
-	offl = OffsetNumberNext(offl);
-      }
-      else if( (pll - plr) < (prr - prl) ) {
-	/**
-	 * All entries still in the list go into listL
-	 */
-	for(; offl <= offr; offl = OffsetNumberNext(offl)) {
-	  curl   = DatumGetPrefixRange(ent[offl].key);
-	  unionL = pr_union(unionL, curl);
-	  v->spl_left[v->spl_nleft++] = offl;
-	}
-      }
-      else {
-	/**
-	 * All entries still in the list go into listR
-	 */
-	for(; offr >= offl; offr = OffsetNumberPrev(offr)) {
-	  curr   = DatumGetPrefixRange(ent[offr].key);
-	  unionR = pr_union(unionR, curr);
-	  v->spl_right[v->spl_nright++] = offr;
-	}
-      }
-    }
-
-    /**
-     * The for loop continues while offl < offr. If maxoff is odd, it
-     * could be that there's a last value to process. Here we choose
-     * where to add it.
-     */
-    if( offl == offr ) {
-      curl = DatumGetPrefixRange(ent[offl].key);
-
-      pll  = __pr_penalty(unionL, curl);
-      plr  = __pr_penalty(unionR, curl);
-
-      if( pll < plr || (pll == plr && v->spl_nleft < v->spl_nright) ) {
-	curl       = DatumGetPrefixRange(ent[offl].key);
-	unionL     = pr_union(unionL, curl);
-	v->spl_left[v->spl_nleft++] = offl;
-      }
-      else {
-	curl       = DatumGetPrefixRange(ent[offl].key);
-	unionR     = pr_union(unionR, curl);
-	v->spl_right[v->spl_nright++] = offl;
-      }
-    }
+    /* the split itself is in prefix.h, for prefix_bench.c to time it */
+    pr_split(prs, maxoff, sort, listL, &v->spl_nleft, listR, &v->spl_nright,
+	     &unionL, &unionR);
 
     v->spl_ldatum = PrefixRangeGetDatum(unionL);
     v->spl_rdatum = PrefixRangeGetDatum(unionR);
@@ -1912,3 +1516,4886 @@ gpr_same(PG_FUNCTION_ARGS)
     *result = pr_eq(v1, v2);
     PG_RETURN_POINTER( result );
 }
+
+/**
+ * Fetch all the prefix_range values found in given column of given
+ * relation. The values are copied in the caller's memory context, and
+ * we cast the column so that a text column will do too.
+ */
+static
+prefix_range **pr_fetch_column(Oid relid, const char *column, int *n) {
+  MemoryContext oldcontext = CurrentMemoryContext;
+  StringInfoData query;
+  prefix_range **result, *pr;
+  Datum value;
+  bool isnull;
+  int i;
+
+  initStringInfo(&query);
+  appendStringInfo(&query,
+		   "SELECT %s::prefix_range FROM %s WHERE %s IS NOT NULL",
+		   quote_identifier(column),
+		   DatumGetCString(DirectFunctionCall1(regclassout,
+						       ObjectIdGetDatum(relid))),
+		   quote_identifier(column));
+
+  if( SPI_connect() != SPI_OK_CONNECT )
+    elog(ERROR, "SPI_connect failed");
+
+  if( SPI_execute(query.data, true, 0) != SPI_OK_SELECT )
+    elog(ERROR, "SPI_execute failed: %s", query.data);
+
+  *n = SPI_processed;
+
+  MemoryContextSwitchTo(oldcontext);
+  result = (prefix_range **) palloc((*n + 1) * sizeof(prefix_range *));
+
+  for(i=0; i < *n; i++) {
+    value  = SPI_getbinval(SPI_tuptable->vals[i],
+			   SPI_tuptable->tupdesc, 1, &isnull);
+    pr = DatumGetPrefixRange(PG_DETOAST_DATUM(value));
+    result[i] = build_pr(pr->prefix, pr->first, pr->last);
+  }
+
+  SPI_finish();
+  pfree(query.data);
+
+  return result;
+}
+
+/**
+ * Set returning functions here all use the materialize mode, prepare
+ * the tuplestore and the result tuple descriptor.
+ */
+static
+Tuplestorestate *pr_srf_materialize(FunctionCallInfo fcinfo,
+				    TupleDesc *tupdesc) {
+  ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+  Tuplestorestate *tupstore;
+  MemoryContext oldcontext;
+
+  if( rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) )
+    ereport(ERROR,
+	    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+	     errmsg("set-valued function called in context that cannot accept a set")));
+
+  if( !(rsinfo->allowedModes & SFRM_Materialize) )
+    ereport(ERROR,
+	    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+	     errmsg("materialize mode required, but it is not allowed in this context")));
+
+  if( get_call_result_type(fcinfo, NULL, tupdesc) != TYPEFUNC_COMPOSITE )
+    elog(ERROR, "return type must be a row type");
+
+  oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+
+  *tupdesc = CreateTupleDescCopy(*tupdesc);
+  tupstore = tuplestore_begin_heap(true, false, work_mem);
+
+  rsinfo->returnMode = SFRM_Materialize;
+  rsinfo->setResult  = tupstore;
+  rsinfo->setDesc    = *tupdesc;
+
+  MemoryContextSwitchTo(oldcontext);
+  return tupstore;
+}
+
+/**
+ * Flattening
+ *
+ * When the numbering plan only contains digits, a prefix is the interval
+ * of numbers it contains once they are all padded to PR_FLAT_DIGITS
+ * digits, and the longest prefix match is the innermost interval
+ * containing the number.
+ *
+ * prefix_range_flatten() turns the nested prefixes into disjoint [lo, hi)
+ * int8 intervals, each of them tagged with the longest prefix covering
+ * it, so that a single B-tree descent on lo is enough to find the match:
+ * that's prefix_range_flat_lookup().
+ *
+ * Numbers are right padded with '0', so that a number shorter than the
+ * prefix it's compared to might match it: the flattened table is meant
+ * for full length numbers.
+ */
+#define PR_FLAT_DIGITS 18
+
+Datum prefix_range_flatten(PG_FUNCTION_ARGS);
+Datum prefix_range_flat_key(PG_FUNCTION_ARGS);
+Datum prefix_range_flat_lookup(PG_FUNCTION_ARGS);
+
+static const int64 pr_flat_pow10[PR_FLAT_DIGITS + 1] = {
+  INT64CONST(1),
+  INT64CONST(10),
+  INT64CONST(100),
+  INT64CONST(1000),
+  INT64CONST(10000),
+  INT64CONST(100000),
+  INT64CONST(1000000),
+  INT64CONST(10000000),
+  INT64CONST(100000000),
+  INT64CONST(1000000000),
+  INT64CONST(10000000000),
+  INT64CONST(100000000000),
+  INT64CONST(1000000000000),
+  INT64CONST(10000000000000),
+  INT64CONST(100000000000000),
+  INT64CONST(1000000000000000),
+  INT64CONST(10000000000000000),
+  INT64CONST(100000000000000000),
+  INT64CONST(1000000000000000000)
+};
+
+typedef struct {
+  int64 lo;
+  int64 hi;
+  prefix_range *pr;
+} pr_flat_interval;
+
+#define PR_IS_DIGIT(c) ((c) >= '0' && (c) <= '9')
+
+static inline
+void pr_flat_bounds(prefix_range *pr, int64 *lo, int64 *hi) {
+  int len   = strlen(pr->prefix);
+  int width = pr->first != 0 ? len + 1 : len;
+  int64 v   = 0;
+  int i;
+
+  if( width > PR_FLAT_DIGITS )
+    ereport(ERROR,
+	    (errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+	     errmsg("prefix_range \"%s\" is longer than %d digits",
+		    pr_to_str(pr),
+		    PR_FLAT_DIGITS)));
+
+  for(i=0; i<len && PR_IS_DIGIT(pr->prefix[i]); i++)
+    v = v * 10 + (pr->prefix[i] - '0');
+
+  if( i < len
+      || (pr->first != 0 && !(PR_IS_DIGIT(pr->first) && PR_IS_DIGIT(pr->last))) )
+    ereport(ERROR,
+	    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+	     errmsg("prefix_range \"%s\" does not contain only digits",
+		    pr_to_str(pr))));
+
+  if( pr->first != 0 ) {
+    *lo = (v * 10 + (pr->first - '0'))    * pr_flat_pow10[PR_FLAT_DIGITS - width];
+    *hi = (v * 10 + (pr->last - '0') + 1) * pr_flat_pow10[PR_FLAT_DIGITS - width];
+  }
+  else {
+    *lo = v       * pr_flat_pow10[PR_FLAT_DIGITS - width];
+    *hi = (v + 1) * pr_flat_pow10[PR_FLAT_DIGITS - width];
+  }
+}
+
+static inline
+int64 pr_flat_key(const char *number, int len) {
+  int64 key = 0;
+  int i;
+
+  for(i=0; i<PR_FLAT_DIGITS; i++) {
+    if( i < len ) {
+      if( !PR_IS_DIGIT(number[i]) )
+	ereport(ERROR,
+		(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		 errmsg("number \"%.*s\" does not contain only digits",
+			len, number)));
+      key = key * 10 + (number[i] - '0');
+    }
+    else
+      key = key * 10;
+  }
+  return key;
+}
+
+/*
+ * Intervals are sorted by lo then larger first, so that enclosing
+ * intervals come before the ones they contain. When two prefixes give
+ * the same interval, as '1' and '1[0-9]' do, the longer one wins.
+ */
+static int pr_flat_cmp(const void *a, const void *b) {
+  const pr_flat_interval *i1 = (const pr_flat_interval *)a;
+  const pr_flat_interval *i2 = (const pr_flat_interval *)b;
+
+  if( i1->lo != i2->lo )
+    return i1->lo < i2->lo ? -1 : 1;
+
+  if( i1->hi != i2->hi )
+    return i1->hi > i2->hi ? -1 : 1;
+
+  return pr_length(i1->pr) - pr_length(i2->pr);
+}
+
+static inline
+void pr_flat_emit(Tuplestorestate *tupstore, TupleDesc tupdesc,
+		  int64 lo, int64 hi, prefix_range *pr) {
+  Datum values[3];
+  bool  nulls[3] = {false, false, false};
+
+  if( lo >= hi )
+    return;
+
+  values[0] = Int64GetDatum(lo);
+  values[1] = Int64GetDatum(hi);
+  values[2] = PrefixRangeGetDatum(pr);
+
+  tuplestore_puttuple(tupstore, heap_form_tuple(tupdesc, values, nulls));
+}
+
+/*
+ * prefix_range_flatten(regclass [, column text])
+ *
+ * The column defaults to "prefix", as in the documentation. We sweep the
+ * sorted intervals keeping a stack of the enclosing ones, emitting the
+ * part of the stack top we are leaving each time an interval is opened
+ * or closed.
+ */
+PG_FUNCTION_INFO_V1(prefix_range_flatten);
+Datum
+prefix_range_flatten(PG_FUNCTION_ARGS)
+{
+  Oid relid = PG_GETARG_OID(0);
+  char *column = PG_NARGS() > 1 ?
+    DatumGetCString(DirectFunctionCall1(textout, PG_GETARG_DATUM(1))) : "prefix";
+
+  TupleDesc tupdesc;
+  Tuplestorestate *tupstore = pr_srf_materialize(fcinfo, &tupdesc);
+  MemoryContext oldcontext;
+
+  prefix_range **prs;
+  pr_flat_interval *intervals, *cur, *top;
+  pr_flat_interval **stack;
+  int n, i, depth = 0;
+  int64 pos = 0;
+
+  prs = pr_fetch_column(relid, column, &n);
+  intervals = (pr_flat_interval *) palloc((n + 1) * sizeof(pr_flat_interval));
+  stack     = (pr_flat_interval **) palloc((n + 1) * sizeof(pr_flat_interval *));
+
+  for(i=0; i<n; i++) {
+    intervals[i].pr = prs[i];
+    pr_flat_bounds(prs[i], &intervals[i].lo, &intervals[i].hi);
+  }
+  qsort(intervals, n, sizeof(pr_flat_interval), pr_flat_cmp);
+
+  oldcontext = MemoryContextSwitchTo(((ReturnSetInfo *) fcinfo->resultinfo)->econtext->ecxt_per_query_memory);
+
+  for(i=0; i<n; i++) {
+    cur = &intervals[i];
+
+    while( depth > 0 && stack[depth-1]->hi <= cur->lo ) {
+      top = stack[--depth];
+      pr_flat_emit(tupstore, tupdesc, pos, top->hi, top->pr);
+      pos = top->hi;
+    }
+
+    if( depth > 0 ) {
+      top = stack[depth-1];
+
+      if( cur->hi > top->hi )
+	ereport(ERROR,
+		(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		 errmsg("prefix_range \"%s\" and \"%s\" overlap without nesting",
+			pr_to_str(top->pr),
+			pr_to_str(cur->pr))));
+
+      if( cur->lo == top->lo && cur->hi == top->hi ) {
+	stack[depth-1] = cur;
+	continue;
+      }
+      pr_flat_emit(tupstore, tupdesc, pos, cur->lo, top->pr);
+    }
+    pos = cur->lo;
+    stack[depth++] = cur;
+  }
+
+  while( depth > 0 ) {
+    top = stack[--depth];
+    pr_flat_emit(tupstore, tupdesc, pos, top->hi, top->pr);
+    pos = top->hi;
+  }
+  MemoryContextSwitchTo(oldcontext);
+
+  tuplestore_donestoring(tupstore);
+  return (Datum) 0;
+}
+
+PG_FUNCTION_INFO_V1(prefix_range_flat_key);
+Datum
+prefix_range_flat_key(PG_FUNCTION_ARGS)
+{
+  text *number = PREFIX_PG_GETARG_TEXT(0);
+
+  PG_RETURN_INT64( pr_flat_key(PREFIX_VARDATA(number),
+			       PREFIX_VARSIZE(number)) );
+}
+
+/*
+ * prefix_range_flat_lookup(index regclass, number text)
+ *
+ * The index must be a btree whose first column is the lo column of a
+ * flattened table, which also has the hi and prefix columns. Scanning
+ * backward from lo <= key gets the only interval which may contain the
+ * number in a single descent, no ORDER BY nor LIMIT needed. As with a
+ * query, the caller needs SELECT on the table.
+ */
+PG_FUNCTION_INFO_V1(prefix_range_flat_lookup);
+Datum
+prefix_range_flat_lookup(PG_FUNCTION_ARGS)
+{
+  Oid indexoid = PG_GETARG_OID(0);
+  text *number = PREFIX_PG_GETARG_TEXT(1);
+  int64 key    = pr_flat_key(PREFIX_VARDATA(number), PREFIX_VARSIZE(number));
+
+  Relation index, heap;
+  TupleDesc tupdesc;
+  IndexScanDesc scan;
+  ScanKeyData skey;
+  HeapTuple tuple;
+  int hiattno, prattno;
+  Datum value;
+  bool isnull;
+  struct varlena *result = NULL;
+  AclResult aclresult;
+
+  index = pr_index_open(indexoid, AccessShareLock);
+
+  aclresult = pg_class_aclcheck(index->rd_index->indrelid, GetUserId(), ACL_SELECT);
+  if( aclresult != ACLCHECK_OK )
+    aclcheck_error(aclresult, ACL_KIND_CLASS,
+		   get_rel_name(index->rd_index->indrelid));
+
+  heap  = heap_open(index->rd_index->indrelid, AccessShareLock);
+  tupdesc = RelationGetDescr(heap);
+
+  hiattno = SPI_fnumber(tupdesc, "hi");
+  prattno = SPI_fnumber(tupdesc, "prefix");
+
+  if( index->rd_rel->relam != BTREE_AM_OID
+      || index->rd_att->attrs[0]->atttypid != INT8OID
+      || hiattno <= 0 || prattno <= 0 )
+    ereport(ERROR,
+	    (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+	     errmsg("\"%s\" is not a btree index on lo of a flattened prefix_range table",
+		    RelationGetRelationName(index))));
+
+  ScanKeyInit(&skey, 1, BTLessEqualStrategyNumber, F_INT8LE, Int64GetDatum(key));
+
+#if PG_MAJOR_VERSION >= 804
+  scan = index_beginscan(heap, index, GetActiveSnapshot(), 1, &skey);
+#else
+  scan = index_beginscan(heap, index, ActiveSnapshot, 1, &skey);
+#endif
+
+  tuple = index_getnext(scan, BackwardScanDirection);
+
+  if( tuple != NULL ) {
+    value = heap_getattr(tuple, hiattno, tupdesc, &isnull);
+
+    if( !isnull && key < DatumGetInt64(value) ) {
+      value = heap_getattr(tuple, prattno, tupdesc, &isnull);
+
+      if( !isnull )
+	result = PG_DETOAST_DATUM_COPY(value);
+    }
+  }
+
+  index_endscan(scan);
+  heap_close(heap, AccessShareLock);
+  pr_index_close(index, AccessShareLock);
+
+  if( result == NULL )
+    PG_RETURN_NULL();
+
+  PG_RETURN_POINTER(result);
+}
+
+/**
+ * keyed_prefix_range is a (key, prefix_range) composite, where the key is
+ * typically a carrier or tenant id, so that one GiST index serves
+ * lookups such as carrier_id = $1 AND prefix @> $2 while keeping each
+ * carrier's prefixes in their own subtree.
+ *
+ * Values have kmin = kmax, the index inner keys are the [kmin, kmax] range
+ * of the keys found below and the union of the prefixes. The penalty and
+ * picksplit functions partition on the key first.
+ *
+ * The type is declared with STORAGE = plain and ALIGNMENT = int4, so
+ * that values are never packed and VARDATA is aligned.
+ */
+typedef struct {
+  int32 kmin;
+  int32 kmax;
+  prefix_range pr; /* varlena structure, data follows */
+} keyed_prefix_range;
+
+#define KPR_HDRSZ                   (offsetof(keyed_prefix_range, pr))
+#define DatumGetKeyedPrefixRange(X) ((keyed_prefix_range *) VARDATA(DatumGetPointer(X)))
+#define KeyedPrefixRangeGetDatum(X) PointerGetDatum(make_keyed_varlena((X)->kmin, (X)->kmax, &(X)->pr))
+#define PG_GETARG_KEYED_PREFIX_RANGE_P(n) DatumGetKeyedPrefixRange(PG_DETOAST_DATUM(PG_GETARG_DATUM(n)))
+
+/*
+ * Penalty given to any key range growth, above what __pr_penalty() can
+ * return, so that we always prefer a subtree of the same key.
+ */
+#define KPR_KEY_PENALTY 256.0
+
+Datum keyed_prefix_range_in(PG_FUNCTION_ARGS);
+Datum keyed_prefix_range_out(PG_FUNCTION_ARGS);
+Datum keyed_prefix_range_init(PG_FUNCTION_ARGS);
+Datum keyed_prefix_range_eq(PG_FUNCTION_ARGS);
+Datum keyed_prefix_range_contains(PG_FUNCTION_ARGS);
+Datum keyed_prefix_range_contained_by(PG_FUNCTION_ARGS);
+Datum keyed_prefix_range_overlaps(PG_FUNCTION_ARGS);
+Datum gkpr_consistent(PG_FUNCTION_ARGS);
+Datum gkpr_union(PG_FUNCTION_ARGS);
+Datum gkpr_penalty(PG_FUNCTION_ARGS);
+Datum gkpr_picksplit(PG_FUNCTION_ARGS);
+Datum gkpr_same(PG_FUNCTION_ARGS);
+
+static inline
+struct varlena *make_keyed_varlena(int32 kmin, int32 kmax, prefix_range *pr) {
+  int size = VARHDRSZ + KPR_HDRSZ + sizeof(prefix_range) + strlen(pr->prefix) + 1;
+  struct varlena *vdat = palloc(size);
+  keyed_prefix_range *kpr = (keyed_prefix_range *) VARDATA(vdat);
+
+  PREFIX_SET_VARSIZE(vdat, size);
+  kpr->kmin = kmin;
+  kpr->kmax = kmax;
+  memcpy(&kpr->pr, pr, size - VARHDRSZ - KPR_HDRSZ);
+
+  return vdat;
+}
+
+static inline
+bool kpr_eq(keyed_prefix_range *a, keyed_prefix_range *b) {
+  return a->kmin == b->kmin && a->kmax == b->kmax && pr_eq(&a->pr, &b->pr);
+}
+
+static inline
+bool kpr_contains(keyed_prefix_range *left, keyed_prefix_range *right) {
+  return left->kmin <= right->kmin && right->kmax <= left->kmax
+    && pr_contains(&left->pr, &right->pr, true);
+}
+
+static inline
+bool kpr_overlaps(keyed_prefix_range *a, keyed_prefix_range *b) {
+  return a->kmin <= b->kmax && b->kmin <= a->kmax
+    && pr_overlaps(&a->pr, &b->pr);
+}
+
+/*
+ * Text representation is key:prefix_range, or kmin-kmax:prefix_range for
+ * the index inner keys.
+ */
+PG_FUNCTION_INFO_V1(keyed_prefix_range_in);
+Datum
+keyed_prefix_range_in(PG_FUNCTION_ARGS)
+{
+  char *str = PG_GETARG_CSTRING(0);
+  char *ptr;
+  long kmin, kmax;
+  struct varlena *pr = NULL;
+
+  kmin = kmax = strtol(str, &ptr, 10);
+
+  if( ptr != str && *ptr == '-' ) {
+    char *start = ptr + 1;
+    kmax = strtol(start, &ptr, 10);
+    if( ptr == start )
+      ptr = str;
+  }
+
+  if( ptr != str && *ptr == ':' && kmin <= kmax
+      && kmin >= INT_MIN && kmax <= INT_MAX )
+    pr = pr_varlena_from_str(ptr + 1, strlen(ptr + 1));
+
+  if( pr == NULL )
+    ereport(ERROR,
+	    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+	     errmsg("invalid keyed_prefix_range value: \"%s\"", str)));
+
+  PG_RETURN_POINTER(make_keyed_varlena((int32) kmin, (int32) kmax,
+				       DatumGetPrefixRange(pr)));
+}
+
+PG_FUNCTION_INFO_V1(keyed_prefix_range_out);
+Datum
+keyed_prefix_range_out(PG_FUNCTION_ARGS)
+{
+  keyed_prefix_range *kpr = PG_GETARG_KEYED_PREFIX_RANGE_P(0);
+  StringInfoData buf;
+
+  initStringInfo(&buf);
+
+  if( kpr->kmin == kpr->kmax )
+    appendStringInfo(&buf, "%d:%s", kpr->kmin, pr_to_str(&kpr->pr));
+  else
+    appendStringInfo(&buf, "%d-%d:%s", kpr->kmin, kpr->kmax, pr_to_str(&kpr->pr));
+
+  PG_RETURN_CSTRING(buf.data);
+}
+
+PG_FUNCTION_INFO_V1(keyed_prefix_range_init);
+Datum
+keyed_prefix_range_init(PG_FUNCTION_ARGS)
+{
+  int32 key = PG_GETARG_INT32(0);
+
+  PG_RETURN_POINTER(make_keyed_varlena(key, key, PG_GETARG_PREFIX_RANGE_P(1)));
+}
+
+PG_FUNCTION_INFO_V1(keyed_prefix_range_eq);
+Datum
+keyed_prefix_range_eq(PG_FUNCTION_ARGS)
+{
+  PG_RETURN_BOOL( kpr_eq(PG_GETARG_KEYED_PREFIX_RANGE_P(0),
+			 PG_GETARG_KEYED_PREFIX_RANGE_P(1)) );
+}
+
+PG_FUNCTION_INFO_V1(keyed_prefix_range_contains);
+Datum
+keyed_prefix_range_contains(PG_FUNCTION_ARGS)
+{
+  PG_RETURN_BOOL( kpr_contains(PG_GETARG_KEYED_PREFIX_RANGE_P(0),
+			       PG_GETARG_KEYED_PREFIX_RANGE_P(1)) );
+}
+
+PG_FUNCTION_INFO_V1(keyed_prefix_range_contained_by);
+Datum
+keyed_prefix_range_contained_by(PG_FUNCTION_ARGS)
+{
+  PG_RETURN_BOOL( kpr_contains(PG_GETARG_KEYED_PREFIX_RANGE_P(1),
+			       PG_GETARG_KEYED_PREFIX_RANGE_P(0)) );
+}
+
+PG_FUNCTION_INFO_V1(keyed_prefix_range_overlaps);
+Datum
+keyed_prefix_range_overlaps(PG_FUNCTION_ARGS)
+{
+  PG_RETURN_BOOL( kpr_overlaps(PG_GETARG_KEYED_PREFIX_RANGE_P(0),
+			       PG_GETARG_KEYED_PREFIX_RANGE_P(1)) );
+}
+
+/*
+ * GiST support for keyed_prefix_range, using the same strategy numbers
+ * as gist_prefix_range_ops. On inner pages, <@ has to check for overlap
+ * only, as the subtree may contain values contained by the query.
+ */
+PG_FUNCTION_INFO_V1(gkpr_consistent);
+Datum
+gkpr_consistent(PG_FUNCTION_ARGS)
+{
+    GISTENTRY *entry = (GISTENTRY *) PG_GETARG_POINTER(0);
+    keyed_prefix_range *query = PG_GETARG_KEYED_PREFIX_RANGE_P(1);
+    StrategyNumber strategy = (StrategyNumber) PG_GETARG_UINT16(2);
+    keyed_prefix_range *key = DatumGetKeyedPrefixRange(entry->key);
+    bool *recheck;
+
+    if( PG_NARGS() == 5 ) {
+      recheck  = (bool *) PG_GETARG_POINTER(4);
+      *recheck = false;
+    }
+
+    switch( strategy ) {
+    case 1:
+      PG_RETURN_BOOL( kpr_contains(key, query) );
+
+    case 2:
+      if( GIST_LEAF(entry) )
+	PG_RETURN_BOOL( kpr_contains(query, key) );
+      PG_RETURN_BOOL( kpr_overlaps(key, query) );
+
+    case 3:
+      if( GIST_LEAF(entry) )
+	PG_RETURN_BOOL( kpr_eq(key, query) );
+      PG_RETURN_BOOL( kpr_contains(key, query) );
+
+    case 4:
+      PG_RETURN_BOOL( kpr_overlaps(key, query) );
+
+    default:
+      PG_RETURN_BOOL( false );
+    }
+}
+
+static inline
+keyed_prefix_range *kpr_union(keyed_prefix_range *a, keyed_prefix_range *b) {
+  return DatumGetKeyedPrefixRange(PointerGetDatum(
+    make_keyed_varlena(a->kmin < b->kmin ? a->kmin : b->kmin,
+		       a->kmax > b->kmax ? a->kmax : b->kmax,
+		       pr_union(&a->pr, &b->pr))));
+}
+
+PG_FUNCTION_INFO_V1(gkpr_union);
+Datum
+gkpr_union(PG_FUNCTION_ARGS)
+{
+    GistEntryVector *entryvec = (GistEntryVector *) PG_GETARG_POINTER(0);
+    GISTENTRY *ent = entryvec->vector;
+    keyed_prefix_range *out;
+    int i;
+
+    out = DatumGetKeyedPrefixRange(ent[0].key);
+
+    for (i = 1; i < entryvec->n; i++)
+      out = kpr_union(out, DatumGetKeyedPrefixRange(ent[i].key));
+
+    PG_RETURN_DATUM( KeyedPrefixRangeGetDatum(out) );
+}
+
+static
+float __kpr_penalty(keyed_prefix_range *orig, keyed_prefix_range *new) {
+  float grow = 0;
+
+  if( new->kmin < orig->kmin )
+    grow += (float) orig->kmin - (float) new->kmin;
+
+  if( new->kmax > orig->kmax )
+    grow += (float) new->kmax - (float) orig->kmax;
+
+  if( grow > 0 )
+    return KPR_KEY_PENALTY + grow;
+
+  return __pr_penalty(&orig->pr, &new->pr);
+}
+
+PG_FUNCTION_INFO_V1(gkpr_penalty);
+Datum
+gkpr_penalty(PG_FUNCTION_ARGS)
+{
+  GISTENTRY *origentry = (GISTENTRY *) PG_GETARG_POINTER(0);
+  GISTENTRY *newentry = (GISTENTRY *) PG_GETARG_POINTER(1);
+  float *penalty = (float *) PG_GETARG_POINTER(2);
+
+  *penalty = __kpr_penalty(DatumGetKeyedPrefixRange(origentry->key),
+			   DatumGetKeyedPrefixRange(newentry->key));
+  PG_RETURN_POINTER(penalty);
+}
+
+static int kpr_entry_cmp(const void *a, const void *b) {
+  keyed_prefix_range *k1 = DatumGetKeyedPrefixRange((*(GISTENTRY **)a)->key);
+  keyed_prefix_range *k2 = DatumGetKeyedPrefixRange((*(GISTENTRY **)b)->key);
+
+  if( k1->kmin != k2->kmin )
+    return k1->kmin < k2->kmin ? -1 : 1;
+
+  if( k1->kmax != k2->kmax )
+    return k1->kmax < k2->kmax ? -1 : 1;
+
+  return pr_cmp(&k1->pr, &k2->pr);
+}
+
+/*
+ * Split a vector of composite keys on their prefix_range part only, found
+ * at the given offset from the key pointer. The union datums are left as
+ * prefix_range, for the caller to wrap.
+ */
+static
+void pr_picksplit_at(GistEntryVector *entryvec, GIST_SPLITVEC *v, Size offset) {
+  OffsetNumber maxoff = entryvec->n - 1;
+  OffsetNumber off;
+  GistEntryVector *prvec = (GistEntryVector *)
+    palloc(GEVHDRSZ + entryvec->n * sizeof(GISTENTRY));
+
+  prvec->n = entryvec->n;
+  for(off = FirstOffsetNumber; off <= maxoff; off = OffsetNumberNext(off)) {
+    prvec->vector[off] = entryvec->vector[off];
+    prvec->vector[off].key = PrefixRangeGetDatum(
+      (prefix_range *) (DatumGetPointer(entryvec->vector[off].key) + offset));
+  }
+  pr_picksplit(prvec, v, false);
+}
+
+/*
+ * When all the entries share the same key, the split is the prefix_range
+ * one, done on a temporary vector of the prefixes. Otherwise we sort the
+ * entries on their keys and cut at the key boundary which is the nearest
+ * to the middle, so that a key is only spread over several pages when
+ * it has more entries than fit in one.
+ */
+PG_FUNCTION_INFO_V1(gkpr_picksplit);
+Datum
+gkpr_picksplit(PG_FUNCTION_ARGS)
+{
+    GistEntryVector *entryvec = (GistEntryVector *) PG_GETARG_POINTER(0);
+    GIST_SPLITVEC *v = (GIST_SPLITVEC *) PG_GETARG_POINTER(1);
+    OffsetNumber maxoff = entryvec->n - 1;
+    GISTENTRY *ent = entryvec->vector;
+    GISTENTRY **sorted;
+    keyed_prefix_range *cur, *prev, *unionL = NULL, *unionR = NULL;
+    int32 kmin, kmax;
+    int nbytes, i, cut, best = -1;
+    OffsetNumber off;
+
+    kmin = DatumGetKeyedPrefixRange(ent[FirstOffsetNumber].key)->kmin;
+    kmax = DatumGetKeyedPrefixRange(ent[FirstOffsetNumber].key)->kmax;
+
+    for(off = FirstOffsetNumber; off <= maxoff; off = OffsetNumberNext(off)) {
+      cur = DatumGetKeyedPrefixRange(ent[off].key);
+      if( cur->kmin < kmin ) kmin = cur->kmin;
+      if( cur->kmax > kmax ) kmax = cur->kmax;
+    }
+
+    if( kmin == kmax ) {
+      pr_picksplit_at(entryvec, v, VARHDRSZ + KPR_HDRSZ);
+
+      v->spl_ldatum = PointerGetDatum(
+	make_keyed_varlena(kmin, kmax, DatumGetPrefixRange(v->spl_ldatum)));
+      v->spl_rdatum = PointerGetDatum(
+	make_keyed_varlena(kmin, kmax, DatumGetPrefixRange(v->spl_rdatum)));
+
+      PG_RETURN_POINTER(v);
+    }
+
+    sorted = (GISTENTRY **) palloc(entryvec->n * sizeof(GISTENTRY *));
+    for(off = FirstOffsetNumber; off <= maxoff; off = OffsetNumberNext(off))
+      sorted[off - FirstOffsetNumber] = &ent[off];
+
+    qsort(sorted, maxoff, sizeof(GISTENTRY *), kpr_entry_cmp);
+
+    /*
+     * Find the key boundary the nearest to the middle, there is one as
+     * we know the entries don't all have the same key.
+     */
+    cut = maxoff / 2;
+    for(i = 1; i < maxoff; i++) {
+      prev = DatumGetKeyedPrefixRange(sorted[i-1]->key);
+      cur  = DatumGetKeyedPrefixRange(sorted[i]->key);
+
+      if( prev->kmin != cur->kmin )
+	if( best < 0 || abs(i - cut) < abs(best - cut) )
+	  best = i;
+    }
+    if( best > 0 )
+      cut = best;
+    if( cut < 1 )
+      cut = 1;
+
+    nbytes = (maxoff + 1) * sizeof(OffsetNumber);
+    v->spl_left   = (OffsetNumber *) palloc(nbytes);
+    v->spl_right  = (OffsetNumber *) palloc(nbytes);
+    v->spl_nleft  = 0;
+    v->spl_nright = 0;
+
+    for(i = 0; i < maxoff; i++) {
+      cur = DatumGetKeyedPrefixRange(sorted[i]->key);
+      off = (OffsetNumber) (sorted[i] - ent);
+
+      if( i < cut ) {
+	unionL = unionL == NULL ? cur : kpr_union(unionL, cur);
+	v->spl_left[v->spl_nleft++] = off;
+      }
+      else {
+	unionR = unionR == NULL ? cur : kpr_union(unionR, cur);
+	v->spl_right[v->spl_nright++] = off;
+      }
+    }
+
+    v->spl_ldatum = KeyedPrefixRangeGetDatum(unionL);
+    v->spl_rdatum = KeyedPrefixRangeGetDatum(unionR);
+
+    PG_RETURN_POINTER(v);
+}
+
+PG_FUNCTION_INFO_V1(gkpr_same);
+Datum
+gkpr_same(PG_FUNCTION_ARGS)
+{
+    keyed_prefix_range *v1 = PG_GETARG_KEYED_PREFIX_RANGE_P(0);
+    keyed_prefix_range *v2 = PG_GETARG_KEYED_PREFIX_RANGE_P(1);
+    bool *result = (bool *) PG_GETARG_POINTER(2);
+
+    *result = kpr_eq(v1, v2);
+    PG_RETURN_POINTER( result );
+}
+
+/**
+ * timed_prefix_range is a prefix_range with a [vfrom, vuntil) validity
+ * period, so that one GiST index serves historical rating queries such
+ * as prefix @> $1 AND valid_from <= $2 AND $2 < valid_until, touching
+ * only the versions of the matching prefixes valid at call time.
+ *
+ * The query side is usually an instant, which is a period where vfrom
+ * equals vuntil, contained in [vfrom, vuntil) when vfrom <= t < vuntil.
+ * Periods are unbounded with -infinity and infinity.
+ *
+ * As TimestampTz needs double alignment, the struct includes the varlena
+ * header, and the type is declared with STORAGE = plain.
+ */
+typedef struct {
+  int32 vl_len_;         /* varlena header (do not touch directly!) */
+  TimestampTz vfrom;
+  TimestampTz vuntil;
+  prefix_range pr;       /* varlena structure, data follows */
+} timed_prefix_range;
+
+#define DatumGetTimedPrefixRange(X) ((timed_prefix_range *) DatumGetPointer(X))
+#define TimedPrefixRangeGetDatum(X) PointerGetDatum(make_timed_varlena((X)->vfrom, (X)->vuntil, &(X)->pr))
+#define PG_GETARG_TIMED_PREFIX_RANGE_P(n) DatumGetTimedPrefixRange(PG_DETOAST_DATUM(PG_GETARG_DATUM(n)))
+
+Datum timed_prefix_range_in(PG_FUNCTION_ARGS);
+Datum timed_prefix_range_out(PG_FUNCTION_ARGS);
+Datum timed_prefix_range_init(PG_FUNCTION_ARGS);
+Datum timed_prefix_range_eq(PG_FUNCTION_ARGS);
+Datum timed_prefix_range_contains(PG_FUNCTION_ARGS);
+Datum timed_prefix_range_contained_by(PG_FUNCTION_ARGS);
+Datum timed_prefix_range_overlaps(PG_FUNCTION_ARGS);
+Datum gtpr_consistent(PG_FUNCTION_ARGS);
+Datum gtpr_union(PG_FUNCTION_ARGS);
+Datum gtpr_penalty(PG_FUNCTION_ARGS);
+Datum gtpr_picksplit(PG_FUNCTION_ARGS);
+Datum gtpr_same(PG_FUNCTION_ARGS);
+
+static inline
+timed_prefix_range *make_timed_varlena(TimestampTz vfrom, TimestampTz vuntil,
+				       prefix_range *pr) {
+  int size = offsetof(timed_prefix_range, pr) + sizeof(prefix_range) + strlen(pr->prefix) + 1;
+  timed_prefix_range *tpr = (timed_prefix_range *) palloc(size);
+
+  PREFIX_SET_VARSIZE(tpr, size);
+  tpr->vfrom  = vfrom;
+  tpr->vuntil = vuntil;
+  memcpy(&tpr->pr, pr, size - offsetof(timed_prefix_range, pr));
+
+  return tpr;
+}
+
+/*
+ * Is t before the end of the given period?
+ */
+static inline
+bool tpr_before_end(TimestampTz t, timed_prefix_range *p) {
+  return p->vfrom == p->vuntil ? t <= p->vuntil : t < p->vuntil;
+}
+
+static inline
+bool tpr_eq(timed_prefix_range *a, timed_prefix_range *b) {
+  return a->vfrom == b->vfrom && a->vuntil == b->vuntil && pr_eq(&a->pr, &b->pr);
+}
+
+static inline
+bool tpr_contains(timed_prefix_range *left, timed_prefix_range *right) {
+  if( left->vfrom > right->vfrom )
+    return false;
+
+  if( right->vfrom == right->vuntil ) {
+    if( !tpr_before_end(right->vfrom, left) )
+      return false;
+  }
+  else if( right->vuntil > left->vuntil )
+    return false;
+
+  return pr_contains(&left->pr, &right->pr, true);
+}
+
+static inline
+bool tpr_overlaps(timed_prefix_range *a, timed_prefix_range *b) {
+  return tpr_before_end(a->vfrom, b) && tpr_before_end(b->vfrom, a)
+    && pr_overlaps(&a->pr, &b->pr);
+}
+
+/*
+ * Index inner keys are the [min(vfrom), max(vuntil)] closed period of the
+ * keys found below, so that an instant is never lost at a period bound.
+ */
+static inline
+bool tpr_inner_contains(timed_prefix_range *key, timed_prefix_range *query) {
+  return key->vfrom <= query->vfrom && query->vuntil <= key->vuntil
+    && pr_contains(&key->pr, &query->pr, true);
+}
+
+static inline
+bool tpr_inner_overlaps(timed_prefix_range *key, timed_prefix_range *query) {
+  return key->vfrom <= query->vuntil && query->vfrom <= key->vuntil
+    && pr_overlaps(&key->pr, &query->pr);
+}
+
+static inline
+timed_prefix_range *tpr_check(TimestampTz vfrom, TimestampTz vuntil, prefix_range *pr) {
+  if( vfrom > vuntil )
+    ereport(ERROR,
+	    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+	     errmsg("timed_prefix_range period lower bound must not be after its upper bound")));
+
+  return make_timed_varlena(vfrom, vuntil, pr);
+}
+
+static inline
+TimestampTz tpr_timestamp_in(char *str) {
+  return DatumGetTimestampTz(DirectFunctionCall3(timestamptz_in,
+						 CStringGetDatum(str),
+						 ObjectIdGetDatum(InvalidOid),
+						 Int32GetDatum(-1)));
+}
+
+static inline
+char *tpr_timestamp_out(TimestampTz t) {
+  return DatumGetCString(DirectFunctionCall1(timestamptz_out,
+					     TimestampTzGetDatum(t)));
+}
+
+/*
+ * Text representation is prefix_range@[vfrom,vuntil) for a period and
+ * prefix_range@[t] for an instant.
+ */
+PG_FUNCTION_INFO_V1(timed_prefix_range_in);
+Datum
+timed_prefix_range_in(PG_FUNCTION_ARGS)
+{
+  char *str = PG_GETARG_CSTRING(0);
+  char *at = NULL, *ptr, *sep = NULL, *end = NULL;
+  struct varlena *pr = NULL;
+  TimestampTz vfrom, vuntil;
+
+  for(ptr = strchr(str, '@'); ptr != NULL; ptr = strchr(ptr + 1, '@'))
+    if( ptr[1] == '[' )
+      at = ptr;
+
+  if( at != NULL ) {
+    pr  = pr_varlena_from_str(str, at - str);
+    ptr = pstrdup(at + 2);
+    end = ptr + strlen(ptr) - 1;
+    sep = strchr(ptr, ',');
+
+    if( end < ptr || (sep == NULL ? *end != ']' : *end != ')') )
+      pr = NULL;
+  }
+
+  if( pr == NULL )
+    ereport(ERROR,
+	    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+	     errmsg("invalid timed_prefix_range value: \"%s\"", str)));
+
+  *end = '\0';
+  if( sep == NULL )
+    vfrom = vuntil = tpr_timestamp_in(ptr);
+  else {
+    *sep   = '\0';
+    vfrom  = tpr_timestamp_in(ptr);
+    vuntil = tpr_timestamp_in(sep + 1);
+  }
+
+  PG_RETURN_POINTER(tpr_check(vfrom, vuntil, DatumGetPrefixRange(pr)));
+}
+
+PG_FUNCTION_INFO_V1(timed_prefix_range_out);
+Datum
+timed_prefix_range_out(PG_FUNCTION_ARGS)
+{
+  timed_prefix_range *tpr = PG_GETARG_TIMED_PREFIX_RANGE_P(0);
+  StringInfoData buf;
+
+  initStringInfo(&buf);
+  appendStringInfo(&buf, "%s@[%s", pr_to_str(&tpr->pr), tpr_timestamp_out(tpr->vfrom));
+
+  if( tpr->vfrom == tpr->vuntil )
+    appendStringInfoChar(&buf, ']');
+  else
+    appendStringInfo(&buf, ",%s)", tpr_timestamp_out(tpr->vuntil));
+
+  PG_RETURN_CSTRING(buf.data);
+}
+
+/*
+ * timed_prefix_range(prefix, vfrom, vuntil) or timed_prefix_range(prefix, t)
+ */
+PG_FUNCTION_INFO_V1(timed_prefix_range_init);
+Datum
+timed_prefix_range_init(PG_FUNCTION_ARGS)
+{
+  TimestampTz vfrom = PG_GETARG_TIMESTAMPTZ(1);
+  TimestampTz vuntil = PG_NARGS() == 3 ? PG_GETARG_TIMESTAMPTZ(2) : vfrom;
+
+  PG_RETURN_POINTER(tpr_check(vfrom, vuntil, PG_GETARG_PREFIX_RANGE_P(0)));
+}
+
+PG_FUNCTION_INFO_V1(timed_prefix_range_eq);
+Datum
+timed_prefix_range_eq(PG_FUNCTION_ARGS)
+{
+  PG_RETURN_BOOL( tpr_eq(PG_GETARG_TIMED_PREFIX_RANGE_P(0),
+			 PG_GETARG_TIMED_PREFIX_RANGE_P(1)) );
+}
+
+PG_FUNCTION_INFO_V1(timed_prefix_range_contains);
+Datum
+timed_prefix_range_contains(PG_FUNCTION_ARGS)
+{
+  PG_RETURN_BOOL( tpr_contains(PG_GETARG_TIMED_PREFIX_RANGE_P(0),
+			       PG_GETARG_TIMED_PREFIX_RANGE_P(1)) );
+}
+
+PG_FUNCTION_INFO_V1(timed_prefix_range_contained_by);
+Datum
+timed_prefix_range_contained_by(PG_FUNCTION_ARGS)
+{
+  PG_RETURN_BOOL( tpr_contains(PG_GETARG_TIMED_PREFIX_RANGE_P(1),
+			       PG_GETARG_TIMED_PREFIX_RANGE_P(0)) );
+}
+
+PG_FUNCTION_INFO_V1(timed_prefix_range_overlaps);
+Datum
+timed_prefix_range_overlaps(PG_FUNCTION_ARGS)
+{
+  PG_RETURN_BOOL( tpr_overlaps(PG_GETARG_TIMED_PREFIX_RANGE_P(0),
+			       PG_GETARG_TIMED_PREFIX_RANGE_P(1)) );
+}
+
+/*
+ * GiST support for timed_prefix_range, same strategy numbers as
+ * gist_prefix_range_ops.
+ */
+PG_FUNCTION_INFO_V1(gtpr_consistent);
+Datum
+gtpr_consistent(PG_FUNCTION_ARGS)
+{
+    GISTENTRY *entry = (GISTENTRY *) PG_GETARG_POINTER(0);
+    timed_prefix_range *query = PG_GETARG_TIMED_PREFIX_RANGE_P(1);
+    StrategyNumber strategy = (StrategyNumber) PG_GETARG_UINT16(2);
+    timed_prefix_range *key = DatumGetTimedPrefixRange(entry->key);
+    bool *recheck;
+
+    if( PG_NARGS() == 5 ) {
+      recheck  = (bool *) PG_GETARG_POINTER(4);
+      *recheck = false;
+    }
+
+    if( !GIST_LEAF(entry) ) {
+      switch( strategy ) {
+      case 1:
+      case 3:
+	PG_RETURN_BOOL( tpr_inner_contains(key, query) );
+
+      case 2:
+      case 4:
+	PG_RETURN_BOOL( tpr_inner_overlaps(key, query) );
+
+      default:
+	PG_RETURN_BOOL( false );
+      }
+    }
+
+    switch( strategy ) {
+    case 1:
+      PG_RETURN_BOOL( tpr_contains(key, query) );
+
+    case 2:
+      PG_RETURN_BOOL( tpr_contains(query, key) );
+
+    case 3:
+      PG_RETURN_BOOL( tpr_eq(key, query) );
+
+    case 4:
+      PG_RETURN_BOOL( tpr_overlaps(key, query) );
+
+    default:
+      PG_RETURN_BOOL( false );
+    }
+}
+
+static inline
+timed_prefix_range *tpr_union(timed_prefix_range *a, timed_prefix_range *b) {
+  return make_timed_varlena(a->vfrom < b->vfrom ? a->vfrom : b->vfrom,
+			    a->vuntil > b->vuntil ? a->vuntil : b->vuntil,
+			    pr_union(&a->pr, &b->pr));
+}
+
+PG_FUNCTION_INFO_V1(gtpr_union);
+Datum
+gtpr_union(PG_FUNCTION_ARGS)
+{
+    GistEntryVector *entryvec = (GistEntryVector *) PG_GETARG_POINTER(0);
+    GISTENTRY *ent = entryvec->vector;
+    timed_prefix_range *out;
+    int i;
+
+    out = DatumGetTimedPrefixRange(ent[0].key);
+
+    for (i = 1; i < entryvec->n; i++)
+      out = tpr_union(out, DatumGetTimedPrefixRange(ent[i].key));
+
+    PG_RETURN_DATUM( TimedPrefixRangeGetDatum(out) );
+}
+
+/*
+ * The prefix penalty is multiplied by 1 plus the period growth ratio, so
+ * that the prefix distance, which is a factor 256 per common character,
+ * decides first, then the period growth chooses among close prefixes.
+ */
+static
+float __tpr_penalty(timed_prefix_range *orig, timed_prefix_range *new) {
+  double grow = 0, ratio = 0;
+
+  if( new->vfrom < orig->vfrom )
+    grow += (double) orig->vfrom - (double) new->vfrom;
+
+  if( new->vuntil > orig->vuntil )
+    grow += (double) new->vuntil - (double) orig->vuntil;
+
+  if( grow > 0 ) {
+    ratio = grow / (grow + (double) orig->vuntil - (double) orig->vfrom);
+
+    /* infinite bounds */
+    if( !(ratio >= 0 && ratio <= 1) )
+      ratio = 1;
+  }
+
+  return __pr_penalty(&orig->pr, &new->pr) * (1 + (float) ratio);
+}
+
+PG_FUNCTION_INFO_V1(gtpr_penalty);
+Datum
+gtpr_penalty(PG_FUNCTION_ARGS)
+{
+  GISTENTRY *origentry = (GISTENTRY *) PG_GETARG_POINTER(0);
+  GISTENTRY *newentry = (GISTENTRY *) PG_GETARG_POINTER(1);
+  float *penalty = (float *) PG_GETARG_POINTER(2);
+
+  *penalty = __tpr_penalty(DatumGetTimedPrefixRange(origentry->key),
+			   DatumGetTimedPrefixRange(newentry->key));
+  PG_RETURN_POINTER(penalty);
+}
+
+static int tpr_entry_cmp(const void *a, const void *b) {
+  timed_prefix_range *t1 = DatumGetTimedPrefixRange((*(GISTENTRY **)a)->key);
+  timed_prefix_range *t2 = DatumGetTimedPrefixRange((*(GISTENTRY **)b)->key);
+
+  if( t1->vfrom != t2->vfrom )
+    return t1->vfrom < t2->vfrom ? -1 : 1;
+
+  if( t1->vuntil != t2->vuntil )
+    return t1->vuntil < t2->vuntil ? -1 : 1;
+
+  return 0;
+}
+
+/*
+ * When the page holds several prefixes, the split is the prefix_range
+ * one, and the page unions get the period of their entries. When it's
+ * all versions of the same prefix, they are split in the middle of the
+ * time line instead.
+ */
+PG_FUNCTION_INFO_V1(gtpr_picksplit);
+Datum
+gtpr_picksplit(PG_FUNCTION_ARGS)
+{
+    GistEntryVector *entryvec = (GistEntryVector *) PG_GETARG_POINTER(0);
+    GIST_SPLITVEC *v = (GIST_SPLITVEC *) PG_GETARG_POINTER(1);
+    OffsetNumber maxoff = entryvec->n - 1;
+    GISTENTRY *ent = entryvec->vector;
+    GISTENTRY **sorted;
+    timed_prefix_range *first, *cur, *unionL = NULL, *unionR = NULL;
+    bool same = true;
+    int nbytes, i;
+    OffsetNumber off;
+
+    first = DatumGetTimedPrefixRange(ent[FirstOffsetNumber].key);
+    for(off = OffsetNumberNext(FirstOffsetNumber); same && off <= maxoff;
+	off = OffsetNumberNext(off))
+      same = pr_eq(&first->pr, &DatumGetTimedPrefixRange(ent[off].key)->pr);
+
+    if( !same ) {
+      pr_picksplit_at(entryvec, v, offsetof(timed_prefix_range, pr));
+
+      for(i = 0; i < v->spl_nleft; i++) {
+	cur = DatumGetTimedPrefixRange(ent[v->spl_left[i]].key);
+	unionL = unionL == NULL ? cur : tpr_union(unionL, cur);
+      }
+      for(i = 0; i < v->spl_nright; i++) {
+	cur = DatumGetTimedPrefixRange(ent[v->spl_right[i]].key);
+	unionR = unionR == NULL ? cur : tpr_union(unionR, cur);
+      }
+      v->spl_ldatum = TimedPrefixRangeGetDatum(unionL);
+      v->spl_rdatum = TimedPrefixRangeGetDatum(unionR);
+
+      PG_RETURN_POINTER(v);
+    }
+
+    sorted = (GISTENTRY **) palloc(entryvec->n * sizeof(GISTENTRY *));
+    for(off = FirstOffsetNumber; off <= maxoff; off = OffsetNumberNext(off))
+      sorted[off - FirstOffsetNumber] = &ent[off];
+
+    qsort(sorted, maxoff, sizeof(GISTENTRY *), tpr_entry_cmp);
+
+    nbytes = (maxoff + 1) * sizeof(OffsetNumber);
+    v->spl_left   = (OffsetNumber *) palloc(nbytes);
+    v->spl_right  = (OffsetNumber *) palloc(nbytes);
+    v->spl_nleft  = 0;
+    v->spl_nright = 0;
+
+    for(i = 0; i < maxoff; i++) {
+      cur = DatumGetTimedPrefixRange(sorted[i]->key);
+      off = (OffsetNumber) (sorted[i] - ent);
+
+      if( i < maxoff / 2 ) {
+	unionL = unionL == NULL ? cur : tpr_union(unionL, cur);
+	v->spl_left[v->spl_nleft++] = off;
+      }
+      else {
+	unionR = unionR == NULL ? cur : tpr_union(unionR, cur);
+	v->spl_right[v->spl_nright++] = off;
+      }
+    }
+
+    v->spl_ldatum = TimedPrefixRangeGetDatum(unionL);
+    v->spl_rdatum = TimedPrefixRangeGetDatum(unionR);
+
+    PG_RETURN_POINTER(v);
+}
+
+PG_FUNCTION_INFO_V1(gtpr_same);
+Datum
+gtpr_same(PG_FUNCTION_ARGS)
+{
+    timed_prefix_range *v1 = PG_GETARG_TIMED_PREFIX_RANGE_P(0);
+    timed_prefix_range *v2 = PG_GETARG_TIMED_PREFIX_RANGE_P(1);
+    bool *result = (bool *) PG_GETARG_POINTER(2);
+
+    *result = tpr_eq(v1, v2);
+    PG_RETURN_POINTER( result );
+}
+
+/**
+ * Least cost routing: the longest prefix match of a number in each of
+ * the given carrier tables, returned cheapest first.
+ *
+ * The number is parsed once, as a prefix_range, and each table is probed
+ * with a saved plan using its prefix index.
+ */
+typedef struct {
+  Oid relid;
+  int pos;
+  Datum prefix;
+  Datum cost;
+  bool costnull;
+} pr_lcr_route;
+
+Datum prefix_lcr(PG_FUNCTION_ARGS);
+
+/**
+ * The saved plans of the lookup functions, cached in TopMemoryContext for
+ * the backend lifetime and keyed by the table oid and the query text. The
+ * query names the table with its schema, so that a replan can't find
+ * another table in the search_path, and the plan of a dropped table is
+ * never used again.
+ */
+typedef struct pr_saved_plan {
+  Oid relid;
+  Oid argtype;
+  char *query;
+  void *plan;
+  struct pr_saved_plan *next;
+} pr_saved_plan;
+
+static pr_saved_plan *pr_saved_plans = NULL;
+
+static
+char *pr_qualified_relname(Oid relid) {
+  char *relname = get_rel_name(relid);
+  char *nspname = get_namespace_name(get_rel_namespace(relid));
+
+  if( relname == NULL || nspname == NULL )
+    elog(ERROR, "cache lookup failed for relation %u", relid);
+
+  return quote_qualified_identifier(nspname, relname);
+}
+
+static
+void *pr_get_saved_plan(Oid relid, Oid argtype, const char *query) {
+  pr_saved_plan *p;
+  void *plan;
+
+  for(p = pr_saved_plans; p != NULL; p = p->next)
+    if( p->relid == relid && p->argtype == argtype
+	&& strcmp(p->query, query) == 0 )
+      return p->plan;
+
+  plan = SPI_prepare(query, 1, &argtype);
+  if( plan == NULL )
+    elog(ERROR, "SPI_prepare failed: %s", query);
+
+  p = (pr_saved_plan *) MemoryContextAlloc(TopMemoryContext,
+					   sizeof(pr_saved_plan));
+  p->relid   = relid;
+  p->argtype = argtype;
+  p->query   = MemoryContextStrdup(TopMemoryContext, query);
+  p->plan    = SPI_saveplan(plan);
+  p->next    = pr_saved_plans;
+  pr_saved_plans = p;
+
+  SPI_freeplan(plan);
+
+  return p->plan;
+}
+
+/*
+ * The prefix column is cast, as a text column would do as well, and it
+ * is then read as a prefix_range.
+ */
+static
+void *pr_lcr_get_plan(Oid relid, Oid prtypid, Name cost, Name prefix) {
+  StringInfoData query;
+  void *plan;
+  char *col;
+
+  col = pstrdup(quote_identifier(NameStr(*prefix)));
+
+  initStringInfo(&query);
+  appendStringInfo(&query,
+		   "SELECT %s::prefix_range, %s::numeric FROM %s WHERE %s @> $1 "
+		   "ORDER BY length(%s) DESC LIMIT 1",
+		   col, quote_identifier(NameStr(*cost)),
+		   pr_qualified_relname(relid), col, col);
+
+  plan = pr_get_saved_plan(relid, prtypid, query.data);
+  pfree(query.data);
+
+  return plan;
+}
+
+/*
+ * Cheapest first, routes without a cost last, then in the order the
+ * tables were given.
+ */
+static int pr_lcr_cmp(const void *a, const void *b) {
+  const pr_lcr_route *r1 = (const pr_lcr_route *) a;
+  const pr_lcr_route *r2 = (const pr_lcr_route *) b;
+  int cmp;
+
+  if( r1->costnull != r2->costnull )
+    return r1->costnull ? 1 : -1;
+
+  if( !r1->costnull ) {
+    cmp = DatumGetInt32(DirectFunctionCall2(numeric_cmp, r1->cost, r2->cost));
+    if( cmp != 0 )
+      return cmp;
+  }
+  return r1->pos - r2->pos;
+}
+
+/*
+ * prefix_lcr(number text, tables regclass[], cost name [, prefix name])
+ *   RETURNS SETOF (carrier regclass, prefix prefix_range, cost numeric)
+ */
+PG_FUNCTION_INFO_V1(prefix_lcr);
+Datum
+prefix_lcr(PG_FUNCTION_ARGS)
+{
+  text *number = PREFIX_PG_GETARG_TEXT(0);
+  ArrayType *tables = PG_GETARG_ARRAYTYPE_P(1);
+  Name cost = PG_GETARG_NAME(2);
+  Name prefix;
+  NameData defprefix;
+
+  TupleDesc tupdesc;
+  Tuplestorestate *tupstore = pr_srf_materialize(fcinfo, &tupdesc);
+  MemoryContext callcontext = CurrentMemoryContext, oldcontext;
+
+  Oid prtypid = tupdesc->attrs[1]->atttypid;
+  struct varlena *query;
+  Datum *relids, value, values[3];
+  bool isnull, nulls[3] = {false, false, false};
+  pr_lcr_route *routes;
+  int n, nroutes = 0, i;
+
+  if( PG_NARGS() > 3 )
+    prefix = PG_GETARG_NAME(3);
+  else {
+    namestrcpy(&defprefix, "prefix");
+    prefix = &defprefix;
+  }
+
+  query = pr_varlena_from_str(PREFIX_VARDATA(number), PREFIX_VARSIZE(number));
+  if( query == NULL )
+    ereport(ERROR,
+	    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+	     errmsg("invalid prefix_range value: \"%.*s\"",
+		    PREFIX_VARSIZE(number), PREFIX_VARDATA(number))));
+
+#if PG_MAJOR_VERSION >= 802
+  deconstruct_array(tables, REGCLASSOID, sizeof(Oid), true, 'i',
+		    &relids, NULL, &n);
+#else
+  deconstruct_array(tables, REGCLASSOID, sizeof(Oid), true, 'i',
+		    &relids, &n);
+#endif
+  routes = (pr_lcr_route *) palloc((n + 1) * sizeof(pr_lcr_route));
+
+  if( SPI_connect() != SPI_OK_CONNECT )
+    elog(ERROR, "SPI_connect failed");
+
+  for(i = 0; i < n; i++) {
+    void *plan = pr_lcr_get_plan(DatumGetObjectId(relids[i]),
+				 prtypid, cost, prefix);
+    value = PointerGetDatum(query);
+
+    if( SPI_execute_plan(plan, &value, NULL, true, 1) != SPI_OK_SELECT )
+      elog(ERROR, "SPI_execute_plan failed");
+
+    if( SPI_processed == 0 )
+      continue;
+
+    oldcontext = MemoryContextSwitchTo(callcontext);
+
+    routes[nroutes].relid = DatumGetObjectId(relids[i]);
+    routes[nroutes].pos   = i;
+
+    value = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull);
+    routes[nroutes].prefix = PointerGetDatum(PG_DETOAST_DATUM_COPY(value));
+
+    value = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 2, &isnull);
+    routes[nroutes].costnull = isnull;
+    if( !isnull )
+      routes[nroutes].cost = PointerGetDatum(PG_DETOAST_DATUM_COPY(value));
+
+    MemoryContextSwitchTo(oldcontext);
+    nroutes++;
+  }
+
+  SPI_finish();
+
+  qsort(routes, nroutes, sizeof(pr_lcr_route), pr_lcr_cmp);
+
+  for(i = 0; i < nroutes; i++) {
+    values[0] = ObjectIdGetDatum(routes[i].relid);
+    values[1] = routes[i].prefix;
+    values[2] = routes[i].cost;
+    nulls[2]  = routes[i].costnull;
+
+    tuplestore_puttuple(tupstore, heap_form_tuple(tupdesc, values, nulls));
+  }
+
+  return (Datum) 0;
+}
+
+/**
+ * Routing with ported numbers: an exact number overlay on top of the
+ * prefixes. prefix_range_route(number, ported, prefixes) returns the
+ * prefix column of the ported table row having this number, if any, and
+ * the longest prefix match of the number in the prefixes table
+ * otherwise, in one call.
+ *
+ * Both probes are saved plans, cached as the prefix_lcr() ones are, and
+ * the ported table probe is an equality on its number column, so that
+ * it's done with a hash or a btree index on it, and the overlay is an
+ * ordinary table, updated in place.
+ */
+Datum prefix_range_route(PG_FUNCTION_ARGS);
+
+static
+void *pr_route_get_plan(Oid relid, Oid argtype, Name prefix, Name number) {
+  StringInfoData query;
+  char *table, *col;
+  void *plan;
+
+  table = pr_qualified_relname(relid);
+  col   = pstrdup(quote_identifier(NameStr(*prefix)));
+
+  initStringInfo(&query);
+  if( number != NULL )
+    appendStringInfo(&query,
+		     "SELECT %s::prefix_range FROM %s WHERE %s = $1 LIMIT 1",
+		     col, table, quote_identifier(NameStr(*number)));
+  else
+    appendStringInfo(&query,
+		     "SELECT %s::prefix_range FROM %s WHERE %s @> $1 "
+		     "ORDER BY length(%s) DESC LIMIT 1",
+		     col, table, col, col);
+
+  plan = pr_get_saved_plan(relid, argtype, query.data);
+  pfree(query.data);
+
+  return plan;
+}
+
+/*
+ * prefix_range_route(number text, ported regclass, prefixes regclass
+ *                    [, prefix name [, number name]]) RETURNS prefix_range
+ */
+PG_FUNCTION_INFO_V1(prefix_range_route);
+Datum
+prefix_range_route(PG_FUNCTION_ARGS)
+{
+  text *number  = PREFIX_PG_GETARG_TEXT(0);
+  Oid ported    = PG_GETARG_OID(1);
+  Oid prefixes  = PG_GETARG_OID(2);
+  Oid prtypid   = get_fn_expr_rettype(fcinfo->flinfo);
+  MemoryContext callcontext = CurrentMemoryContext, oldcontext;
+  struct varlena *query;
+  Name prefix, numcol;
+  NameData defprefix, defnumcol;
+  Datum value, result = (Datum) 0;
+  bool isnull = true;
+  void *plan;
+
+  if( PG_NARGS() > 3 )
+    prefix = PG_GETARG_NAME(3);
+  else {
+    namestrcpy(&defprefix, "prefix");
+    prefix = &defprefix;
+  }
+
+  if( PG_NARGS() > 4 )
+    numcol = PG_GETARG_NAME(4);
+  else {
+    namestrcpy(&defnumcol, "number");
+    numcol = &defnumcol;
+  }
+
+  query = pr_varlena_from_str(PREFIX_VARDATA(number), PREFIX_VARSIZE(number));
+  if( query == NULL )
+    ereport(ERROR,
+	    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+	     errmsg("invalid prefix_range value: \"%.*s\"",
+		    PREFIX_VARSIZE(number), PREFIX_VARDATA(number))));
+
+  if( SPI_connect() != SPI_OK_CONNECT )
+    elog(ERROR, "SPI_connect failed");
+
+  plan  = pr_route_get_plan(ported, TEXTOID, prefix, numcol);
+  value = PointerGetDatum(number);
+
+  if( SPI_execute_plan(plan, &value, NULL, true, 1) != SPI_OK_SELECT )
+    elog(ERROR, "SPI_execute_plan failed");
+
+  if( SPI_processed == 0 ) {
+    plan  = pr_route_get_plan(prefixes, prtypid, prefix, NULL);
+    value = PointerGetDatum(query);
+
+    if( SPI_execute_plan(plan, &value, NULL, true, 1) != SPI_OK_SELECT )
+      elog(ERROR, "SPI_execute_plan failed");
+  }
+
+  if( SPI_processed > 0 ) {
+    value = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull);
+
+    if( !isnull ) {
+      oldcontext = MemoryContextSwitchTo(callcontext);
+      result = PointerGetDatum(PG_DETOAST_DATUM_COPY(value));
+      MemoryContextSwitchTo(oldcontext);
+    }
+  }
+
+  SPI_finish();
+
+  if( isnull )
+    PG_RETURN_NULL();
+
+  PG_RETURN_DATUM(result);
+}
+
+/**
+ * Numbering plan validation: all the pairs of overlapping prefixes of a
+ * table, in a single sweep rather than a self join on &&.
+ *
+ * The strings of a prefix_range are the [lo, hi) interval, in byte
+ * order, of prefix_range_lower() and prefix_range_upper(). Sorting on lo
+ * then on hi descending is the trie order, where a range comes before
+ * the ranges it contains, and the ranges overlapping the current one
+ * are exactly the previous ones whose hi is still after its lo. We keep
+ * those in an active list, and each pair is reported once as
+ * 'duplicate', 'shadowed' (the second range is within the first one,
+ * and wins the longest prefix match there) or 'overlap'.
+ */
+typedef struct {
+  prefix_range *pr;
+  unsigned char *lo;
+  unsigned char *hi;
+  int lolen;
+  int hilen;          /* -1 when unbounded */
+} pr_sweep_item;
+
+Datum prefix_range_conflicts(PG_FUNCTION_ARGS);
+
+static inline
+int pr_bound_cmp(unsigned char *a, int alen, unsigned char *b, int blen) {
+  int cmp;
+
+  if( alen < 0 || blen < 0 )
+    return alen < 0 ? (blen < 0 ? 0 : 1) : -1;
+
+  cmp = memcmp(a, b, alen < blen ? alen : blen);
+  return cmp != 0 ? cmp : alen - blen;
+}
+
+static
+void pr_sweep_bounds(prefix_range *pr, pr_sweep_item *item) {
+  int plen = strlen(pr->prefix);
+  int len  = pr->first != 0 ? plen + 1 : plen;
+
+  item->pr = pr;
+  item->lo = (unsigned char *) palloc(len + 1);
+  item->hi = (unsigned char *) palloc(len + 1);
+  item->lolen = item->hilen = len;
+
+  memcpy(item->lo, pr->prefix, plen);
+  memcpy(item->hi, pr->prefix, plen);
+
+  if( pr->first != 0 ) {
+    item->lo[plen] = (unsigned char) pr->first;
+    item->hi[plen] = (unsigned char) pr->last;
+  }
+
+  while( item->hilen > 0 && item->hi[item->hilen - 1] == 0xFF )
+    item->hilen--;
+
+  if( item->hilen == 0 )
+    item->hilen = -1;
+  else
+    item->hi[item->hilen - 1]++;
+}
+
+static int pr_sweep_cmp(const void *a, const void *b) {
+  const pr_sweep_item *i1 = (const pr_sweep_item *) a;
+  const pr_sweep_item *i2 = (const pr_sweep_item *) b;
+  int cmp = pr_bound_cmp(i1->lo, i1->lolen, i2->lo, i2->lolen);
+
+  if( cmp != 0 )
+    return cmp;
+
+  return pr_bound_cmp(i2->hi, i2->hilen, i1->hi, i1->hilen);
+}
+
+/*
+ * prefix_range_conflicts(regclass [, column text])
+ *   RETURNS SETOF (a prefix_range, b prefix_range, conflict text)
+ */
+PG_FUNCTION_INFO_V1(prefix_range_conflicts);
+Datum
+prefix_range_conflicts(PG_FUNCTION_ARGS)
+{
+  Oid relid = PG_GETARG_OID(0);
+  char *column = PG_NARGS() > 1 ?
+    DatumGetCString(DirectFunctionCall1(textout, PG_GETARG_DATUM(1))) : "prefix";
+
+  TupleDesc tupdesc;
+  Tuplestorestate *tupstore = pr_srf_materialize(fcinfo, &tupdesc);
+
+  prefix_range **prs;
+  pr_sweep_item *items, *cur, **active;
+  int n, i, j, nactive = 0, kept;
+  Datum values[3];
+  bool nulls[3] = {false, false, false};
+  char *conflict;
+
+  prs    = pr_fetch_column(relid, column, &n);
+  items  = (pr_sweep_item *) palloc((n + 1) * sizeof(pr_sweep_item));
+  active = (pr_sweep_item **) palloc((n + 1) * sizeof(pr_sweep_item *));
+
+  for(i=0; i<n; i++)
+    pr_sweep_bounds(prs[i], &items[i]);
+
+  qsort(items, n, sizeof(pr_sweep_item), pr_sweep_cmp);
+
+  for(i=0; i<n; i++) {
+    cur = &items[i];
+
+    for(j=0, kept=0; j<nactive; j++) {
+      if( pr_bound_cmp(active[j]->hi, active[j]->hilen, cur->lo, cur->lolen) <= 0 )
+	continue;
+
+      active[kept++] = active[j];
+
+      if( pr_eq(active[j]->pr, cur->pr) )
+	conflict = "duplicate";
+      else if( pr_contains(active[j]->pr, cur->pr, true) )
+	conflict = "shadowed";
+      else
+	conflict = "overlap";
+
+      values[0] = PrefixRangeGetDatum(active[j]->pr);
+      values[1] = PrefixRangeGetDatum(cur->pr);
+      values[2] = DirectFunctionCall1(textin, CStringGetDatum(conflict));
+
+      tuplestore_puttuple(tupstore, heap_form_tuple(tupdesc, values, nulls));
+    }
+    active[kept++] = cur;
+    nactive = kept;
+  }
+
+  return (Datum) 0;
+}
+
+/**
+ * Merge containment join
+ *
+ * numbers JOIN prefixes ON prefix @> number can only be a nested loop,
+ * as @> has no merge nor hash strategy. With the numbers read in byte
+ * order and the prefixes sorted in trie order, the prefixes containing a
+ * number are the ones whose lo is before it and whose hi is still after
+ * it, so we merge both lists keeping a stack of the open prefixes, the
+ * innermost on top. A number leaving a prefix leaves it for good, so the
+ * stack is compacted as we go, and the join is linear in the size of
+ * both inputs plus the output.
+ *
+ * The numbers are streamed from a cursor, ORDER BY number USING ~<~,
+ * and are plain strings: a number which reads as a prefix_range is
+ * compared as text.
+ */
+#define PR_MERGE_FETCH 1000
+
+Datum prefix_range_merge_join(PG_FUNCTION_ARGS);
+
+/*
+ * prefix_range_merge_join(numbers regclass, prefixes regclass,
+ *                         longest bool [, number text, prefix text])
+ *   RETURNS SETOF (number text, prefix prefix_range)
+ *
+ * When longest is true, only the longest prefix match of each number is
+ * returned.
+ */
+PG_FUNCTION_INFO_V1(prefix_range_merge_join);
+Datum
+prefix_range_merge_join(PG_FUNCTION_ARGS)
+{
+  Oid numrelid = PG_GETARG_OID(0);
+  Oid prrelid  = PG_GETARG_OID(1);
+  bool longest = PG_GETARG_BOOL(2);
+  char *numcol = PG_NARGS() > 3 ?
+    DatumGetCString(DirectFunctionCall1(textout, PG_GETARG_DATUM(3))) : "number";
+  char *prcol  = PG_NARGS() > 4 ?
+    DatumGetCString(DirectFunctionCall1(textout, PG_GETARG_DATUM(4))) : "prefix";
+
+  TupleDesc tupdesc;
+  Tuplestorestate *tupstore = pr_srf_materialize(fcinfo, &tupdesc);
+  MemoryContext callcontext = CurrentMemoryContext, oldcontext;
+
+  prefix_range **prs;
+  pr_sweep_item *items, **stack;
+  StringInfoData query;
+  void *plan;
+  Portal portal;
+  text *number;
+  Datum value, values[2];
+  bool isnull, nulls[2] = {false, false};
+  int n, next = 0, depth = 0, kept, nlen, i, j;
+  unsigned char *num;
+
+  prs   = pr_fetch_column(prrelid, prcol, &n);
+  items = (pr_sweep_item *) palloc((n + 1) * sizeof(pr_sweep_item));
+  stack = (pr_sweep_item **) palloc((n + 1) * sizeof(pr_sweep_item *));
+
+  for(i=0; i<n; i++)
+    pr_sweep_bounds(prs[i], &items[i]);
+
+  qsort(items, n, sizeof(pr_sweep_item), pr_sweep_cmp);
+
+  initStringInfo(&query);
+  appendStringInfo(&query,
+		   "SELECT %s::text FROM %s WHERE %s IS NOT NULL ORDER BY 1 USING ~<~",
+		   quote_identifier(numcol),
+		   DatumGetCString(DirectFunctionCall1(regclassout,
+						       ObjectIdGetDatum(numrelid))),
+		   quote_identifier(numcol));
+
+  if( SPI_connect() != SPI_OK_CONNECT )
+    elog(ERROR, "SPI_connect failed");
+
+  if( (plan = SPI_prepare(query.data, 0, NULL)) == NULL )
+    elog(ERROR, "SPI_prepare failed: %s", query.data);
+
+  portal = SPI_cursor_open(NULL, plan, NULL, NULL, true);
+
+  for(SPI_cursor_fetch(portal, true, PR_MERGE_FETCH);
+      SPI_processed > 0;
+      SPI_cursor_fetch(portal, true, PR_MERGE_FETCH)) {
+
+    for(i = 0; i < SPI_processed; i++) {
+      value  = SPI_getbinval(SPI_tuptable->vals[i],
+			     SPI_tuptable->tupdesc, 1, &isnull);
+      number = (text *) PREFIX_DETOAST_DATUM(value);
+      num    = (unsigned char *) PREFIX_VARDATA(number);
+      nlen   = PREFIX_VARSIZE(number);
+
+      /* open the prefixes starting before the number */
+      while( next < n
+	     && pr_bound_cmp(items[next].lo, items[next].lolen, num, nlen) <= 0 )
+	stack[depth++] = &items[next++];
+
+      /* close the prefixes ending before it, for good */
+      for(j = 0, kept = 0; j < depth; j++)
+	if( pr_bound_cmp(stack[j]->hi, stack[j]->hilen, num, nlen) > 0 )
+	  stack[kept++] = stack[j];
+      depth = kept;
+
+      if( depth == 0 )
+	continue;
+
+      oldcontext = MemoryContextSwitchTo(callcontext);
+      values[0] = PointerGetDatum(number);
+
+      for(j = longest ? depth - 1 : 0; j < depth; j++) {
+	values[1] = PrefixRangeGetDatum(stack[j]->pr);
+	tuplestore_puttuple(tupstore, heap_form_tuple(tupdesc, values, nulls));
+      }
+      MemoryContextSwitchTo(oldcontext);
+    }
+    SPI_freetuptable(SPI_tuptable);
+  }
+
+  SPI_cursor_close(portal);
+  SPI_finish();
+
+  return (Datum) 0;
+}
+
+/**
+ * Traffic rollup: prefix_rollup(number text, value numeric, max_depth int)
+ * sums the values at every level of the numbering tree, 0, 01, 014...,
+ * in one pass, and returns a prefix_rollup[] array with the calls count
+ * and the total of each prefix, in trie order. The first element is the
+ * empty prefix, for the grand total.
+ *
+ * The transition state is a trie where each number is counted only at
+ * its own node, max_depth characters deep at most, the totals of the
+ * parents are computed by the final function. The state lives in the
+ * aggregate memory context, which needs an internal transition type
+ * (8.4 and up).
+ */
+#if PG_MAJOR_VERSION >= 804
+
+typedef struct pr_rollup_node {
+  unsigned char c;
+  int64 calls;
+  bool hastotal;
+  Datum total;                       /* numeric */
+  struct pr_rollup_node *child;      /* sorted on c */
+  struct pr_rollup_node *next;
+} pr_rollup_node;
+
+typedef struct {
+  MemoryContext aggcontext;
+  int maxdepth;
+  int depth;                         /* deepest node, for the final */
+  int nnodes;
+  pr_rollup_node root;
+} pr_rollup_state;
+
+typedef struct {
+  TupleDesc tupdesc;
+  Datum *elems;
+  char *prefix;
+  int n;
+} pr_rollup_out;
+
+Datum prefix_rollup_trans(PG_FUNCTION_ARGS);
+Datum prefix_rollup_final(PG_FUNCTION_ARGS);
+
+static
+MemoryContext pr_rollup_aggcontext(FunctionCallInfo fcinfo) {
+  MemoryContext aggcontext = NULL;
+
+#if PG_MAJOR_VERSION >= 900
+  if( !AggCheckCallContext(fcinfo, &aggcontext) )
+    aggcontext = NULL;
+#else
+  if( fcinfo->context && IsA(fcinfo->context, AggState) )
+    aggcontext = ((AggState *) fcinfo->context)->aggcontext;
+#endif
+
+  if( aggcontext == NULL )
+    elog(ERROR, "prefix_rollup_trans called in non-aggregate context");
+
+  return aggcontext;
+}
+
+static inline
+pr_rollup_node *pr_rollup_child(pr_rollup_state *state,
+				pr_rollup_node *node, unsigned char c) {
+  pr_rollup_node **link = &node->child, *child;
+
+  while( *link != NULL && (*link)->c < c )
+    link = &(*link)->next;
+
+  if( *link != NULL && (*link)->c == c )
+    return *link;
+
+  child = (pr_rollup_node *)
+    MemoryContextAllocZero(state->aggcontext, sizeof(pr_rollup_node));
+  child->c    = c;
+  child->next = *link;
+  *link       = child;
+  state->nnodes++;
+
+  return child;
+}
+
+PG_FUNCTION_INFO_V1(prefix_rollup_trans);
+Datum
+prefix_rollup_trans(PG_FUNCTION_ARGS)
+{
+  MemoryContext aggcontext = pr_rollup_aggcontext(fcinfo);
+  MemoryContext oldcontext;
+  pr_rollup_state *state;
+  pr_rollup_node *node;
+  text *number;
+  unsigned char *digits;
+  int len, i;
+
+  if( PG_ARGISNULL(0) ) {
+    if( PG_ARGISNULL(3) || PG_GETARG_INT32(3) < 0 )
+      ereport(ERROR,
+	      (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+	       errmsg("prefix_rollup max_depth must not be negative")));
+
+    state = (pr_rollup_state *)
+      MemoryContextAllocZero(aggcontext, sizeof(pr_rollup_state));
+    state->aggcontext = aggcontext;
+    state->maxdepth   = PG_GETARG_INT32(3);
+    state->nnodes     = 1;
+  }
+  else
+    state = (pr_rollup_state *) PG_GETARG_POINTER(0);
+
+  if( PG_ARGISNULL(1) )
+    PG_RETURN_POINTER(state);
+
+  number = PREFIX_PG_GETARG_TEXT(1);
+  digits = (unsigned char *) PREFIX_VARDATA(number);
+  len    = PREFIX_VARSIZE(number);
+  node   = &state->root;
+
+  for(i = 0; i < len && i < state->maxdepth; i++)
+    node = pr_rollup_child(state, node, digits[i]);
+
+  if( i > state->depth )
+    state->depth = i;
+
+  node->calls++;
+
+  if( !PG_ARGISNULL(2) ) {
+    oldcontext = MemoryContextSwitchTo(aggcontext);
+
+    if( node->hastotal ) {
+      Datum total = DirectFunctionCall2(numeric_add, node->total, PG_GETARG_DATUM(2));
+      pfree(DatumGetPointer(node->total));
+      node->total = total;
+    }
+    else {
+      node->total    = PointerGetDatum(PG_DETOAST_DATUM_COPY(PG_GETARG_DATUM(2)));
+      node->hastotal = true;
+    }
+    MemoryContextSwitchTo(oldcontext);
+  }
+
+  PG_RETURN_POINTER(state);
+}
+
+/*
+ * The element of a node is reserved before visiting its children, so
+ * that the array is in trie order, and filled once the subtree totals
+ * are known. The state is not modified, as a window aggregate calls the
+ * final function more than once. We recurse once per character of the
+ * longest number, which max_depth does not bound in practice.
+ */
+static
+void pr_rollup_emit(pr_rollup_node *node, int depth, pr_rollup_out *out,
+		    int64 *calls, Datum *total, bool *hastotal) {
+  pr_rollup_node *child;
+  int slot = out->n++;
+  int64 ccalls;
+  Datum ctotal, values[3];
+  bool chastotal, nulls[3] = {false, false, false};
+
+  check_stack_depth();
+
+  *calls    = node->calls;
+  *total    = node->total;
+  *hastotal = node->hastotal;
+
+  for(child = node->child; child != NULL; child = child->next) {
+    out->prefix[depth] = (char) child->c;
+    pr_rollup_emit(child, depth + 1, out, &ccalls, &ctotal, &chastotal);
+
+    *calls += ccalls;
+    if( chastotal ) {
+      *total = *hastotal ?
+	DirectFunctionCall2(numeric_add, *total, ctotal) : ctotal;
+      *hastotal = true;
+    }
+  }
+
+  values[0] = PointerGetDatum(cstring_to_text_with_len(out->prefix, depth));
+  values[1] = Int64GetDatum(*calls);
+  values[2] = *total;
+  nulls[2]  = !*hastotal;
+
+  out->elems[slot] = HeapTupleGetDatum(heap_form_tuple(out->tupdesc, values, nulls));
+}
+
+PG_FUNCTION_INFO_V1(prefix_rollup_final);
+Datum
+prefix_rollup_final(PG_FUNCTION_ARGS)
+{
+  pr_rollup_state *state;
+  pr_rollup_out out;
+  Oid elemtype;
+  TupleDesc tupdesc;
+  int64 calls;
+  Datum total;
+  bool hastotal;
+
+  if( PG_ARGISNULL(0) )
+    PG_RETURN_NULL();
+
+  state = (pr_rollup_state *) PG_GETARG_POINTER(0);
+
+  elemtype = get_element_type(get_fn_expr_rettype(fcinfo->flinfo));
+  if( !OidIsValid(elemtype) )
+    elog(ERROR, "prefix_rollup_final must return an array");
+
+  tupdesc = lookup_rowtype_tupdesc(elemtype, -1);
+  out.tupdesc = CreateTupleDescCopy(tupdesc);
+  ReleaseTupleDesc(tupdesc);
+
+  out.elems  = (Datum *) palloc(state->nnodes * sizeof(Datum));
+  out.prefix = (char *) palloc(state->depth + 1);
+  out.n      = 0;
+
+  pr_rollup_emit(&state->root, 0, &out, &calls, &total, &hastotal);
+
+  PG_RETURN_ARRAYTYPE_P(construct_array(out.elems, out.n, elemtype,
+					-1, false, 'd'));
+}
+
+#endif
+
+/**
+ * Incremental re-rating. When a prefix is added, removed or changed,
+ * only the numbers it contains may change their longest prefix match.
+ *
+ * The prefix_range_log_change(log table [, column]) trigger function
+ * records the old and new prefixes of the modified rows in a log table
+ * having a prefix column. prefix_range_affected(log) returns the
+ * minimal set of ranges covering the logged prefixes, and
+ * prefix_range_rerate(matches, prefixes, log) consumes the log and runs
+ * the longest prefix match again only for the numbers of the matches
+ * table contained in those ranges.
+ */
+typedef struct pr_log_plan {
+  Oid tgoid;
+  void *plan;
+  struct pr_log_plan *next;
+} pr_log_plan;
+
+static pr_log_plan *pr_log_plans = NULL;
+
+Datum prefix_range_log_change(PG_FUNCTION_ARGS);
+Datum prefix_range_affected(PG_FUNCTION_ARGS);
+Datum prefix_range_rerate(PG_FUNCTION_ARGS);
+
+static
+void *pr_log_get_plan(Trigger *trigger, Oid typid) {
+  pr_log_plan *p;
+  StringInfoData query;
+  Datum logrel;
+  void *plan;
+
+  for(p = pr_log_plans; p != NULL; p = p->next)
+    if( p->tgoid == trigger->tgoid )
+      return p->plan;
+
+  /* the argument is a table name, not a piece of SQL */
+  logrel = DirectFunctionCall1(regclassin, CStringGetDatum(trigger->tgargs[0]));
+
+  initStringInfo(&query);
+  appendStringInfo(&query, "INSERT INTO %s(prefix) VALUES ($1)",
+		   DatumGetCString(DirectFunctionCall1(regclassout, logrel)));
+
+  plan = SPI_prepare(query.data, 1, &typid);
+  if( plan == NULL )
+    elog(ERROR, "SPI_prepare failed: %s", query.data);
+
+  p = (pr_log_plan *) MemoryContextAlloc(TopMemoryContext, sizeof(pr_log_plan));
+  p->tgoid = trigger->tgoid;
+  p->plan  = SPI_saveplan(plan);
+  p->next  = pr_log_plans;
+  pr_log_plans = p;
+
+  SPI_freeplan(plan);
+  pfree(query.data);
+
+  return p->plan;
+}
+
+static inline
+bool pr_datum_same(Datum a, Datum b) {
+  struct varlena *va = PG_DETOAST_DATUM(a);
+  struct varlena *vb = PG_DETOAST_DATUM(b);
+
+  return VARSIZE(va) == VARSIZE(vb)
+    && memcmp(VARDATA(va), VARDATA(vb), VARSIZE(va) - VARHDRSZ) == 0;
+}
+
+PG_FUNCTION_INFO_V1(prefix_range_log_change);
+Datum
+prefix_range_log_change(PG_FUNCTION_ARGS)
+{
+  TriggerData *trigdata = (TriggerData *) fcinfo->context;
+  Trigger *trigger;
+  TupleDesc tupdesc;
+  HeapTuple rettuple;
+  Datum values[2];
+  bool nulls[2] = {true, true};
+  char *column;
+  void *plan;
+  int attno, i;
+
+  if( !CALLED_AS_TRIGGER(fcinfo) )
+    elog(ERROR, "prefix_range_log_change: not called by trigger manager");
+
+  if( !TRIGGER_FIRED_AFTER(trigdata->tg_event)
+      || !TRIGGER_FIRED_FOR_ROW(trigdata->tg_event) )
+    elog(ERROR, "prefix_range_log_change: must be fired AFTER ... FOR EACH ROW");
+
+  trigger = trigdata->tg_trigger;
+  if( trigger->tgnargs < 1 || trigger->tgnargs > 2 )
+    ereport(ERROR,
+	    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+	     errmsg("prefix_range_log_change expects a log table and an optional column name")));
+
+  column  = trigger->tgnargs > 1 ? trigger->tgargs[1] : "prefix";
+  tupdesc = trigdata->tg_relation->rd_att;
+  attno   = SPI_fnumber(tupdesc, column);
+
+  if( attno <= 0 )
+    ereport(ERROR,
+	    (errcode(ERRCODE_UNDEFINED_COLUMN),
+	     errmsg("column \"%s\" does not exist", column)));
+
+  rettuple = trigdata->tg_trigtuple;
+
+  if( TRIGGER_FIRED_BY_INSERT(trigdata->tg_event) )
+    values[1] = heap_getattr(trigdata->tg_trigtuple, attno, tupdesc, &nulls[1]);
+
+  else if( TRIGGER_FIRED_BY_DELETE(trigdata->tg_event) )
+    values[0] = heap_getattr(trigdata->tg_trigtuple, attno, tupdesc, &nulls[0]);
+
+  else {
+    values[0] = heap_getattr(trigdata->tg_trigtuple, attno, tupdesc, &nulls[0]);
+    values[1] = heap_getattr(trigdata->tg_newtuple, attno, tupdesc, &nulls[1]);
+    rettuple  = trigdata->tg_newtuple;
+
+    /* only the prefix matters to the matching */
+    if( nulls[0] && nulls[1] )
+      return PointerGetDatum(rettuple);
+
+    if( !nulls[0] && !nulls[1] && pr_datum_same(values[0], values[1]) )
+      return PointerGetDatum(rettuple);
+  }
+
+  if( SPI_connect() != SPI_OK_CONNECT )
+    elog(ERROR, "SPI_connect failed");
+
+  plan = pr_log_get_plan(trigger, SPI_gettypeid(tupdesc, attno));
+
+  for(i = 0; i < 2; i++)
+    if( !nulls[i] )
+      if( SPI_execute_plan(plan, &values[i], NULL, false, 0) != SPI_OK_INSERT )
+	elog(ERROR, "SPI_execute_plan failed");
+
+  SPI_finish();
+
+  return PointerGetDatum(rettuple);
+}
+
+/*
+ * Removes from prs the ranges contained by another one, in place, and
+ * returns how many are left. In the sweep order, a range is contained
+ * by one of the previous ranges if and only if it ends before the
+ * farthest end seen so far.
+ */
+static
+int pr_minimal_cover(prefix_range **prs, int n) {
+  pr_sweep_item *items = (pr_sweep_item *) palloc((n + 1) * sizeof(pr_sweep_item));
+  pr_sweep_item *farthest = NULL;
+  int i, ncover = 0;
+
+  for(i=0; i<n; i++)
+    pr_sweep_bounds(prs[i], &items[i]);
+
+  qsort(items, n, sizeof(pr_sweep_item), pr_sweep_cmp);
+
+  for(i=0; i<n; i++) {
+    if( farthest != NULL
+	&& pr_bound_cmp(items[i].hi, items[i].hilen,
+			farthest->hi, farthest->hilen) <= 0 )
+      continue;
+
+    prs[ncover++] = items[i].pr;
+    farthest = &items[i];
+  }
+  pfree(items);
+
+  return ncover;
+}
+
+PG_FUNCTION_INFO_V1(prefix_range_affected);
+Datum
+prefix_range_affected(PG_FUNCTION_ARGS)
+{
+  FuncCallContext *funcctx;
+  prefix_range **prs;
+
+  if( SRF_IS_FIRSTCALL() ) {
+    MemoryContext oldcontext;
+    int n;
+
+    funcctx    = SRF_FIRSTCALL_INIT();
+    oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+    prs = pr_fetch_column(PG_GETARG_OID(0), "prefix", &n);
+    funcctx->max_calls = pr_minimal_cover(prs, n);
+    funcctx->user_fctx = prs;
+
+    MemoryContextSwitchTo(oldcontext);
+  }
+
+  funcctx = SRF_PERCALL_SETUP();
+  prs     = (prefix_range **) funcctx->user_fctx;
+
+  if( funcctx->call_cntr < funcctx->max_calls )
+    SRF_RETURN_NEXT(funcctx, PrefixRangeGetDatum(prs[funcctx->call_cntr]));
+
+  SRF_RETURN_DONE(funcctx);
+}
+
+static inline
+text *pr_bound_text(unsigned char *bound, int len) {
+  text *t = (text *) palloc(VARHDRSZ + len);
+
+  PREFIX_SET_VARSIZE(t, VARHDRSZ + len);
+  memcpy(VARDATA(t), bound, len);
+  return t;
+}
+
+/*
+ * prefix_range_rerate(matches regclass, prefixes regclass, log regclass)
+ *
+ * The matches table has the number text and prefix prefix_range columns,
+ * the prefixes and log tables a prefix column. The log rows are deleted
+ * as they are read, so that changes committed meanwhile are kept for
+ * the next run. Returns the number of matches rows updated.
+ */
+PG_FUNCTION_INFO_V1(prefix_range_rerate);
+Datum
+prefix_range_rerate(PG_FUNCTION_ARGS)
+{
+  char *matches  = DatumGetCString(DirectFunctionCall1(regclassout, PG_GETARG_DATUM(0)));
+  char *prefixes = DatumGetCString(DirectFunctionCall1(regclassout, PG_GETARG_DATUM(1)));
+  char *log      = DatumGetCString(DirectFunctionCall1(regclassout, PG_GETARG_DATUM(2)));
+  StringInfoData query;
+  prefix_range **prs, *pr;
+  pr_sweep_item item;
+  Oid argtypes[2] = {TEXTOID, TEXTOID};
+  Datum value, values[2];
+  bool isnull;
+  void *plans[2] = {NULL, NULL};
+  int n = 0, ncover, i, bounded;
+  int64 updated = 0;
+
+  if( SPI_connect() != SPI_OK_CONNECT )
+    elog(ERROR, "SPI_connect failed");
+
+  initStringInfo(&query);
+  appendStringInfo(&query, "DELETE FROM %s RETURNING prefix", log);
+
+  if( SPI_execute(query.data, false, 0) != SPI_OK_DELETE_RETURNING )
+    elog(ERROR, "SPI_execute failed: %s", query.data);
+
+  prs   = (prefix_range **) palloc((SPI_processed + 1) * sizeof(prefix_range *));
+
+  for(i = 0; i < SPI_processed; i++) {
+    value = SPI_getbinval(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 1, &isnull);
+
+    if( !isnull ) {
+      pr = DatumGetPrefixRange(PG_DETOAST_DATUM(value));
+      prs[n++] = build_pr(pr->prefix, pr->first, pr->last);
+    }
+  }
+  ncover = pr_minimal_cover(prs, n);
+
+  /**
+   * The numbers within a range are the [lo, hi) interval of its bounds,
+   * which we give as such, so that both ends are index conditions on a
+   * text_pattern_ops index of the number and each update only visits
+   * the numbers of its range. The range has no hi bound when its
+   * prefix is all 0xFF bytes, or empty, hence the second plan.
+   */
+  for(i = 0; i < ncover; i++) {
+    pr_sweep_bounds(prs[i], &item);
+    bounded = item.hilen >= 0 ? 1 : 0;
+
+    if( plans[bounded] == NULL ) {
+      initStringInfo(&query);
+      appendStringInfo(&query,
+		       "UPDATE %s m SET prefix = "
+		       "(SELECT p.prefix FROM %s p WHERE p.prefix @> m.number "
+		       "ORDER BY length(p.prefix) DESC LIMIT 1) "
+		       "WHERE m.number ~>=~ $1%s",
+		       matches, prefixes,
+		       bounded ? " AND m.number ~<~ $2" : "");
+
+      plans[bounded] = SPI_prepare(query.data, bounded + 1, argtypes);
+      if( plans[bounded] == NULL )
+	elog(ERROR, "SPI_prepare failed: %s", query.data);
+    }
+
+    values[0] = PointerGetDatum(pr_bound_text(item.lo, item.lolen));
+    if( bounded )
+      values[1] = PointerGetDatum(pr_bound_text(item.hi, item.hilen));
+
+    if( SPI_execute_plan(plans[bounded], values, NULL, false, 0) != SPI_OK_UPDATE )
+      elog(ERROR, "SPI_execute_plan failed");
+
+    updated += SPI_processed;
+  }
+
+  SPI_finish();
+  PG_RETURN_INT64(updated);
+}
+
+/**
+ * prefix_range(digits), prefix_range(hex) and prefix_range(bytes) restrict
+ * the characters of the prefix and of the [a-b] range to an alphabet,
+ * which is checked when a value is stored in a column having the typmod,
+ * the same way varchar(n) checks its length. Without typmod, or with
+ * bytes, any character is accepted.
+ */
+#define PR_TYPMOD_DIGITS 1
+#define PR_TYPMOD_HEX    2
+#define PR_TYPMOD_BYTES  3
+
+static const char *pr_typmod_names[] = {NULL, "digits", "hex", "bytes"};
+
+Datum prefix_range_typmod_in(PG_FUNCTION_ARGS);
+Datum prefix_range_typmod_out(PG_FUNCTION_ARGS);
+Datum prefix_range_enforce_typmod(PG_FUNCTION_ARGS);
+
+static inline
+bool pr_in_alphabet(char c, int32 typmod) {
+  switch( typmod ) {
+  case PR_TYPMOD_DIGITS:
+    return c >= '0' && c <= '9';
+
+  case PR_TYPMOD_HEX:
+    return (c >= '0' && c <= '9')
+      || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+
+  default:
+    return true;
+  }
+}
+
+PG_FUNCTION_INFO_V1(prefix_range_typmod_in);
+Datum
+prefix_range_typmod_in(PG_FUNCTION_ARGS)
+{
+  ArrayType *ta = PG_GETARG_ARRAYTYPE_P(0);
+  Datum *elems;
+  char *name;
+  int n, typmod;
+
+#if PG_MAJOR_VERSION >= 802
+  deconstruct_array(ta, CSTRINGOID, -2, false, 'c', &elems, NULL, &n);
+#else
+  deconstruct_array(ta, CSTRINGOID, -2, false, 'c', &elems, &n);
+#endif
+
+  if( n != 1 )
+    ereport(ERROR,
+	    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+	     errmsg("invalid prefix_range type modifier"),
+	     errhint("Use one of digits, hex or bytes.")));
+
+  name = DatumGetCString(elems[0]);
+
+  for(typmod = PR_TYPMOD_DIGITS; typmod <= PR_TYPMOD_BYTES; typmod++)
+    if( pg_strcasecmp(name, pr_typmod_names[typmod]) == 0 )
+      PG_RETURN_INT32(typmod);
+
+  ereport(ERROR,
+	  (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+	   errmsg("invalid prefix_range type modifier: \"%s\"", name),
+	   errhint("Use one of digits, hex or bytes.")));
+
+  PG_RETURN_INT32(-1);
+}
+
+PG_FUNCTION_INFO_V1(prefix_range_typmod_out);
+Datum
+prefix_range_typmod_out(PG_FUNCTION_ARGS)
+{
+  int32 typmod = PG_GETARG_INT32(0);
+  char *out;
+
+  if( typmod < PR_TYPMOD_DIGITS || typmod > PR_TYPMOD_BYTES )
+    PG_RETURN_CSTRING(pstrdup(""));
+
+  out = (char *) palloc(strlen(pr_typmod_names[typmod]) + 3);
+  sprintf(out, "(%s)", pr_typmod_names[typmod]);
+
+  PG_RETURN_CSTRING(out);
+}
+
+/*
+ * prefix_range(prefix_range, typmod int4, explicit bool), the typmod
+ * coercion cast.
+ */
+PG_FUNCTION_INFO_V1(prefix_range_enforce_typmod);
+Datum
+prefix_range_enforce_typmod(PG_FUNCTION_ARGS)
+{
+  prefix_range *pr = PG_GETARG_PREFIX_RANGE_P(0);
+  int32 typmod = PG_GETARG_INT32(1);
+  char *c;
+
+  if( typmod == PR_TYPMOD_DIGITS || typmod == PR_TYPMOD_HEX ) {
+    bool valid = pr->first == 0
+      || (pr_in_alphabet(pr->first, typmod) && pr_in_alphabet(pr->last, typmod));
+
+    for(c = pr->prefix; valid && *c != 0; c++)
+      valid = pr_in_alphabet(*c, typmod);
+
+    if( !valid )
+      ereport(ERROR,
+	      (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+	       errmsg("prefix_range \"%s\" is not made of %s",
+		      pr_to_str(pr), pr_typmod_names[typmod])));
+  }
+
+  PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+}
+
+/**
+ * Hot prefixes and lookup statistics
+ *
+ * When prefix is in shared_preload_libraries and prefix.hot_prefixes is
+ * not 0, gpr_consistent() samples one index lookup out of
+ * prefix.stats_sample_rate into shared memory: the leaf keys it matches
+ * go to a space-saving sketch of the prefix.hot_prefixes most matched
+ * (index, prefix) pairs, their length to the match depth histogram, and
+ * the number of index pages the lookup visited to the pages histogram.
+ *
+ * consistent() doesn't see the index scan it's called for, so lookups
+ * are told apart from the calls: a lookup begins when the query or the
+ * index is not the previous call's, or when we're back on the first
+ * page of the lookup, the root, which a scan only reads once. That
+ * separates the lookups of a nested loop or prepared plan, which can
+ * reuse the query address. Lookups that only read the root, on a one
+ * page index, are still merged when their query address is the same, so
+ * the counts are approximate. A page is visited each time the entries
+ * come from another page than the previous one. When the statistics
+ * are not enabled, pr_stats is NULL and sampling costs a test.
+ */
+#if PG_MAJOR_VERSION >= 804
+
+#define PR_STATS_KEYLEN   32
+#define PR_STATS_BUCKETS  32
+
+typedef struct {
+  Oid indexrelid;
+  char prefix[PR_STATS_KEYLEN];
+  int64 count;
+  int64 error;
+} pr_stats_entry;
+
+typedef struct pr_stats_shared {
+  LWLockId lock;
+  int size;
+  int used;
+  int64 depth[PR_STATS_BUCKETS];     /* matched keys per prefix length */
+  int64 pages[PR_STATS_BUCKETS];     /* lookups per pages visited */
+  pr_stats_entry entries[1];         /* size of them, in shared memory */
+} pr_stats_shared;
+
+typedef struct {
+  Oid indexrelid;
+  Datum query;
+  Page root;
+  Page page;
+  bool sampled;
+  int pages;
+  uint32 lookups;
+} pr_stats_current;
+
+static int pr_stats_size        = 0;
+static int pr_stats_sample_rate = 100;
+static pr_stats_current pr_stats_lookup = {InvalidOid, 0, NULL, NULL, false, 0, 0};
+static shmem_startup_hook_type pr_stats_prev_shmem_startup_hook = NULL;
+
+void _PG_init(void);
+
+Datum prefix_range_hot_prefixes(PG_FUNCTION_ARGS);
+Datum prefix_range_lookup_histogram(PG_FUNCTION_ARGS);
+Datum prefix_range_stats_reset(PG_FUNCTION_ARGS);
+
+static
+Size pr_stats_memsize(void) {
+  return add_size(offsetof(pr_stats_shared, entries),
+		  mul_size(pr_stats_size, sizeof(pr_stats_entry)));
+}
+
+static
+void pr_stats_shmem_startup(void) {
+  bool found;
+
+  if( pr_stats_prev_shmem_startup_hook )
+    pr_stats_prev_shmem_startup_hook();
+
+  LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+  pr_stats = (pr_stats_shared *)
+    ShmemInitStruct("prefix lookup statistics", pr_stats_memsize(), &found);
+
+  if( !found ) {
+    memset(pr_stats, 0, pr_stats_memsize());
+    pr_stats->lock = LWLockAssign();
+    pr_stats->size = pr_stats_size;
+  }
+  LWLockRelease(AddinShmemInitLock);
+}
+
+void
+_PG_init(void)
+{
+  if( !process_shared_preload_libraries_in_progress )
+    return;
+
+  DefineCustomIntVariable("prefix.hot_prefixes",
+			  "Number of hot prefixes tracked in shared memory.",
+			  "Zero disables the prefix_range lookup statistics.",
+			  &pr_stats_size,
+			  0, 0, 10000,
+			  PGC_POSTMASTER, 0, NULL, NULL);
+
+  DefineCustomIntVariable("prefix.stats_sample_rate",
+			  "Sample one prefix_range index lookup out of this many.",
+			  NULL,
+			  &pr_stats_sample_rate,
+			  100, 1, INT_MAX,
+			  PGC_SUSET, 0, NULL, NULL);
+
+  EmitWarningsOnPlaceholders("prefix");
+
+  if( pr_stats_size == 0 )
+    return;
+
+  RequestAddinShmemSpace(pr_stats_memsize());
+  RequestAddinLWLocks(1);
+
+  pr_stats_prev_shmem_startup_hook = shmem_startup_hook;
+  shmem_startup_hook = pr_stats_shmem_startup;
+}
+
+static inline
+int pr_stats_bucket(int n) {
+  return n < PR_STATS_BUCKETS ? n : PR_STATS_BUCKETS - 1;
+}
+
+/**
+ * Space-saving: count the key when it's tracked, or take a free slot,
+ * or replace the least counted key and inherit its count as the error.
+ */
+static
+void pr_stats_hit(Oid indexrelid, prefix_range *key) {
+  char prefix[PR_STATS_KEYLEN];
+  int plen = strlen(key->prefix);
+  int len  = pr_str_len(key, plen);
+  pr_stats_entry *e, *min = NULL;
+  int i;
+
+  if( len < PR_STATS_KEYLEN ) {
+    pr_write_str(key, plen, prefix);
+    prefix[len] = 0;
+  }
+  else {
+    /* we track the key prefix, still a prefix of what matched */
+    memcpy(prefix, key->prefix, PR_STATS_KEYLEN - 1);
+    prefix[PR_STATS_KEYLEN - 1] = 0;
+  }
+
+  LWLockAcquire(pr_stats->lock, LW_EXCLUSIVE);
+
+  pr_stats->depth[pr_stats_bucket(pr_length(key))]++;
+
+  for(i = 0; i < pr_stats->used; i++) {
+    e = &pr_stats->entries[i];
+
+    if( e->indexrelid == indexrelid && strcmp(e->prefix, prefix) == 0 ) {
+      e->count++;
+      LWLockRelease(pr_stats->lock);
+      return;
+    }
+    if( min == NULL || e->count < min->count )
+      min = e;
+  }
+
+  if( pr_stats->used < pr_stats->size ) {
+    e = &pr_stats->entries[pr_stats->used++];
+    e->count = 1;
+    e->error = 0;
+  }
+  else {
+    e = min;
+    e->error = min->count;
+    e->count = min->count + 1;
+  }
+  e->indexrelid = indexrelid;
+  memcpy(e->prefix, prefix, PR_STATS_KEYLEN);
+
+  LWLockRelease(pr_stats->lock);
+}
+
+static
+void pr_stats_sample(GISTENTRY *entry, Datum query,
+		     prefix_range *key, bool match) {
+  pr_stats_current *cur = &pr_stats_lookup;
+  Oid indexrelid = RelationGetRelid(entry->rel);
+
+  if( query != cur->query || indexrelid != cur->indexrelid
+      || (entry->page == cur->root && cur->page != cur->root) ) {
+    if( cur->sampled && cur->pages > 0 ) {
+      LWLockAcquire(pr_stats->lock, LW_EXCLUSIVE);
+      pr_stats->pages[pr_stats_bucket(cur->pages)]++;
+      LWLockRelease(pr_stats->lock);
+    }
+    cur->query      = query;
+    cur->indexrelid = indexrelid;
+    cur->root       = entry->page;
+    cur->page       = NULL;
+    cur->pages      = 0;
+    cur->sampled    = ++cur->lookups % pr_stats_sample_rate == 0;
+  }
+
+  /* followed even when not sampled, to see the next lookup begin */
+  if( entry->page != cur->page ) {
+    cur->page = entry->page;
+    cur->pages++;
+  }
+
+  if( !cur->sampled )
+    return;
+
+  if( match && GIST_LEAF(entry) )
+    pr_stats_hit(indexrelid, key);
+}
+
+static
+void pr_stats_check_enabled(void) {
+  if( pr_stats == NULL )
+    ereport(ERROR,
+	    (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+	     errmsg("prefix_range lookup statistics are not enabled"),
+	     errhint("Add prefix to shared_preload_libraries and set prefix.hot_prefixes.")));
+}
+
+static int pr_stats_entry_cmp(const void *a, const void *b) {
+  const pr_stats_entry *e1 = (const pr_stats_entry *) a;
+  const pr_stats_entry *e2 = (const pr_stats_entry *) b;
+
+  if( e1->count != e2->count )
+    return e1->count < e2->count ? 1 : -1;
+  return strcmp(e1->prefix, e2->prefix);
+}
+
+/*
+ * prefix_range_hot_prefixes()
+ *   RETURNS SETOF (indexrelid regclass, prefix text, count int8, error int8)
+ *
+ * Most matched first. A key's true count is between count - error and
+ * count.
+ */
+PG_FUNCTION_INFO_V1(prefix_range_hot_prefixes);
+Datum
+prefix_range_hot_prefixes(PG_FUNCTION_ARGS)
+{
+  TupleDesc tupdesc;
+  Tuplestorestate *tupstore;
+  pr_stats_entry *entries;
+  Datum values[4];
+  bool nulls[4] = {false, false, false, false};
+  int n, i;
+
+  pr_stats_check_enabled();
+  tupstore = pr_srf_materialize(fcinfo, &tupdesc);
+
+  LWLockAcquire(pr_stats->lock, LW_SHARED);
+  n = pr_stats->used;
+  entries = (pr_stats_entry *) palloc((n + 1) * sizeof(pr_stats_entry));
+  memcpy(entries, pr_stats->entries, n * sizeof(pr_stats_entry));
+  LWLockRelease(pr_stats->lock);
+
+  qsort(entries, n, sizeof(pr_stats_entry), pr_stats_entry_cmp);
+
+  for(i = 0; i < n; i++) {
+    values[0] = ObjectIdGetDatum(entries[i].indexrelid);
+    values[1] = DirectFunctionCall1(textin, CStringGetDatum(entries[i].prefix));
+    values[2] = Int64GetDatum(entries[i].count);
+    values[3] = Int64GetDatum(entries[i].error);
+    tuplestore_puttuple(tupstore, heap_form_tuple(tupdesc, values, nulls));
+  }
+
+  return (Datum) 0;
+}
+
+/*
+ * prefix_range_lookup_histogram()
+ *   RETURNS SETOF (bucket int4, depth int8, pages int8)
+ *
+ * depth counts the matched keys of bucket length, pages the lookups
+ * having visited bucket index pages. The last bucket counts the longer
+ * ones too.
+ */
+PG_FUNCTION_INFO_V1(prefix_range_lookup_histogram);
+Datum
+prefix_range_lookup_histogram(PG_FUNCTION_ARGS)
+{
+  TupleDesc tupdesc;
+  Tuplestorestate *tupstore;
+  int64 depth[PR_STATS_BUCKETS], pages[PR_STATS_BUCKETS];
+  Datum values[3];
+  bool nulls[3] = {false, false, false};
+  int i;
+
+  pr_stats_check_enabled();
+  tupstore = pr_srf_materialize(fcinfo, &tupdesc);
+
+  LWLockAcquire(pr_stats->lock, LW_SHARED);
+  memcpy(depth, pr_stats->depth, sizeof(depth));
+  memcpy(pages, pr_stats->pages, sizeof(pages));
+  LWLockRelease(pr_stats->lock);
+
+  for(i = 0; i < PR_STATS_BUCKETS; i++) {
+    if( depth[i] == 0 && pages[i] == 0 )
+      continue;
+
+    values[0] = Int32GetDatum(i);
+    values[1] = Int64GetDatum(depth[i]);
+    values[2] = Int64GetDatum(pages[i]);
+    tuplestore_puttuple(tupstore, heap_form_tuple(tupdesc, values, nulls));
+  }
+
+  return (Datum) 0;
+}
+
+PG_FUNCTION_INFO_V1(prefix_range_stats_reset);
+Datum
+prefix_range_stats_reset(PG_FUNCTION_ARGS)
+{
+  pr_stats_check_enabled();
+
+  LWLockAcquire(pr_stats->lock, LW_EXCLUSIVE);
+  pr_stats->used = 0;
+  memset(pr_stats->depth, 0, sizeof(pr_stats->depth));
+  memset(pr_stats->pages, 0, sizeof(pr_stats->pages));
+  LWLockRelease(pr_stats->lock);
+
+  PG_RETURN_VOID();
+}
+
+#endif
+
+/**
+ * Prewarming
+ *
+ * After a restart, the first lookups would read the index pages one at a
+ * time as they go. prefix_range_prewarm(index) reads a GiST index into
+ * shared buffers in tree order, breadth first, so that the inner pages
+ * every lookup goes through are loaded before the leaves, and returns
+ * the number of pages read once they all are.
+ */
+Datum prefix_range_prewarm(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(prefix_range_prewarm);
+Datum
+prefix_range_prewarm(PG_FUNCTION_ARGS)
+{
+  Oid indexoid = PG_GETARG_OID(0);
+  Relation index;
+  BlockNumber nblocks, child, *queue;
+  Buffer buffer;
+  Page page;
+  OffsetNumber off, maxoff;
+  IndexTuple itup;
+  bool *seen;
+  int head = 0, tail = 0;
+  AclResult aclresult;
+
+  index = pr_index_open(indexoid, AccessShareLock);
+
+  if( index->rd_rel->relam != GIST_AM_OID )
+    ereport(ERROR,
+	    (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+	     errmsg("\"%s\" is not a GiST index",
+		    RelationGetRelationName(index))));
+
+  /* reading the index is reading the table */
+  aclresult = pg_class_aclcheck(index->rd_index->indrelid, GetUserId(), ACL_SELECT);
+  if( aclresult != ACLCHECK_OK )
+    aclcheck_error(aclresult, ACL_KIND_CLASS,
+		   get_rel_name(index->rd_index->indrelid));
+
+  nblocks = RelationGetNumberOfBlocks(index);
+  queue = (BlockNumber *) palloc((nblocks + 1) * sizeof(BlockNumber));
+  seen  = (bool *) palloc0((nblocks + 1) * sizeof(bool));
+
+  if( nblocks > 0 ) {
+    queue[tail++] = GIST_ROOT_BLKNO;
+    seen[GIST_ROOT_BLKNO] = true;
+  }
+
+  while( head < tail ) {
+    CHECK_FOR_INTERRUPTS();
+
+    buffer = ReadBuffer(index, queue[head++]);
+    LockBuffer(buffer, GIST_SHARE);
+    page = BufferGetPage(buffer);
+
+    if( !GistPageIsLeaf(page) ) {
+      maxoff = PageGetMaxOffsetNumber(page);
+
+      for(off = FirstOffsetNumber; off <= maxoff; off = OffsetNumberNext(off)) {
+	itup  = (IndexTuple) PageGetItem(page, PageGetItemId(page, off));
+	child = ItemPointerGetBlockNumber(&(itup->t_tid));
+
+	/* pages added by a concurrent split are left for the lookups */
+	if( child < nblocks && !seen[child] ) {
+	  seen[child] = true;
+	  queue[tail++] = child;
+	}
+      }
+    }
+    LockBuffer(buffer, GIST_UNLOCK);
+    ReleaseBuffer(buffer);
+  }
+
+  pfree(queue);
+  pfree(seen);
+  pr_index_close(index, AccessShareLock);
+
+  PG_RETURN_INT64(tail);
+}
+
+/**
+ * Sorted plan files
+ *
+ * Regulators publish numbering plans as CSV files. prefix_file_build(csv,
+ * file) validates the first column of such a file as prefix_range
+ * values, and writes them sorted, one prefix[;data] line each, to a plan
+ * file. prefix_file_lookup(file, number, longest) then finds the lines
+ * containing the number right in the file, without loading it in a
+ * table: the file is mapped in memory, and for each prefix of the number
+ * a binary search over the lines finds the ones having that prefix.
+ *
+ * The mapping and its lines offsets are kept per backend, until the file
+ * changes: writing a new plan file then renaming it over the old one
+ * makes the next lookups use it.
+ */
+typedef struct pr_plan_file {
+  char *path;
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  time_t mtime;
+  char *base;
+  int nlines;
+  size_t *lines;           /* offset of each line, and of the end */
+  struct pr_plan_file *next;
+} pr_plan_file;
+
+typedef struct {
+  prefix_range *pr;
+  char *data;
+  int datalen;
+} pr_plan_line;
+
+static pr_plan_file *pr_plan_files = NULL;
+
+Datum prefix_file_build(PG_FUNCTION_ARGS);
+Datum prefix_file_lookup(PG_FUNCTION_ARGS);
+
+static
+void pr_plan_check_superuser(void) {
+  if( !superuser() )
+    ereport(ERROR,
+	    (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+	     errmsg("must be superuser to use prefix plan files")));
+}
+
+static
+pr_plan_file *pr_plan_file_open(const char *path) {
+  pr_plan_file *f;
+  struct stat st;
+  off_t i;
+  int fd, n;
+
+  if( stat(path, &st) < 0 )
+    ereport(ERROR,
+	    (errcode_for_file_access(),
+	     errmsg("could not stat file \"%s\": %m", path)));
+
+  for(f = pr_plan_files; f != NULL; f = f->next)
+    if( strcmp(f->path, path) == 0 )
+      break;
+
+  if( f != NULL ) {
+    if( f->dev == st.st_dev && f->ino == st.st_ino
+	&& f->size == st.st_size && f->mtime == st.st_mtime )
+      return f;
+
+    /* the plan changed, map the new one */
+    if( f->base != NULL )
+      munmap(f->base, f->size);
+    if( f->lines != NULL )
+      pfree(f->lines);
+  }
+  else {
+    f = (pr_plan_file *) MemoryContextAllocZero(TopMemoryContext,
+						 sizeof(pr_plan_file));
+    f->path = MemoryContextStrdup(TopMemoryContext, path);
+    f->next = pr_plan_files;
+    pr_plan_files = f;
+  }
+
+  /* until the file is mapped, it doesn't match any stat() */
+  f->ino   = 0;
+  f->size  = 0;
+  f->base  = NULL;
+  f->lines = NULL;
+
+  if( st.st_size > 0 ) {
+    if( (fd = open(path, O_RDONLY)) < 0 )
+      ereport(ERROR,
+	      (errcode_for_file_access(),
+	       errmsg("could not open file \"%s\": %m", path)));
+
+    f->base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if( f->base == MAP_FAILED ) {
+      f->base = NULL;
+      ereport(ERROR,
+	      (errcode_for_file_access(),
+	       errmsg("could not map file \"%s\": %m", path)));
+    }
+  }
+  f->dev   = st.st_dev;
+  f->ino   = st.st_ino;
+  f->size  = st.st_size;
+  f->mtime = st.st_mtime;
+
+  for(n = 0, i = 0; i < f->size; i++)
+    if( f->base[i] == '\n' )
+      n++;
+
+  if( f->size > 0 && f->base[f->size - 1] != '\n' )
+    n++;
+
+  f->nlines = n;
+  f->lines  = (size_t *) MemoryContextAlloc(TopMemoryContext,
+					    (n + 1) * sizeof(size_t));
+  f->lines[0] = 0;
+
+  for(n = 1, i = 0; i < f->size; i++)
+    if( f->base[i] == '\n' && n <= f->nlines )
+      f->lines[n++] = i + 1;
+
+  f->lines[f->nlines] = f->size;
+
+  return f;
+}
+
+/**
+ * The prefix part of a line, up to the range, the data or the end of
+ * line.
+ */
+static inline
+int pr_plan_key_len(pr_plan_file *f, int line) {
+  const char *s = f->base + f->lines[line];
+  const char *e = f->base + f->lines[line + 1];
+  const char *p;
+
+  for(p = s; p < e && *p != '[' && *p != ';' && *p != '\n'; p++);
+  return p - s;
+}
+
+static inline
+int pr_plan_field_len(pr_plan_file *f, int line) {
+  const char *s = f->base + f->lines[line];
+  const char *e = f->base + f->lines[line + 1];
+  const char *p;
+
+  for(p = s; p < e && *p != ';' && *p != '\n'; p++);
+  return p - s;
+}
+
+static int pr_plan_line_cmp(const void *a, const void *b) {
+  const pr_plan_line *l1 = (const pr_plan_line *) a;
+  const pr_plan_line *l2 = (const pr_plan_line *) b;
+  int cmp = strcmp(l1->pr->prefix, l2->pr->prefix);
+
+  if( cmp != 0 )
+    return cmp;
+
+  if( l1->pr->first != l2->pr->first )
+    return (unsigned char) l1->pr->first - (unsigned char) l2->pr->first;
+
+  /* the narrower range last, so that it wins the longest match */
+  return (unsigned char) l2->pr->last - (unsigned char) l1->pr->last;
+}
+
+static
+void pr_plan_emit(Tuplestorestate *tupstore, TupleDesc tupdesc,
+		  pr_plan_file *f, int line, struct varlena *vdat) {
+  const char *s = f->base + f->lines[line];
+  const char *e = f->base + f->lines[line + 1];
+  int flen = pr_plan_field_len(f, line);
+  text *data;
+  Datum values[2];
+  bool nulls[2] = {false, false};
+
+  if( e > s && e[-1] == '\n' )
+    e--;
+
+  values[0] = PointerGetDatum(vdat);
+
+  if( flen < e - s ) {
+    data = (text *) palloc(VARHDRSZ + (e - s) - flen - 1);
+    PREFIX_SET_VARSIZE(data, VARHDRSZ + (e - s) - flen - 1);
+    memcpy(VARDATA(data), s + flen + 1, (e - s) - flen - 1);
+    values[1] = PointerGetDatum(data);
+  }
+  else
+    nulls[1] = true;
+
+  tuplestore_puttuple(tupstore, heap_form_tuple(tupdesc, values, nulls));
+}
+
+/*
+ * prefix_file_build(csv text, file text) RETURNS bigint
+ *
+ * The prefix is the first field of each line, separated by ; and maybe
+ * quoted with ", the rest of the line is kept as the data.
+ */
+PG_FUNCTION_INFO_V1(prefix_file_build);
+Datum
+prefix_file_build(PG_FUNCTION_ARGS)
+{
+  char *csvpath = DatumGetCString(DirectFunctionCall1(textout, PG_GETARG_DATUM(0)));
+  char *path    = DatumGetCString(DirectFunctionCall1(textout, PG_GETARG_DATUM(1)));
+  StringInfoData csv, tmppath;
+  FILE *in, *out;
+  pr_plan_line *lines;
+  struct varlena *vdat;
+  char buf[8192], *p, *end, *eol, *lend, *field, *fend, *str;
+  size_t r;
+  int n = 0, size = 1024, lineno = 0, i;
+
+  pr_plan_check_superuser();
+
+  if( (in = AllocateFile(csvpath, "r")) == NULL )
+    ereport(ERROR,
+	    (errcode_for_file_access(),
+	     errmsg("could not open file \"%s\" for reading: %m", csvpath)));
+
+  initStringInfo(&csv);
+  while( (r = fread(buf, 1, sizeof(buf), in)) > 0 )
+    appendBinaryStringInfo(&csv, buf, r);
+  FreeFile(in);
+
+  lines = (pr_plan_line *) palloc(size * sizeof(pr_plan_line));
+
+  for(p = csv.data, end = csv.data + csv.len; p < end; p = eol + 1) {
+    lineno++;
+    for(eol = p; eol < end && *eol != '\n'; eol++);
+    lend = (eol > p && eol[-1] == '\r') ? eol - 1 : eol;
+
+    field = p;
+    if( *field == '"' ) {
+      for(fend = ++field; fend < lend && *fend != '"'; fend++);
+      for(p = fend; p < lend && *p != ';'; p++);
+    }
+    else {
+      for(fend = field; fend < lend && *fend != ';'; fend++);
+      p = fend;
+    }
+
+    if( fend == field && p == lend )
+      continue;                     /* empty line */
+
+    vdat = pr_varlena_from_str(field, fend - field);
+
+    if( vdat == NULL || strchr(((prefix_range *) VARDATA(vdat))->prefix, ';') != NULL )
+      ereport(ERROR,
+	      (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+	       errmsg("invalid prefix_range value: \"%.*s\"",
+		      (int) (fend - field), field),
+	       errdetail("File \"%s\", line %d.", csvpath, lineno)));
+
+    if( n == size ) {
+      size *= 2;
+      lines = (pr_plan_line *) repalloc(lines, size * sizeof(pr_plan_line));
+    }
+    lines[n].pr = (prefix_range *) VARDATA(vdat);
+
+    /* the data, after the field separator */
+    lines[n].data    = p < lend ? p + 1 : NULL;
+    lines[n].datalen = p < lend ? lend - p - 1 : 0;
+    n++;
+  }
+
+  qsort(lines, n, sizeof(pr_plan_line), pr_plan_line_cmp);
+
+  /* write a new file, then rename it over the plan file */
+  initStringInfo(&tmppath);
+  appendStringInfo(&tmppath, "%s.%d.tmp", path, MyProcPid);
+
+  if( (out = AllocateFile(tmppath.data, "w")) == NULL )
+    ereport(ERROR,
+	    (errcode_for_file_access(),
+	     errmsg("could not open file \"%s\" for writing: %m", tmppath.data)));
+
+  for(i = 0; i < n; i++) {
+    str = pr_to_str(lines[i].pr);
+    fputs(str, out);
+    pfree(str);
+
+    if( lines[i].data != NULL ) {
+      fputc(';', out);
+      fwrite(lines[i].data, 1, lines[i].datalen, out);
+    }
+    fputc('\n', out);
+  }
+
+  if( FreeFile(out) != 0 || rename(tmppath.data, path) != 0 ) {
+    unlink(tmppath.data);
+    ereport(ERROR,
+	    (errcode_for_file_access(),
+	     errmsg("could not write file \"%s\": %m", path)));
+  }
+
+  PG_RETURN_INT64(n);
+}
+
+/*
+ * prefix_file_lookup(file text, number text, longest bool)
+ *   RETURNS SETOF (prefix prefix_range, data text)
+ *
+ * The lines containing the number, shortest prefix first, or only the
+ * longest prefix match.
+ */
+PG_FUNCTION_INFO_V1(prefix_file_lookup);
+Datum
+prefix_file_lookup(PG_FUNCTION_ARGS)
+{
+  char *path    = DatumGetCString(DirectFunctionCall1(textout, PG_GETARG_DATUM(0)));
+  text *number  = PREFIX_PG_GETARG_TEXT(1);
+  bool longest  = PG_GETARG_BOOL(2);
+  char *num     = PREFIX_VARDATA(number);
+  int nlen      = PREFIX_VARSIZE(number);
+
+  TupleDesc tupdesc;
+  Tuplestorestate *tupstore;
+  pr_plan_file *f;
+  prefix_range *query, *pr;
+  struct varlena *vdat, *found = NULL;
+  int len, lo, hi, mid, klen, flen, cmp, line, foundline = -1;
+
+  pr_plan_check_superuser();
+  tupstore = pr_srf_materialize(fcinfo, &tupdesc);
+  f = pr_plan_file_open(path);
+
+  query = (prefix_range *) palloc0(sizeof(prefix_range) + nlen + 1);
+  memcpy(query->prefix, num, nlen);
+
+  for(len = 0; len <= nlen; len++) {
+    /* first line whose prefix is not before num[0..len) */
+    lo = 0;
+    hi = f->nlines;
+
+    while( lo < hi ) {
+      mid  = lo + (hi - lo) / 2;
+      klen = pr_plan_key_len(f, mid);
+      cmp  = memcmp(f->base + f->lines[mid], num, klen < len ? klen : len);
+
+      if( cmp < 0 || (cmp == 0 && klen < len) )
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+
+    for(line = lo; line < f->nlines; line++) {
+      klen = pr_plan_key_len(f, line);
+
+      if( klen != len || memcmp(f->base + f->lines[line], num, len) != 0 )
+	break;
+
+      flen = pr_plan_field_len(f, line);
+      vdat = pr_varlena_from_str(f->base + f->lines[line], flen);
+
+      if( vdat == NULL )
+	ereport(ERROR,
+		(errcode(ERRCODE_DATA_CORRUPTED),
+		 errmsg("invalid prefix_range value \"%.*s\" in plan file \"%s\"",
+			flen, f->base + f->lines[line], path)));
+
+      pr = (prefix_range *) VARDATA(vdat);
+      if( !pr_contains(pr, query, true) ) {
+	pfree(vdat);
+	continue;
+      }
+
+      if( longest ) {
+	if( found != NULL )
+	  pfree(found);
+	found = vdat;
+	foundline = line;
+	continue;
+      }
+      pr_plan_emit(tupstore, tupdesc, f, line, vdat);
+    }
+  }
+
+  if( found != NULL )
+    pr_plan_emit(tupstore, tupdesc, f, foundline, found);
+
+  return (Datum) 0;
+}
+
+/**
+ * Compiled trie, see prefix.h for its format.
+ *
+ * prefix_trie_build(table [, column [, value]]) sorts the prefixes, then
+ * numbers the trie nodes breadth first: a node at depth d stands for the
+ * run of sorted prefixes sharing their d first characters, its own
+ * entries are the ones of length d, which sort first in the run, and the
+ * rest of the run splits into its children on the character at d.
+ *
+ * The value column is cast to int4 and stored with each entry, 0 when
+ * not given or NULL. A range found twice keeps its smallest value.
+ */
+Datum prefix_trie_build(PG_FUNCTION_ARGS);
+Datum prefix_trie_lookup(PG_FUNCTION_ARGS);
+Datum prefix_trie_write(PG_FUNCTION_ARGS);
+
+typedef struct {
+  prefix_range *pr;
+  int32 value;
+} pr_trie_item;
+
+static int pr_trie_cmp(const void *a, const void *b) {
+  const pr_trie_item *i1 = (const pr_trie_item *) a;
+  const pr_trie_item *i2 = (const pr_trie_item *) b;
+  prefix_range *p1 = i1->pr;
+  prefix_range *p2 = i2->pr;
+  int cmp = strcmp(p1->prefix, p2->prefix);
+
+  if( cmp != 0 )
+    return cmp;
+
+  if( p1->first != p2->first )
+    return (unsigned char) p1->first - (unsigned char) p2->first;
+
+  if( p1->last != p2->last )
+    return (unsigned char) p2->last - (unsigned char) p1->last;
+
+  return i1->value < i2->value ? -1 : i1->value > i2->value ? 1 : 0;
+}
+
+/*
+ * The prefixes of the table with their values, in the caller's memory
+ * context, as pr_fetch_column() does.
+ */
+static
+pr_trie_item *pr_trie_fetch(Oid relid, const char *column, const char *value,
+			    int *n) {
+  MemoryContext oldcontext = CurrentMemoryContext;
+  StringInfoData query;
+  pr_trie_item *items;
+  prefix_range *pr;
+  Datum datum;
+  bool isnull;
+  char *col;
+  int i;
+
+  col = pstrdup(quote_identifier(column));
+
+  initStringInfo(&query);
+  appendStringInfo(&query, "SELECT %s::prefix_range, ", col);
+  if( value != NULL )
+    appendStringInfo(&query, "%s::int4", quote_identifier(value));
+  else
+    appendStringInfoString(&query, "0::int4");
+  appendStringInfo(&query, " FROM %s WHERE %s IS NOT NULL",
+		   pr_qualified_relname(relid), col);
+
+  if( SPI_connect() != SPI_OK_CONNECT )
+    elog(ERROR, "SPI_connect failed");
+
+  if( SPI_execute(query.data, true, 0) != SPI_OK_SELECT )
+    elog(ERROR, "SPI_execute failed: %s", query.data);
+
+  *n = SPI_processed;
+
+  MemoryContextSwitchTo(oldcontext);
+  items = (pr_trie_item *) palloc((*n + 1) * sizeof(pr_trie_item));
+
+  for(i = 0; i < *n; i++) {
+    datum = SPI_getbinval(SPI_tuptable->vals[i],
+			  SPI_tuptable->tupdesc, 1, &isnull);
+    pr = DatumGetPrefixRange(PG_DETOAST_DATUM(datum));
+    items[i].pr = build_pr(pr->prefix, pr->first, pr->last);
+
+    datum = SPI_getbinval(SPI_tuptable->vals[i],
+			  SPI_tuptable->tupdesc, 2, &isnull);
+    items[i].value = isnull ? 0 : DatumGetInt32(datum);
+  }
+
+  SPI_finish();
+  pfree(query.data);
+
+  return items;
+}
+
+/*
+ * prefix_trie_build(regclass [, column text [, value text]]) RETURNS bytea
+ */
+PG_FUNCTION_INFO_V1(prefix_trie_build);
+Datum
+prefix_trie_build(PG_FUNCTION_ARGS)
+{
+  Oid relid = PG_GETARG_OID(0);
+  char *column = PG_NARGS() > 1 ?
+    DatumGetCString(DirectFunctionCall1(textout, PG_GETARG_DATUM(1))) : "prefix";
+  char *value  = PG_NARGS() > 2 ?
+    DatumGetCString(DirectFunctionCall1(textout, PG_GETARG_DATUM(2))) : NULL;
+
+  pr_trie_item *items;
+  int *lens, *qa, *qb, *qd;
+  unsigned char *qlabel;
+  pr_trie_entry *entries;
+  pr_trie_header *h;
+  pr_trie_node *nodes;
+  prefix_range *pr;
+  bytea *result;
+  char *data;
+  size_t size;
+  uint32 maxnodes = 1, nnodes = 1, nentries = 0, head;
+  int n, m = 0, i, j, k, d;
+
+  items = pr_trie_fetch(relid, column, value, &n);
+  qsort(items, n, sizeof(pr_trie_item), pr_trie_cmp);
+
+  /* duplicates would only make the node entries longer */
+  lens = (int *) palloc((n + 1) * sizeof(int));
+  for(i = 0; i < n; i++) {
+    if( m > 0 && pr_eq(items[m - 1].pr, items[i].pr) )
+      continue;
+    items[m] = items[i];
+    lens[m]  = strlen(items[i].pr->prefix);
+    maxnodes += lens[m++];
+  }
+  n = m;
+
+  qa      = (int *) palloc(maxnodes * sizeof(int));
+  qb      = (int *) palloc(maxnodes * sizeof(int));
+  qd      = (int *) palloc(maxnodes * sizeof(int));
+  qlabel  = (unsigned char *) palloc0(maxnodes);
+  nodes   = (pr_trie_node *) palloc0(maxnodes * sizeof(pr_trie_node));
+  entries = (pr_trie_entry *) palloc0((n + 1) * sizeof(pr_trie_entry));
+
+  qa[0] = 0;
+  qb[0] = n;
+  qd[0] = 0;
+
+  for(head = 0; head < nnodes; head++) {
+    d = qd[head];
+
+    nodes[head].first_entry = nentries;
+    for(i = qa[head]; i < qb[head] && lens[i] == d; i++) {
+      entries[nentries].value  = items[i].value;
+      entries[nentries].first  = items[i].pr->first;
+      entries[nentries++].last = items[i].pr->last;
+    }
+    nodes[head].nentry = nentries - nodes[head].first_entry;
+
+    nodes[head].first_child = nnodes;
+    for(j = i; j < qb[head]; j = k) {
+      pr = items[j].pr;
+      for(k = j; k < qb[head] && items[k].pr->prefix[d] == pr->prefix[d]; k++);
+
+      qa[nnodes] = j;
+      qb[nnodes] = k;
+      qd[nnodes] = d + 1;
+      qlabel[nnodes++] = (unsigned char) pr->prefix[d];
+    }
+    nodes[head].nchild = nnodes - nodes[head].first_child;
+  }
+
+  size   = pr_trie_size(nnodes, nentries);
+  result = (bytea *) palloc0(VARHDRSZ + size);
+  PREFIX_SET_VARSIZE(result, VARHDRSZ + size);
+
+  data = VARDATA(result);
+  h = (pr_trie_header *) data;
+  memcpy(h->magic, PR_TRIE_MAGIC, 4);
+  h->order    = PR_TRIE_ORDER;
+  h->nnodes   = nnodes;
+  h->nentries = nentries;
+
+  data += sizeof(pr_trie_header);
+  memcpy(data, nodes, nnodes * sizeof(pr_trie_node));
+  data += nnodes * sizeof(pr_trie_node);
+  memcpy(data, entries, nentries * sizeof(pr_trie_entry));
+  data += nentries * sizeof(pr_trie_entry);
+  memcpy(data, qlabel, nnodes);
+
+  PG_RETURN_BYTEA_P(result);
+}
+
+/*
+ * prefix_trie_lookup(trie bytea, number text) RETURNS prefix_range
+ *
+ * The longest prefix match of the number, or NULL.
+ */
+PG_FUNCTION_INFO_V1(prefix_trie_lookup);
+Datum
+prefix_trie_lookup(PG_FUNCTION_ARGS)
+{
+  bytea *trie  = PG_GETARG_BYTEA_P(0);
+  text *number = PREFIX_PG_GETARG_TEXT(1);
+  char *num    = PREFIX_VARDATA(number);
+  int nlen     = PREFIX_VARSIZE(number);
+  pr_trie_entry match;
+  prefix_range *pr;
+  int depth;
+
+  depth = pr_trie_lookup(VARDATA(trie), VARSIZE(trie) - VARHDRSZ,
+			 num, nlen, &match);
+
+  if( depth == -2 )
+    ereport(ERROR,
+	    (errcode(ERRCODE_DATA_CORRUPTED),
+	     errmsg("invalid prefix trie")));
+
+  if( depth < 0 )
+    PG_RETURN_NULL();
+
+  pr = (prefix_range *) palloc(sizeof(prefix_range) + depth + 1);
+  memcpy(pr->prefix, num, depth);
+  pr->prefix[depth] = 0;
+  pr->first = match.first;
+  pr->last  = match.last;
+
+  PG_RETURN_PREFIX_RANGE_P(pr);
+}
+
+/*
+ * prefix_trie_write(trie bytea, file text) RETURNS bigint
+ *
+ * Saves the trie to a file for prefix_serve, see prefix_serve.c, writing
+ * a new file then renaming it over the old one, so that the server
+ * never maps a partly written trie. Returns the file size.
+ */
+PG_FUNCTION_INFO_V1(prefix_trie_write);
+Datum
+prefix_trie_write(PG_FUNCTION_ARGS)
+{
+  bytea *trie = PG_GETARG_BYTEA_P(0);
+  char *path  = DatumGetCString(DirectFunctionCall1(textout, PG_GETARG_DATUM(1)));
+  size_t len  = VARSIZE(trie) - VARHDRSZ;
+  StringInfoData tmppath;
+  FILE *out;
+
+  if( !superuser() )
+    ereport(ERROR,
+	    (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+	     errmsg("must be superuser to write prefix trie files")));
+
+  if( !pr_trie_check(VARDATA(trie), len) )
+    ereport(ERROR,
+	    (errcode(ERRCODE_DATA_CORRUPTED),
+	     errmsg("invalid prefix trie")));
+
+  initStringInfo(&tmppath);
+  appendStringInfo(&tmppath, "%s.%d.tmp", path, MyProcPid);
+
+  if( (out = AllocateFile(tmppath.data, "w")) == NULL )
+    ereport(ERROR,
+	    (errcode_for_file_access(),
+	     errmsg("could not open file \"%s\" for writing: %m", tmppath.data)));
+
+  if( fwrite(VARDATA(trie), 1, len, out) != len ) {
+    FreeFile(out);
+    unlink(tmppath.data);
+    ereport(ERROR,
+	    (errcode_for_file_access(),
+	     errmsg("could not write file \"%s\": %m", tmppath.data)));
+  }
+
+  if( FreeFile(out) != 0 || rename(tmppath.data, path) != 0 ) {
+    unlink(tmppath.data);
+    ereport(ERROR,
+	    (errcode_for_file_access(),
+	     errmsg("could not write file \"%s\": %m", path)));
+  }
+
+  PG_RETURN_INT64((int64) len);
+}
+
+/**
+ * Partition pruning
+ *
+ * Tables partitioned by prefix_range are inheritance children having a
+ * CHECK constraint on the prefix column, as in
+ *
+ *   CHECK (prefix <@ '01')  or  CHECK (prefix <@ '01' OR prefix <@ '02')
+ *
+ * The planner's constraint exclusion only knows about btree operators,
+ * so prefix_range_partition(parent, query [, column]) does the pruning:
+ * it returns the children whose constraints the query prefix_range
+ * overlaps, which are the only ones that can hold a prefix containing
+ * or contained by the query. A child whose constraints we can't read is
+ * always returned.
+ *
+ * The constraints are parsed once per parent and backend, the cache is
+ * reset on any relcache invalidation, as we can't tell a new partition
+ * from any other relation.
+ */
+typedef struct pr_part_child {
+  Oid relid;
+  AttrNumber attnum;
+  List *checks;
+} pr_part_child;
+
+typedef struct pr_part_cache {
+  Oid parent;
+  char *column;
+  bool valid;
+  uint32 generation;
+  int nchildren;
+  pr_part_child *children;
+  MemoryContext cxt;
+  struct pr_part_cache *next;
+} pr_part_cache;
+
+static pr_part_cache *pr_part_caches = NULL;
+static bool pr_part_callback_registered = false;
+static uint32 pr_part_generation = 0;
+
+Datum prefix_range_partition(PG_FUNCTION_ARGS);
+
+static
+void pr_part_invalidate(Datum arg, Oid relid) {
+  pr_part_generation++;
+}
+
+static
+void pr_part_load(pr_part_cache *cache) {
+  StringInfoData query;
+  MemoryContext oldcontext;
+  pr_part_child *child = NULL;
+  Datum value;
+  bool isnull;
+  Oid relid;
+  uint32 generation = pr_part_generation;
+  int i;
+
+  cache->valid = false;
+  MemoryContextReset(cache->cxt);
+  cache->nchildren = 0;
+  cache->children  = NULL;
+
+  initStringInfo(&query);
+  appendStringInfo(&query,
+		   "SELECT i.inhrelid, c.conbin "
+		   "FROM pg_catalog.pg_inherits i "
+		   "LEFT JOIN pg_catalog.pg_constraint c "
+		   "ON c.conrelid = i.inhrelid AND c.contype = 'c' "
+		   "WHERE i.inhparent = %u ORDER BY i.inhrelid",
+		   cache->parent);
+
+  if( SPI_connect() != SPI_OK_CONNECT )
+    elog(ERROR, "SPI_connect failed");
+
+  if( SPI_execute(query.data, true, 0) != SPI_OK_SELECT )
+    elog(ERROR, "SPI_execute failed: %s", query.data);
+
+  oldcontext = MemoryContextSwitchTo(cache->cxt);
+  cache->children = (pr_part_child *)
+    palloc((SPI_processed + 1) * sizeof(pr_part_child));
+
+  for(i = 0; i < SPI_processed; i++) {
+    value = SPI_getbinval(SPI_tuptable->vals[i],
+			  SPI_tuptable->tupdesc, 1, &isnull);
+    relid = DatumGetObjectId(value);
+
+    if( child == NULL || child->relid != relid ) {
+      child = &cache->children[cache->nchildren++];
+      child->relid  = relid;
+      child->attnum = get_attnum(relid, cache->column);
+      child->checks = NIL;
+    }
+
+    value = SPI_getbinval(SPI_tuptable->vals[i],
+			  SPI_tuptable->tupdesc, 2, &isnull);
+    if( !isnull )
+      child->checks =
+	lappend(child->checks,
+		stringToNode(DatumGetCString(DirectFunctionCall1(textout,
+								 value))));
+  }
+  MemoryContextSwitchTo(oldcontext);
+
+  SPI_finish();
+  pfree(query.data);
+
+  /* an invalidation received while loading is seen on the next call */
+  cache->generation = generation;
+  cache->valid      = true;
+}
+
+static
+pr_part_cache *pr_part_get_cache(Oid parent, const char *column) {
+  pr_part_cache *c;
+
+  for(c = pr_part_caches; c != NULL; c = c->next)
+    if( c->parent == parent && strcmp(c->column, column) == 0 )
+      break;
+
+  if( c == NULL ) {
+    if( !pr_part_callback_registered ) {
+      CacheRegisterRelcacheCallback(pr_part_invalidate, (Datum) 0);
+      pr_part_callback_registered = true;
+    }
+    c = (pr_part_cache *) MemoryContextAllocZero(TopMemoryContext,
+						 sizeof(pr_part_cache));
+    c->parent = parent;
+    c->column = MemoryContextStrdup(TopMemoryContext, column);
+    c->cxt    = AllocSetContextCreate(TopMemoryContext,
+				      "prefix_range partitions",
+				      ALLOCSET_SMALL_MINSIZE,
+				      ALLOCSET_SMALL_INITSIZE,
+				      ALLOCSET_SMALL_MAXSIZE);
+    c->next   = pr_part_caches;
+    pr_part_caches = c;
+  }
+
+  if( !c->valid || c->generation != pr_part_generation )
+    pr_part_load(c);
+
+  return c;
+}
+
+/**
+ * Returns false when no row matching the query can satisfy the node,
+ * true when some can or when we don't know. We only prune on the
+ * clauses that bound the column to the constant, col <@ const,
+ * const @> col and col = const: the column is then within the
+ * constant, and overlaps the query only if the constant does. A column
+ * containing or overlapping the constant, as with &&, can be a shorter
+ * prefix which overlaps any query.
+ */
+static
+bool pr_part_may_match(Node *node, AttrNumber attnum, Oid typid,
+		       prefix_range *query) {
+  ListCell *lc;
+
+  if( node == NULL )
+    return true;
+
+  if( IsA(node, List) ) {
+    foreach(lc, (List *) node)
+      if( !pr_part_may_match(lfirst(lc), attnum, typid, query) )
+	return false;
+    return true;
+  }
+
+  if( IsA(node, BoolExpr) ) {
+    BoolExpr *b = (BoolExpr *) node;
+
+    if( b->boolop == AND_EXPR )
+      return pr_part_may_match((Node *) b->args, attnum, typid, query);
+
+    if( b->boolop == OR_EXPR ) {
+      foreach(lc, b->args)
+	if( pr_part_may_match(lfirst(lc), attnum, typid, query) )
+	  return true;
+      return false;
+    }
+    return true;
+  }
+
+  if( IsA(node, OpExpr) ) {
+    OpExpr *op = (OpExpr *) node;
+    Node *left, *right;
+    Var *var;
+    Const *cst;
+    char *opname;
+    bool var_left;
+
+    if( list_length(op->args) != 2 )
+      return true;
+
+    left  = linitial(op->args);
+    right = lsecond(op->args);
+
+    if( IsA(left, Var) && IsA(right, Const) ) {
+      var = (Var *) left;
+      cst = (Const *) right;
+      var_left = true;
+    }
+    else if( IsA(left, Const) && IsA(right, Var) ) {
+      var = (Var *) right;
+      cst = (Const *) left;
+      var_left = false;
+    }
+    else
+      return true;
+
+    /* a CHECK evaluating to NULL accepts the row */
+    if( var->varattno != attnum || cst->consttype != typid
+	|| cst->constisnull )
+      return true;
+
+    opname = get_opname(op->opno);
+    if( opname == NULL
+	|| !(strcmp(opname, "=") == 0
+	     || (var_left && strcmp(opname, "<@") == 0)
+	     || (!var_left && strcmp(opname, "@>") == 0)) )
+      return true;
+
+    return pr_overlaps(DatumGetPrefixRange(PG_DETOAST_DATUM(cst->constvalue)),
+		       query);
+  }
+
+  return true;
+}
+
+/*
+ * prefix_range_partition(parent regclass, query prefix_range
+ *                        [, column text]) RETURNS SETOF regclass
+ */
+PG_FUNCTION_INFO_V1(prefix_range_partition);
+Datum
+prefix_range_partition(PG_FUNCTION_ARGS)
+{
+  FuncCallContext *funcctx;
+  Oid *matches;
+
+  if( SRF_IS_FIRSTCALL() ) {
+    MemoryContext oldcontext;
+    Oid parent = PG_GETARG_OID(0);
+    prefix_range *query = PG_GETARG_PREFIX_RANGE_P(1);
+    Oid typid = get_fn_expr_argtype(fcinfo->flinfo, 1);
+    char *column = "prefix";
+    pr_part_cache *cache;
+    pr_part_child *child;
+    int i, n = 0;
+
+    if( PG_NARGS() > 2 )
+      column = DatumGetCString(DirectFunctionCall1(textout,
+						   PG_GETARG_DATUM(2)));
+
+    funcctx    = SRF_FIRSTCALL_INIT();
+    oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+    cache   = pr_part_get_cache(parent, column);
+    matches = (Oid *) palloc((cache->nchildren + 1) * sizeof(Oid));
+
+    for(i = 0; i < cache->nchildren; i++) {
+      child = &cache->children[i];
+
+      if( child->attnum == InvalidAttrNumber
+	  || pr_part_may_match((Node *) child->checks,
+			       child->attnum, typid, query) )
+	matches[n++] = child->relid;
+    }
+    funcctx->max_calls = n;
+    funcctx->user_fctx = matches;
+
+    MemoryContextSwitchTo(oldcontext);
+  }
+
+  funcctx = SRF_PERCALL_SETUP();
+  matches = (Oid *) funcctx->user_fctx;
+
+  if( funcctx->call_cntr < funcctx->max_calls )
+    SRF_RETURN_NEXT(funcctx, ObjectIdGetDatum(matches[funcctx->call_cntr]));
+
+  SRF_RETURN_DONE(funcctx);
+}
+
+/**
+ * Bloom filters
+ *
+ * For screening lookups, where most numbers match no prefix at all,
+ * prefix_bloom_build(table [, column [, bits_per_key]]) summarizes the
+ * prefixes of a table into a Bloom filter held in a bytea, and
+ * prefix_bloom_maybe(filter, number) is false when no prefix of the
+ * table can match the number, without an index lookup. A range prefix
+ * such as 01[2-4] is added as its 012, 013 and 014 keys, and only the
+ * prefix lengths found in the table are probed.
+ *
+ * prefix_bloom_add(filter, prefix) returns the filter with one more
+ * prefix, for a trigger to keep it current, a removed prefix needs the
+ * filter to be built again. prefix_bloom_stats(filter) reports its fill
+ * and estimated false positive rate.
+ *
+ * The hash is our own FNV-1a, so that a filter stays valid across
+ * PostgreSQL versions, and the bit positions are derived from its two
+ * halves.
+ */
+#define PR_BLOOM_MAGIC        "PRB1"
+#define PR_BLOOM_BITS_PER_KEY 10
+#define PR_BLOOM_MAXHASHES    32
+#define PR_BLOOM_MAXLEN       63
+#define PR_BLOOM_MAXBITS      ((double) 0xFFFFFFFFU)
+
+typedef struct {
+  char   magic[4];
+  uint32 nbits;
+  uint32 nhashes;
+  uint32 nentries;
+  uint32 lengths[2];   /* bit l is set when there are keys of length l,
+			  bit 63 for the keys of length 63 and more */
+} pr_bloom_header;
+
+Datum prefix_bloom_build(PG_FUNCTION_ARGS);
+Datum prefix_bloom_add(PG_FUNCTION_ARGS);
+Datum prefix_bloom_maybe(PG_FUNCTION_ARGS);
+Datum prefix_bloom_stats(PG_FUNCTION_ARGS);
+
+static inline
+uint64 pr_bloom_hash(const char *key, int len) {
+  uint64 h = UINT64CONST(14695981039346656037);
+  int i;
+
+  for(i = 0; i < len; i++) {
+    h ^= (unsigned char) key[i];
+    h *= UINT64CONST(1099511628211);
+  }
+  return h;
+}
+
+static inline
+void pr_bloom_set_length(pr_bloom_header *h, int len) {
+  if( len > PR_BLOOM_MAXLEN )
+    len = PR_BLOOM_MAXLEN;
+  h->lengths[len / 32] |= (uint32) 1 << (len % 32);
+}
+
+static inline
+bool pr_bloom_has_length(pr_bloom_header *h, int len) {
+  if( len > PR_BLOOM_MAXLEN )
+    len = PR_BLOOM_MAXLEN;
+  return (h->lengths[len / 32] & ((uint32) 1 << (len % 32))) != 0;
+}
+
+static
+void pr_bloom_add_key(pr_bloom_header *h, uint8 *bits,
+		      const char *key, int len) {
+  uint64 hash = pr_bloom_hash(key, len);
+  uint32 h1 = (uint32) hash, h2 = (uint32) (hash >> 32) | 1;
+  uint32 i, bit;
+
+  for(i = 0; i < h->nhashes; i++) {
+    bit = (h1 + i * h2) % h->nbits;
+    bits[bit / 8] |= 1 << (bit % 8);
+  }
+  pr_bloom_set_length(h, len);
+  h->nentries++;
+}
+
+static
+bool pr_bloom_test_key(pr_bloom_header *h, const uint8 *bits,
+		       const char *key, int len) {
+  uint64 hash = pr_bloom_hash(key, len);
+  uint32 h1 = (uint32) hash, h2 = (uint32) (hash >> 32) | 1;
+  uint32 i, bit;
+
+  for(i = 0; i < h->nhashes; i++) {
+    bit = (h1 + i * h2) % h->nbits;
+    if( (bits[bit / 8] & (1 << (bit % 8))) == 0 )
+      return false;
+  }
+  return true;
+}
+
+static
+void pr_bloom_add_pr(pr_bloom_header *h, uint8 *bits, prefix_range *pr) {
+  int len = strlen(pr->prefix);
+  char *key;
+  int c;
+
+  if( pr->first == 0 ) {
+    pr_bloom_add_key(h, bits, pr->prefix, len);
+    return;
+  }
+
+  key = (char *) palloc(len + 1);
+  memcpy(key, pr->prefix, len);
+
+  for(c = (unsigned char) pr->first; c <= (unsigned char) pr->last; c++) {
+    key[len] = (char) c;
+    pr_bloom_add_key(h, bits, key, len + 1);
+  }
+  pfree(key);
+}
+
+static inline
+int pr_bloom_nkeys(prefix_range *pr) {
+  if( pr->first == 0 )
+    return 1;
+  return (unsigned char) pr->last - (unsigned char) pr->first + 1;
+}
+
+/*
+ * Checks the given bytea is a filter and returns its header, copied
+ * out as the bytea data may not be aligned, and its bits.
+ */
+static
+uint8 *pr_bloom_get(bytea *filter, pr_bloom_header *h) {
+  Size size = VARSIZE(filter) - VARHDRSZ;
+
+  if( size >= sizeof(pr_bloom_header) )
+    memcpy(h, VARDATA(filter), sizeof(pr_bloom_header));
+
+  if( size < sizeof(pr_bloom_header)
+      || memcmp(h->magic, PR_BLOOM_MAGIC, 4) != 0
+      || h->nbits == 0
+      || h->nhashes < 1 || h->nhashes > PR_BLOOM_MAXHASHES
+      || size != sizeof(pr_bloom_header) + ((Size) h->nbits + 7) / 8 )
+    ereport(ERROR,
+	    (errcode(ERRCODE_DATA_CORRUPTED),
+	     errmsg("invalid prefix bloom filter")));
+
+  return (uint8 *) VARDATA(filter) + sizeof(pr_bloom_header);
+}
+
+/*
+ * prefix_bloom_build(regclass [, column text [, bits_per_key int4]])
+ *   RETURNS bytea
+ */
+PG_FUNCTION_INFO_V1(prefix_bloom_build);
+Datum
+prefix_bloom_build(PG_FUNCTION_ARGS)
+{
+  Oid relid   = PG_GETARG_OID(0);
+  char *column = "prefix";
+  int32 bpk   = PR_BLOOM_BITS_PER_KEY;
+  prefix_range **prs;
+  pr_bloom_header h;
+  bytea *filter;
+  uint8 *bits;
+  double nbits;
+  Size size;
+  int64 nkeys = 0;
+  int n, i;
+
+  if( PG_NARGS() > 1 )
+    column = DatumGetCString(DirectFunctionCall1(textout, PG_GETARG_DATUM(1)));
+
+  if( PG_NARGS() > 2 )
+    bpk = PG_GETARG_INT32(2);
+
+  if( bpk < 1 || bpk > 64 )
+    ereport(ERROR,
+	    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+	     errmsg("bits per key must be between 1 and 64")));
+
+  prs = pr_fetch_column(relid, column, &n);
+
+  for(i = 0; i < n; i++)
+    nkeys += pr_bloom_nkeys(prs[i]);
+
+  /* nbits is a uint32 in the header, and a 512MB filter is plenty */
+  nbits = Max((double) nkeys * bpk, 64);
+  nbits = Min(nbits, PR_BLOOM_MAXBITS);
+
+  memset(&h, 0, sizeof(pr_bloom_header));
+  memcpy(h.magic, PR_BLOOM_MAGIC, 4);
+  h.nbits   = (uint32) nbits;
+  h.nhashes = Min(Max((int) rint(bpk * 0.693), 1), PR_BLOOM_MAXHASHES);
+
+  size   = VARHDRSZ + sizeof(pr_bloom_header) + ((Size) h.nbits + 7) / 8;
+  filter = (bytea *) palloc0(size);
+  PREFIX_SET_VARSIZE(filter, size);
+  bits   = (uint8 *) VARDATA(filter) + sizeof(pr_bloom_header);
+
+  for(i = 0; i < n; i++)
+    pr_bloom_add_pr(&h, bits, prs[i]);
+
+  memcpy(VARDATA(filter), &h, sizeof(pr_bloom_header));
+
+  PG_RETURN_BYTEA_P(filter);
+}
+
+/*
+ * prefix_bloom_add(filter bytea, prefix prefix_range) RETURNS bytea
+ */
+PG_FUNCTION_INFO_V1(prefix_bloom_add);
+Datum
+prefix_bloom_add(PG_FUNCTION_ARGS)
+{
+  bytea *filter    = PG_GETARG_BYTEA_P_COPY(0);
+  prefix_range *pr = PG_GETARG_PREFIX_RANGE_P(1);
+  pr_bloom_header h;
+  uint8 *bits      = pr_bloom_get(filter, &h);
+
+  pr_bloom_add_pr(&h, bits, pr);
+  memcpy(VARDATA(filter), &h, sizeof(pr_bloom_header));
+
+  PG_RETURN_BYTEA_P(filter);
+}
+
+/*
+ * prefix_bloom_maybe(filter bytea, number text) RETURNS bool
+ */
+PG_FUNCTION_INFO_V1(prefix_bloom_maybe);
+Datum
+prefix_bloom_maybe(PG_FUNCTION_ARGS)
+{
+  bytea *filter = PG_GETARG_BYTEA_P(0);
+  text *number  = PREFIX_PG_GETARG_TEXT(1);
+  char *num     = PREFIX_VARDATA(number);
+  int nlen      = PREFIX_VARSIZE(number);
+  pr_bloom_header h;
+  uint8 *bits   = pr_bloom_get(filter, &h);
+  int len;
+
+  for(len = 0; len <= nlen; len++)
+    if( pr_bloom_has_length(&h, len)
+	&& pr_bloom_test_key(&h, bits, num, len) )
+      PG_RETURN_BOOL(true);
+
+  PG_RETURN_BOOL(false);
+}
+
+/*
+ * prefix_bloom_stats(filter bytea) RETURNS (bits bigint, hashes int,
+ *   entries bigint, lengths int, fill float8, false_positive float8)
+ *
+ * The false positive rate is the probability that a number matching no
+ * prefix passes the filter, having one probe per prefix length.
+ */
+PG_FUNCTION_INFO_V1(prefix_bloom_stats);
+Datum
+prefix_bloom_stats(PG_FUNCTION_ARGS)
+{
+  bytea *filter = PG_GETARG_BYTEA_P(0);
+  pr_bloom_header h;
+  uint8 *bits   = pr_bloom_get(filter, &h);
+  TupleDesc tupdesc;
+  Datum values[6];
+  bool nulls[6] = {false, false, false, false, false, false};
+  int64 set = 0;
+  int nlengths = 0, i;
+  double fill;
+  uint8 b;
+
+  if( get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE )
+    elog(ERROR, "return type must be a row type");
+  tupdesc = BlessTupleDesc(tupdesc);
+
+  for(i = 0; i < (h.nbits + 7) / 8; i++)
+    for(b = bits[i]; b != 0; b &= b - 1)
+      set++;
+
+  for(i = 0; i <= PR_BLOOM_MAXLEN; i++)
+    if( pr_bloom_has_length(&h, i) )
+      nlengths++;
+
+  fill = (double) set / h.nbits;
+
+  values[0] = Int64GetDatum((int64) h.nbits);
+  values[1] = Int32GetDatum((int32) h.nhashes);
+  values[2] = Int64GetDatum((int64) h.nentries);
+  values[3] = Int32GetDatum(nlengths);
+  values[4] = Float8GetDatum(fill);
+  values[5] = Float8GetDatum(1 - pow(1 - pow(fill, h.nhashes), nlengths));
+
+  PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/**
+ * prefix_set, a set of prefix ranges in a single value.
+ *
+ * The ranges are kept normalized: the ones contained by another range
+ * are removed, those next to each other or overlapping under the same
+ * prefix, as 01[2-4] and 015, are merged, and what's left is sorted
+ * in the sweep order of pr_minimal_cover(). Those ranges are disjoint,
+ * and a range containing the query is the last one starting before
+ * it, so that @> and && are binary searches.
+ *
+ * The items are stored as prefix_range structures, after an array of
+ * their offsets from the first one. The type has int4 alignment and we
+ * use PG_DETOAST_DATUM(), so that the header is aligned.
+ *
+ * The GiST support indexes the union of the ranges of each set, with
+ * the prefix_range opclass functions, and is lossy.
+ */
+typedef struct {
+  int32 vl_len_;
+  int32 nitems;
+  uint32 offsets[1];   /* VARIABLE LENGTH, items follow */
+} prefix_set;
+
+#define PSET_ITEMS(s)   ((char *) &(s)->offsets[(s)->nitems])
+#define PSET_ITEM(s, i) ((prefix_range *) (PSET_ITEMS(s) + (s)->offsets[i]))
+#define PG_GETARG_PREFIX_SET_P(n) ((prefix_set *) PG_DETOAST_DATUM(PG_GETARG_DATUM(n)))
+
+Datum prefix_set_in(PG_FUNCTION_ARGS);
+Datum prefix_set_out(PG_FUNCTION_ARGS);
+Datum prefix_set_recv(PG_FUNCTION_ARGS);
+Datum prefix_set_send(PG_FUNCTION_ARGS);
+Datum prefix_set_from_array(PG_FUNCTION_ARGS);
+Datum prefix_set_ranges(PG_FUNCTION_ARGS);
+Datum prefix_set_add(PG_FUNCTION_ARGS);
+Datum prefix_set_eq(PG_FUNCTION_ARGS);
+Datum prefix_set_contains(PG_FUNCTION_ARGS);
+Datum prefix_set_contained_by(PG_FUNCTION_ARGS);
+Datum prefix_set_overlaps(PG_FUNCTION_ARGS);
+Datum prefix_set_overlapped_by(PG_FUNCTION_ARGS);
+Datum prefix_set_union(PG_FUNCTION_ARGS);
+Datum prefix_set_inter(PG_FUNCTION_ARGS);
+Datum gpset_compress(PG_FUNCTION_ARGS);
+Datum gpset_consistent(PG_FUNCTION_ARGS);
+
+/*
+ * A range seen as base[first-last], where 015 is 01[5-5]. The empty
+ * prefix has no such form.
+ */
+static inline
+bool pr_set_range_form(prefix_range *pr, int *blen,
+		       unsigned char *first, unsigned char *last) {
+  int plen = strlen(pr->prefix);
+
+  if( pr->first != 0 ) {
+    *blen  = plen;
+    *first = (unsigned char) pr->first;
+    *last  = (unsigned char) pr->last;
+    return true;
+  }
+  if( plen == 0 )
+    return false;
+
+  *blen  = plen - 1;
+  *first = *last = (unsigned char) pr->prefix[plen - 1];
+  return true;
+}
+
+/*
+ * Normalizes the n ranges of prs in place, see above, and returns how
+ * many are left. The ranges are modified, so they must be copies.
+ *
+ * After pr_minimal_cover(), ranges next to each other under the same
+ * base are consecutive, as any range between them would be contained
+ * by one of them.
+ */
+static
+int pr_set_normalize(prefix_range **prs, int n) {
+  prefix_range *prev;
+  unsigned char pf, pl, cf, cl;
+  int i, k = 0, pblen, cblen;
+
+  for(i = 0; i < n; i++)
+    pr_normalize(prs[i]);
+
+  n = pr_minimal_cover(prs, n);
+
+  for(i = 0; i < n; i++) {
+    prev = k > 0 ? prs[k - 1] : NULL;
+
+    if( prev != NULL
+	&& pr_set_range_form(prev, &pblen, &pf, &pl)
+	&& pr_set_range_form(prs[i], &cblen, &cf, &cl)
+	&& pblen == cblen
+	&& memcmp(prev->prefix, prs[i]->prefix, pblen) == 0
+	&& cf <= pl + 1 ) {
+
+      prev->prefix[pblen] = 0;
+      prev->first = (char) pf;
+      prev->last  = (char) (cl > pl ? cl : pl);
+      continue;
+    }
+    prs[k++] = prs[i];
+  }
+  return k;
+}
+
+/*
+ * Builds the prefix_set of the n given ranges, normalizing them first.
+ */
+static
+prefix_set *pr_set_build(prefix_range **prs, int n) {
+  prefix_set *set;
+  Size size;
+  char *p;
+  int i, len;
+
+  n = pr_set_normalize(prs, n);
+
+  size = offsetof(prefix_set, offsets) + n * sizeof(uint32);
+  for(i = 0; i < n; i++)
+    size += sizeof(prefix_range) + strlen(prs[i]->prefix);
+
+  set = (prefix_set *) palloc0(size);
+  PREFIX_SET_VARSIZE(set, size);
+  set->nitems = n;
+
+  p = PSET_ITEMS(set);
+  for(i = 0; i < n; i++) {
+    len = strlen(prs[i]->prefix);
+
+    set->offsets[i] = p - PSET_ITEMS(set);
+    memcpy(p, prs[i], sizeof(prefix_range) + len);
+    p += sizeof(prefix_range) + len;
+  }
+  return set;
+}
+
+/*
+ * Copies of the ranges of a set, plus room for extra more.
+ */
+static
+prefix_range **pr_set_items(prefix_set *set, int extra) {
+  prefix_range **prs, *pr;
+  int i;
+
+  prs = (prefix_range **) palloc((set->nitems + extra + 1) * sizeof(prefix_range *));
+
+  for(i = 0; i < set->nitems; i++) {
+    pr = PSET_ITEM(set, i);
+    prs[i] = build_pr(pr->prefix, pr->first, pr->last);
+  }
+  return prs;
+}
+
+/*
+ * Compares the start of pr in the sweep order, prefix then first, to the
+ * given lo string.
+ */
+static inline
+int pr_set_lo_cmp(prefix_range *pr, const unsigned char *lo, int lolen) {
+  int plen = strlen(pr->prefix);
+  int len  = pr->first != 0 ? plen + 1 : plen;
+  int cmp  = memcmp(pr->prefix, lo, Min(plen, lolen));
+
+  if( cmp != 0 )
+    return cmp;
+
+  if( pr->first != 0 && lolen > plen
+      && (unsigned char) pr->first != lo[plen] )
+    return (unsigned char) pr->first - lo[plen];
+
+  return len - lolen;
+}
+
+/*
+ * Index of the last range starting at or before the query, -1 if none.
+ */
+static
+int pr_set_search(prefix_set *set, prefix_range *query) {
+  pr_sweep_item q;
+  int lo = 0, hi = set->nitems - 1, mid, res = -1;
+
+  pr_sweep_bounds(query, &q);
+
+  while( lo <= hi ) {
+    mid = lo + (hi - lo) / 2;
+
+    if( pr_set_lo_cmp(PSET_ITEM(set, mid), q.lo, q.lolen) <= 0 ) {
+      res = mid;
+      lo  = mid + 1;
+    }
+    else
+      hi = mid - 1;
+  }
+  pfree(q.lo);
+  pfree(q.hi);
+
+  return res;
+}
+
+static
+bool pr_set_contains(prefix_set *set, prefix_range *query) {
+  int i = pr_set_search(set, query);
+
+  return i >= 0 && pr_contains(PSET_ITEM(set, i), query, true);
+}
+
+/*
+ * The ranges before the one found end before the query starts, the
+ * ones after the next start after the next does.
+ */
+static
+bool pr_set_overlaps(prefix_set *set, prefix_range *query) {
+  int i = pr_set_search(set, query);
+
+  if( i >= 0 && pr_overlaps(PSET_ITEM(set, i), query) )
+    return true;
+
+  return i + 1 < set->nitems && pr_overlaps(PSET_ITEM(set, i + 1), query);
+}
+
+/*
+ * Intersection of two overlapping ranges: one contains the other, or
+ * they share their prefix.
+ */
+static
+prefix_range *pr_set_inter_pair(prefix_range *a, prefix_range *b) {
+  if( pr_contains(a, b, true) )
+    return build_pr(b->prefix, b->first, b->last);
+
+  if( pr_contains(b, a, true) )
+    return build_pr(a->prefix, a->first, a->last);
+
+  return pr_normalize(build_pr(a->prefix,
+			       (unsigned char) a->first > (unsigned char) b->first ? a->first : b->first,
+			       (unsigned char) a->last  < (unsigned char) b->last  ? a->last  : b->last));
+}
+
+/*
+ * The text representation is the one of arrays: {0146,01[2-4]}, where
+ * the elements are double quoted when empty or having a special char,
+ * with " and \ escaped by a \.
+ */
+static inline
+bool pr_set_needs_quote(const char *str) {
+  if( *str == 0 )
+    return true;
+
+  for(; *str; str++)
+    if( *str == ',' || *str == '{' || *str == '}' || *str == '"'
+	|| *str == '\\' || isspace((unsigned char) *str) )
+      return true;
+
+  return false;
+}
+
+PG_FUNCTION_INFO_V1(prefix_set_in);
+Datum
+prefix_set_in(PG_FUNCTION_ARGS)
+{
+  char *str = PG_GETARG_CSTRING(0);
+  char *p = str;
+  struct varlena *vdat;
+  prefix_range **prs;
+  StringInfoData buf;
+  int n = 0, size = 8;
+
+  prs = (prefix_range **) palloc(size * sizeof(prefix_range *));
+  initStringInfo(&buf);
+
+  while( isspace((unsigned char) *p) )
+    p++;
+
+  if( *p++ != '{' )
+    ereport(ERROR,
+	    (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+	     errmsg("invalid prefix_set value: \"%s\"", str),
+	     errdetail("Missing left brace.")));
+
+  while( isspace((unsigned char) *p) )
+    p++;
+
+  while( *p != '}' ) {
+    buf.len = 0;
+    buf.data[0] = 0;
+
+    if( *p == '"' ) {
+      for(p++; *p && *p != '"'; p++) {
+	if( *p == '\\' && p[1] != 0 )
+	  p++;
+	appendStringInfoChar(&buf, *p);
+      }
+      if( *p == '"' )
+	p++;
+    }
+    else {
+      for(; *p && *p != ',' && *p != '}'; p++)
+	appendStringInfoChar(&buf, *p);
+
+      while( buf.len > 0 && isspace((unsigned char) buf.data[buf.len - 1]) )
+	buf.data[--buf.len] = 0;
+    }
+
+    while( isspace((unsigned char) *p) )
+      p++;
+
+    if( *p != ',' && *p != '}' )
+      ereport(ERROR,
+	      (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+	       errmsg("invalid prefix_set value: \"%s\"", str),
+	       errdetail("Missing right brace.")));
+
+    vdat = pr_varlena_from_str(buf.data, buf.len);
+    if( vdat == NULL )
+      ereport(ERROR,
+	      (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+	       errmsg("invalid prefix_range value: \"%s\"", buf.data)));
+
+    if( n == size ) {
+      size *= 2;
+      prs = (prefix_range **) repalloc(prs, size * sizeof(prefix_range *));
+    }
+    prs[n++] = (prefix_range *) VARDATA(vdat);
+
+    if( *p == ',' )
+      for(p++; isspace((unsigned char) *p); p++);
+  }
+  p++;
+
+  while( isspace((unsigned char) *p) )
+    p++;
+
+  if( *p != 0 )
+    ereport(ERROR,
+	    (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+	     errmsg("invalid prefix_set value: \"%s\"", str),
+	     errdetail("Junk after right brace.")));
+
+  PG_RETURN_POINTER(pr_set_build(prs, n));
+}
+
+PG_FUNCTION_INFO_V1(prefix_set_out);
+Datum
+prefix_set_out(PG_FUNCTION_ARGS)
+{
+  prefix_set *set = PG_GETARG_PREFIX_SET_P(0);
+  StringInfoData buf;
+  char *elem, *c;
+  int i;
+
+  initStringInfo(&buf);
+  appendStringInfoChar(&buf, '{');
+
+  for(i = 0; i < set->nitems; i++) {
+    if( i > 0 )
+      appendStringInfoChar(&buf, ',');
+
+    elem = pr_to_str(PSET_ITEM(set, i));
+
+    if( !pr_set_needs_quote(elem) ) {
+      appendStringInfoString(&buf, elem);
+      continue;
+    }
+
+    appendStringInfoChar(&buf, '"');
+    for(c = elem; *c; c++) {
+      if( *c == '"' || *c == '\\' )
+	appendStringInfoChar(&buf, '\\');
+      appendStringInfoChar(&buf, *c);
+    }
+    appendStringInfoChar(&buf, '"');
+  }
+  appendStringInfoChar(&buf, '}');
+
+  PG_RETURN_CSTRING(buf.data);
+}
+
+/*
+ * Binary format, version 1: a version byte, the int4 number of ranges
+ * then each range in the prefix_range binary format, without its version
+ * byte. The ranges are normalized again, as the input function does.
+ */
+#define PSET_BINARY_VERSION 1
+
+PG_FUNCTION_INFO_V1(prefix_set_recv);
+Datum
+prefix_set_recv(PG_FUNCTION_ARGS)
+{
+  StringInfo buf = (StringInfo) PG_GETARG_POINTER(0);
+  int version    = pq_getmsgbyte(buf);
+  prefix_range **prs;
+  int n, i;
+
+  if( version != PSET_BINARY_VERSION )
+    ereport(ERROR,
+	    (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+	     errmsg("unsupported prefix_set binary format version %d", version)));
+
+  n = (int) pq_getmsgint(buf, 4);
+
+  /* a range takes at least 6 bytes */
+  if( n < 0 || n > (buf->len - buf->cursor) / 6 )
+    ereport(ERROR,
+	    (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+	     errmsg("invalid prefix_set number of ranges %d", n)));
+
+  prs = (prefix_range **) palloc((n + 1) * sizeof(prefix_range *));
+
+  for(i = 0; i < n; i++)
+    prs[i] = (prefix_range *) VARDATA(pr_recv(buf));
+
+  pq_getmsgend(buf);
+
+  PG_RETURN_POINTER(pr_set_build(prs, n));
+}
+
+PG_FUNCTION_INFO_V1(prefix_set_send);
+Datum
+prefix_set_send(PG_FUNCTION_ARGS)
+{
+  prefix_set *set = PG_GETARG_PREFIX_SET_P(0);
+  StringInfoData buf;
+  int i;
+
+  pq_begintypsend(&buf);
+  pq_sendbyte(&buf, PSET_BINARY_VERSION);
+  pq_sendint(&buf, set->nitems, 4);
+
+  for(i = 0; i < set->nitems; i++)
+    pr_send(&buf, PSET_ITEM(set, i));
+
+  PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+/*
+ * prefix_set(prefix_range[]) RETURNS prefix_set
+ */
+PG_FUNCTION_INFO_V1(prefix_set_from_array);
+Datum
+prefix_set_from_array(PG_FUNCTION_ARGS)
+{
+  ArrayType *array = PG_GETARG_ARRAYTYPE_P(0);
+  prefix_range **prs, *pr;
+  Datum *elems;
+  bool *nulls;
+  int n, i, k = 0;
+
+#if PG_MAJOR_VERSION >= 802
+  deconstruct_array(array, ARR_ELEMTYPE(array), -1, false, 'i',
+		    &elems, &nulls, &n);
+#else
+  deconstruct_array(array, ARR_ELEMTYPE(array), -1, false, 'i',
+		    &elems, &n);
+  nulls = NULL;
+#endif
+
+  prs = (prefix_range **) palloc((n + 1) * sizeof(prefix_range *));
+
+  for(i = 0; i < n; i++) {
+    if( nulls != NULL && nulls[i] )
+      continue;
+
+    pr = DatumGetPrefixRange(PREFIX_DETOAST_DATUM(elems[i]));
+    prs[k++] = build_pr(pr->prefix, pr->first, pr->last);
+  }
+
+  PG_RETURN_POINTER(pr_set_build(prs, k));
+}
+
+/*
+ * prefix_set_ranges(prefix_set) RETURNS SETOF prefix_range
+ */
+PG_FUNCTION_INFO_V1(prefix_set_ranges);
+Datum
+prefix_set_ranges(PG_FUNCTION_ARGS)
+{
+  FuncCallContext *funcctx;
+  prefix_set *set;
+
+  if( SRF_IS_FIRSTCALL() ) {
+    MemoryContext oldcontext;
+
+    funcctx    = SRF_FIRSTCALL_INIT();
+    oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+    set = (prefix_set *) PG_DETOAST_DATUM_COPY(PG_GETARG_DATUM(0));
+    funcctx->max_calls = set->nitems;
+    funcctx->user_fctx = set;
+
+    MemoryContextSwitchTo(oldcontext);
+  }
+
+  funcctx = SRF_PERCALL_SETUP();
+  set     = (prefix_set *) funcctx->user_fctx;
+
+  if( funcctx->call_cntr < funcctx->max_calls )
+    SRF_RETURN_NEXT(funcctx,
+		    PrefixRangeGetDatum(PSET_ITEM(set, funcctx->call_cntr)));
+
+  SRF_RETURN_DONE(funcctx);
+}
+
+/*
+ * prefix_set_add(prefix_set, prefix_range) RETURNS prefix_set, the set
+ * with one more range. The prefix_set_agg() aggregate rather collects an
+ * array and builds the set once, with prefix_set(prefix_range[]).
+ */
+PG_FUNCTION_INFO_V1(prefix_set_add);
+Datum
+prefix_set_add(PG_FUNCTION_ARGS)
+{
+  prefix_set *set  = PG_GETARG_PREFIX_SET_P(0);
+  prefix_range *pr = PG_GETARG_PREFIX_RANGE_P(1);
+  prefix_range **prs;
+
+  if( pr_set_contains(set, pr) )
+    PG_RETURN_POINTER(set);
+
+  prs = pr_set_items(set, 1);
+  prs[set->nitems] = build_pr(pr->prefix, pr->first, pr->last);
+
+  PG_RETURN_POINTER(pr_set_build(prs, set->nitems + 1));
+}
+
+PG_FUNCTION_INFO_V1(prefix_set_eq);
+Datum
+prefix_set_eq(PG_FUNCTION_ARGS)
+{
+  prefix_set *a = PG_GETARG_PREFIX_SET_P(0);
+  prefix_set *b = PG_GETARG_PREFIX_SET_P(1);
+
+  PG_RETURN_BOOL( VARSIZE(a) == VARSIZE(b)
+		  && memcmp(a, b, VARSIZE(a)) == 0 );
+}
+
+PG_FUNCTION_INFO_V1(prefix_set_contains);
+Datum
+prefix_set_contains(PG_FUNCTION_ARGS)
+{
+  PG_RETURN_BOOL( pr_set_contains(PG_GETARG_PREFIX_SET_P(0),
+				  PG_GETARG_PREFIX_RANGE_P(1)) );
+}
+
+PG_FUNCTION_INFO_V1(prefix_set_contained_by);
+Datum
+prefix_set_contained_by(PG_FUNCTION_ARGS)
+{
+  PG_RETURN_BOOL( pr_set_contains(PG_GETARG_PREFIX_SET_P(1),
+				  PG_GETARG_PREFIX_RANGE_P(0)) );
+}
+
+PG_FUNCTION_INFO_V1(prefix_set_overlaps);
+Datum
+prefix_set_overlaps(PG_FUNCTION_ARGS)
+{
+  PG_RETURN_BOOL( pr_set_overlaps(PG_GETARG_PREFIX_SET_P(0),
+				  PG_GETARG_PREFIX_RANGE_P(1)) );
+}
+
+PG_FUNCTION_INFO_V1(prefix_set_overlapped_by);
+Datum
+prefix_set_overlapped_by(PG_FUNCTION_ARGS)
+{
+  PG_RETURN_BOOL( pr_set_overlaps(PG_GETARG_PREFIX_SET_P(1),
+				  PG_GETARG_PREFIX_RANGE_P(0)) );
+}
+
+PG_FUNCTION_INFO_V1(prefix_set_union);
+Datum
+prefix_set_union(PG_FUNCTION_ARGS)
+{
+  prefix_set *a = PG_GETARG_PREFIX_SET_P(0);
+  prefix_set *b = PG_GETARG_PREFIX_SET_P(1);
+  prefix_range **prs = pr_set_items(a, b->nitems);
+  prefix_range *pr;
+  int i;
+
+  for(i = 0; i < b->nitems; i++) {
+    pr = PSET_ITEM(b, i);
+    prs[a->nitems + i] = build_pr(pr->prefix, pr->first, pr->last);
+  }
+
+  PG_RETURN_POINTER(pr_set_build(prs, a->nitems + b->nitems));
+}
+
+/*
+ * Both sets being sorted and disjoint, we walk them together, always
+ * leaving the range ending first.
+ */
+PG_FUNCTION_INFO_V1(prefix_set_inter);
+Datum
+prefix_set_inter(PG_FUNCTION_ARGS)
+{
+  prefix_set *a = PG_GETARG_PREFIX_SET_P(0);
+  prefix_set *b = PG_GETARG_PREFIX_SET_P(1);
+  prefix_range **prs, *pa, *pb;
+  pr_sweep_item ia, ib;
+  int i = 0, j = 0, n = 0;
+
+  prs = (prefix_range **) palloc((a->nitems + b->nitems + 1) * sizeof(prefix_range *));
+
+  while( i < a->nitems && j < b->nitems ) {
+    pa = PSET_ITEM(a, i);
+    pb = PSET_ITEM(b, j);
+
+    if( pr_overlaps(pa, pb) )
+      prs[n++] = pr_set_inter_pair(pa, pb);
+
+    pr_sweep_bounds(pa, &ia);
+    pr_sweep_bounds(pb, &ib);
+
+    if( pr_bound_cmp(ia.hi, ia.hilen, ib.hi, ib.hilen) <= 0 )
+      i++;
+    else
+      j++;
+
+    pfree(ia.lo); pfree(ia.hi);
+    pfree(ib.lo); pfree(ib.hi);
+  }
+
+  PG_RETURN_POINTER(pr_set_build(prs, n));
+}
+
+/*
+ * The leaf keys are the union of the ranges of the set, the inner keys
+ * are prefix_range already.
+ */
+PG_FUNCTION_INFO_V1(gpset_compress);
+Datum
+gpset_compress(PG_FUNCTION_ARGS)
+{
+  GISTENTRY *entry = (GISTENTRY *) PG_GETARG_POINTER(0);
+  GISTENTRY *retval;
+  prefix_set *set;
+  prefix_range *cover;
+  int i;
+
+  if( !entry->leafkey )
+    PG_RETURN_POINTER(entry);
+
+  set = (prefix_set *) PG_DETOAST_DATUM(entry->key);
+
+  if( set->nitems == 0 )
+    cover = build_pr("", 0, 0);
+  else {
+    cover = PSET_ITEM(set, 0);
+
+    for(i = 1; i < set->nitems; i++)
+      cover = pr_union(cover, PSET_ITEM(set, i));
+  }
+
+  retval = (GISTENTRY *) palloc(sizeof(GISTENTRY));
+#if PG_MAJOR_VERSION >= 802
+  gistentryinit(*retval, PrefixRangeGetDatum(cover),
+		entry->rel, entry->page, entry->offset, FALSE);
+#else
+  gistentryinit(*retval, PrefixRangeGetDatum(cover),
+		entry->rel, entry->page, entry->offset,
+		VARSIZE(DatumGetPointer(PrefixRangeGetDatum(cover))), FALSE);
+#endif
+
+  PG_RETURN_POINTER(retval);
+}
+
+/*
+ * Strategies are 1 for @> and 4 for &&, as in gist_prefix_range_ops.
+ * The keys are unions of ranges so we always recheck, and before 8.4
+ * the operator class says so.
+ */
+PG_FUNCTION_INFO_V1(gpset_consistent);
+Datum
+gpset_consistent(PG_FUNCTION_ARGS)
+{
+  GISTENTRY *entry = (GISTENTRY *) PG_GETARG_POINTER(0);
+  prefix_range *query = PG_GETARG_PREFIX_RANGE_P(1);
+  StrategyNumber strategy = (StrategyNumber) PG_GETARG_UINT16(2);
+  prefix_range *key = DatumGetPrefixRange(entry->key);
+
+  if( PG_NARGS() == 5 )
+    *((bool *) PG_GETARG_POINTER(4)) = true;
+
+  switch( strategy ) {
+  case 1:
+    PG_RETURN_BOOL( pr_contains(key, query, true) );
+
+  case 4:
+    PG_RETURN_BOOL( pr_overlaps(key, query) );
+
+  default:
+    PG_RETURN_BOOL( false );
+  }
+}
+
+/**
+ * Suffix matching
+ *
+ * Domains and other keys matched on their end are indexed as the
+ * prefix_range of their reversed key, so that @>, the GiST opclass and
+ * the longest match ordering all apply as is:
+ *
+ *  - prefix_range_suffix(text) reverses the characters, example becomes
+ *    elpmaxe, and keeps the bytes of a multibyte one in their order;
+ *  - prefix_range_domain(text) reverses the labels of a domain name, and
+ *    ends it with a dot, so that sip.carrier.example becomes
+ *    example.carrier.sip. and only matches whole labels. ASCII letters
+ *    are lower cased, a leading *. and the trailing root dot are removed.
+ *
+ * Both are immutable, for use in expression indexes.
+ */
+Datum prefix_range_suffix(PG_FUNCTION_ARGS);
+Datum prefix_range_domain(PG_FUNCTION_ARGS);
+
+static
+prefix_range *pr_reversed_key(const char *key, int len) {
+  prefix_range *pr = (prefix_range *) palloc(sizeof(prefix_range) + len + 1);
+
+  pr->first = 0;
+  pr->last  = 0;
+  pr->prefix[len] = 0;
+
+  if( memchr(key, PR_OPEN, len) != NULL || memchr(key, PR_CLOSE, len) != NULL )
+    ereport(ERROR,
+	    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+	     errmsg("invalid character in prefix_range prefix")));
+
+  return pr;
+}
+
+PG_FUNCTION_INFO_V1(prefix_range_suffix);
+Datum
+prefix_range_suffix(PG_FUNCTION_ARGS)
+{
+  text *txt = PREFIX_PG_GETARG_TEXT(0);
+  char *str = PREFIX_VARDATA(txt);
+  int len   = PREFIX_VARSIZE(txt);
+  prefix_range *pr = pr_reversed_key(str, len);
+  int i, clen;
+
+  for(i = 0; i < len; i += clen) {
+    clen = Min(pg_mblen(str + i), len - i);
+    memcpy(pr->prefix + len - i - clen, str + i, clen);
+  }
+
+  PG_RETURN_PREFIX_RANGE_P(pr);
+}
+
+PG_FUNCTION_INFO_V1(prefix_range_domain);
+Datum
+prefix_range_domain(PG_FUNCTION_ARGS)
+{
+  text *txt = PREFIX_PG_GETARG_TEXT(0);
+  char *str = PREFIX_VARDATA(txt);
+  int len   = PREFIX_VARSIZE(txt);
+  prefix_range *pr;
+  char *out;
+  int end, start, i;
+
+  if( len >= 2 && str[0] == '*' && str[1] == '.' ) {
+    str += 2;
+    len -= 2;
+  }
+  if( len > 0 && str[len - 1] == '.' )
+    len--;
+
+  /* every label is followed by a dot in the key, which has room for it */
+  pr  = pr_reversed_key(str, len);
+  out = pr->prefix;
+
+  for(end = len; len > 0 && end >= 0; end = start - 1) {
+    for(start = end; start > 0 && str[start - 1] != '.'; start--);
+
+    /* ASCII only, the key mustn't depend on lc_ctype */
+    for(i = start; i < end; i++)
+      *out++ = str[i] >= 'A' && str[i] <= 'Z' ? str[i] + ('a' - 'A') : str[i];
+    *out++ = '.';
+  }
+  *out = 0;
+
+  PG_RETURN_PREFIX_RANGE_P(pr);
+}
@@ -0,0 +1,956 @@
+/**
+ * prefix_range kernels: the datatype and the functions working on it
+ * which don't need a backend, so that prefix_bench.c can time them
+ * outside of PostgreSQL.
+ *
+ * prefix.c includes this file once it has set up its PREFIX_* macros,
+ * and the standalone programs define PREFIX_STANDALONE first, which
+ * maps palloc() and friends to the C library.
+ */
+
+#ifndef PREFIX_H
+#define PREFIX_H
+
+#ifdef PREFIX_STANDALONE
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef char bool;
+#define true   ((bool) 1)
+#define false  ((bool) 0)
+
+typedef unsigned short uint16;
+typedef unsigned int   uint32;
+typedef int            int32;
+
+#define palloc(s)    malloc(s)
+#define pfree(p)     free(p)
+#define Assert(c)    assert(c)
+#endif
+
+#include <math.h>
+
+/**
+ * prefix_range datatype, varlena structure
+ */
+typedef struct {
+  char first;
+  char last;
+  char prefix[1]; /* this is a varlena structure, data follows */
+} prefix_range;
+
+enum pr_delimiters_t {
+  PR_OPEN   = '[',
+  PR_CLOSE  = ']',
+  PR_SEP    = '-'
+} pr_delimiters;
+
+/**
+ * Used by prefix_contains_internal and pr_contains_prefix.
+ *
+ * plen is the length of string p, qlen the length of string q, the
+ * caller are dealing with either text * or char * and its their
+ * responsabolity to use either strlen() or PREFIX_VARSIZE()
+ */
+static inline
+bool __prefix_contains(char *p, char *q, int plen, int qlen) {
+  if(qlen < plen )
+    return false;
+
+  return memcmp(p, q, plen) == 0;
+}
+
+static inline
+char *__greater_prefix(char *a, char *b, int alen, int blen)
+{
+  int i = 0;
+  char *result = NULL;
+
+  for(i=0; i<alen && i<blen && a[i] == b[i]; i++);
+  
+  /* i is the last common char position in a, or 0 */
+  if( i == 0 ) {
+    /**
+     * return ""
+     */
+    result = (char *)palloc(sizeof(char));
+  }
+  else {
+    result = (char *)palloc((i+1) * sizeof(char));
+    memcpy(result, a, i);
+  }
+  result[i] = 0;
+    
+  return result;
+}
+
+/**
+ * Helper function which builds a prefix_range from a prefix, a first
+ * and a last component, making a copy of the prefix string. 
+ */
+static inline
+prefix_range *build_pr(const char *prefix, char first, char last) {
+  int s = strlen(prefix) + 1;
+  prefix_range *pr = palloc(sizeof(prefix_range) + s);
+  memcpy(pr->prefix, prefix, s);
+  pr->first = first;
+  pr->last  = last;
+
+#ifdef DEBUG_PR_IN
+  elog(NOTICE,
+       "build_pr: pr->prefix = '%s', pr->first = %d, pr->last = %d", 
+       pr->prefix, pr->first, pr->last);
+#endif
+
+  return pr;
+}
+
+/**
+ * Normalize a prefix_range, in place. Two cases are handled:
+ *
+ *  abc[x-x] is rewritten abcx
+ *  abc[x-y] is rewritten abc[y-x] when y < x
+ *
+ * The first case needs room for one more char in the prefix, which
+ * build_pr() and pr_varlena_from_str() both leave.
+ */
+static inline
+prefix_range *pr_normalize(prefix_range *pr) {
+  char tmpswap;
+  int len;
+
+  if( pr->first != 0 && pr->first == pr->last ) {
+#ifdef DEBUG_PR_NORMALIZE
+    elog(NOTICE, "prefix_range %s[%c-%c] normalized",
+	 pr->prefix, pr->first, pr->last);
+#endif
+
+    len = strlen(pr->prefix);
+    pr->prefix[len]   = pr->first;
+    pr->prefix[len+1] = 0;
+
+    pr->first = 0;
+    pr->last  = 0;
+  }
+  else if( pr->first > pr->last ) {
+    tmpswap   = pr->first;
+    pr->first = pr->last;
+    pr->last  = tmpswap;
+  }
+  return pr;
+}
+
+/**
+ * The output writer, formatting prefix[first-last] in the given buffer,
+ * which pr_str_len() tells the size of (without terminating NUL). plen is
+ * strlen(pr->prefix).
+ */
+static inline
+int pr_str_len(prefix_range *pr, int plen) {
+  return pr->first != 0 ? plen + 5 : plen;
+}
+
+static inline
+void pr_write_str(prefix_range *pr, int plen, char *out) {
+  memcpy(out, pr->prefix, plen);
+
+  if( pr->first != 0 ) {
+    out += plen;
+    *out++ = PR_OPEN;
+    *out++ = pr->first;
+    *out++ = PR_SEP;
+    *out++ = pr->last;
+    *out   = PR_CLOSE;
+  }
+}
+
+static inline
+char *pr_to_str(prefix_range *pr) {
+  int plen  = strlen(pr->prefix);
+  int len   = pr_str_len(pr, plen);
+  char *out = (char *)palloc(len + 1);
+
+  pr_write_str(pr, plen, out);
+  out[len] = 0;
+
+  return out;
+}
+
+/*
+ * Allow users to use length(prefix) rather than length(prefix::text), and
+ * while at it, provides an implementation which won't count the displaying
+ * artifacts that are the [] and -.
+ */
+static inline
+int pr_length(prefix_range *pr) {
+  int len = strlen(pr->prefix);
+  
+  if( pr->first != 0 )
+    len += 1;
+
+  if( pr->last != 0 )
+    len += 1;
+
+  return len;
+}
+
+static inline
+bool pr_eq(prefix_range *a, prefix_range *b) {
+  int sa = strlen(a->prefix);
+  int sb = strlen(b->prefix);
+
+  return sa == sb
+    && memcmp(a->prefix, b->prefix, sa) == 0
+    && a->first == b->first 
+    && a->last  == b->last;
+}
+
+/*
+ * We invent a prefix_range ordering for convenience, but that's
+ * dangerous. Use the BTree opclass at your own risk.
+ *
+ * On the other hand, when your routing table does contain pretty static
+ * data and you test it carefully or know it will fit into the ordering
+ * simplification, you're good to go.
+ *
+ * Baring bug, the constraint is to have non-overlapping data.
+ */
+
+/*static inline
+bool pr_lt(prefix_range *a, prefix_range *b, bool eqval) {
+*/
+
+static inline
+int pr_cmp(prefix_range *a, prefix_range *b) {
+  int cmp = 0;
+  int alen = strlen(a->prefix);
+  int blen = strlen(b->prefix);
+  int mlen = alen; /* minimum length */
+  char *p  = a->prefix;
+  char *q  = b->prefix;
+
+  /*
+   * First case, common prefix length
+   */
+  if( alen == blen ) {
+    cmp = memcmp(p, q, alen);
+
+    /* Uncommon prefix, easy to compare */
+    if( cmp != 0 ) 
+      return cmp;
+
+    /* Common prefix, check for (sub)ranges */
+    else
+      return (a->first == b->first) ? (a->last - b->last) : (a->first - b->first);
+  }
+
+  /* For memcmp() safety, we need the minimum length */
+  if( mlen > blen )
+    mlen = blen;
+
+  /*
+   * Don't forget we may have [x-y] prefix style, that's empty prefix, only range.
+   */
+  if( alen == 0 && a->first != 0 ) {
+    /* return (eqval ? (a->first <= q[0]) : (a->first < q[0])); */
+    return a->first - q[0];
+  }
+  else if( blen == 0 && b->first != 0 ) {
+    /* return (eqval ? (p[0] <= b->first) : (p[0] < b->first)); */
+    return p[0] - b->first;
+  }
+
+  /*
+   * General case
+   *
+   * When memcmp() on the shorter of p and q returns 0, that means they
+   * share a common prefix: avoid to say that '93' < '9377' and '9377' <
+   * '93'.
+   */
+  cmp = memcmp(p, q, mlen);
+  
+  if( cmp == 0 )
+    /*
+     * we are comparing e.g. '1' and '12' (the shorter contains the
+     * smaller), so let's pretend '12' < '1' as it contains less elements.
+     */
+    return (alen == mlen) ? 1 : -1;
+
+  return cmp;
+}
+
+static inline
+bool pr_lt(prefix_range *a, prefix_range *b, bool eqval) {
+  int cmp = pr_cmp(a, b);
+  return eqval ? cmp <= 0 : cmp < 0;
+}
+
+static inline
+bool pr_gt(prefix_range *a, prefix_range *b, bool eqval) {
+  int cmp = pr_cmp(a, b);
+  return eqval ? cmp >= 0 : cmp > 0;
+}
+
+static inline
+bool pr_contains(prefix_range *left, prefix_range *right, bool eqval) {
+  int sl;
+  int sr;
+  bool left_prefixes_right;
+
+  if( pr_eq(left, right) )
+    return eqval;
+
+  sl = strlen(left->prefix);
+  sr = strlen(right->prefix);
+
+  if( sr < sl )
+    return false;
+
+  left_prefixes_right = memcmp(left->prefix, right->prefix, sl) == 0;
+
+  if( left_prefixes_right ) {
+    if( sl == sr )
+      return left->first == 0 ||
+	(left->first <= right->first && left->last >= right->last);
+
+    return left->first == 0 ||
+      (left->first <= right->prefix[sl] && right->prefix[sl] <= left->last);
+  }
+  return false;
+}
+
+static inline
+prefix_range *pr_union(prefix_range *a, prefix_range *b) {
+  prefix_range *res = NULL;
+  int alen = strlen(a->prefix);
+  int blen = strlen(b->prefix);
+  char *gp = NULL;
+  int gplen;
+  char min, max;
+
+  if( 0 == alen && 0 == blen ) {
+    res = build_pr("",
+		   a->first <= b->first ? a->first : b->first,
+		   a->last  >= b->last  ? a->last : b->last);
+    return pr_normalize(res);
+  }
+
+  gp = __greater_prefix(a->prefix, b->prefix, alen, blen);
+  gplen = strlen(gp);
+
+  if( gplen == 0 ) {
+    res = build_pr("", 0, 0);
+    if( alen > 0 && blen > 0 ) {
+      res->first = a->prefix[0];
+      res->last  = b->prefix[0];
+    }
+    else if( alen == 0 ) {
+      res->first = a->first <= b->prefix[0] ? a->first : b->prefix[0];
+      res->last  = a->last  >= b->prefix[0] ? a->last  : b->prefix[0];
+    }
+    else if( blen == 0 ) {
+      res->first = b->first <= a->prefix[0] ? b->first : a->prefix[0];
+      res->last  = b->last  >= a->prefix[0] ? b->last  : a->prefix[0];
+    }
+  }
+  else {
+    res = build_pr(gp, 0, 0);
+
+    if( gplen == alen && alen == blen ) {
+      res->first = a->first <= b->first ? a->first : b->first;
+      res->last  = a->last  >= b->last  ? a->last : b->last;
+    }
+    else if( gplen == alen ) {
+      Assert(alen < blen);
+      res->first = a->first <= b->prefix[alen] ? a->first : b->prefix[alen];
+      res->last  = a->last  >= b->prefix[alen] ? a->last  : b->prefix[alen];
+    }
+    else if( gplen == blen ) {
+      Assert(blen < alen);
+      res->first = b->first <= a->prefix[blen] ? b->first : a->prefix[blen];
+      res->last  = b->last  >= a->prefix[blen] ? b->last  : a->prefix[blen];
+    }
+    else {
+      Assert(gplen < alen && gplen < blen);
+      min = a->prefix[gplen];
+      max = b->prefix[gplen];
+
+      if( min > max ) {
+	min = b->prefix[gplen];
+	max = a->prefix[gplen];
+      }
+      res->first = min;
+      res->last  = max;
+#ifdef DEBUG_UNION
+    elog(NOTICE, "union a: %s %d %d", a->prefix, a->first, a->last);
+    elog(NOTICE, "union b: %s %d %d", b->prefix, b->first, b->last);
+    elog(NOTICE, "union r: %s %d %d", res->prefix, res->first, res->last);
+#endif
+    }
+  }
+  return pr_normalize(res);
+}
+
+static inline
+prefix_range *pr_inter(prefix_range *a, prefix_range *b) {
+  prefix_range *res = NULL;
+  int alen = strlen(a->prefix);
+  int blen = strlen(b->prefix);
+  char *gp = NULL;
+  int gplen;
+
+  if( 0 == alen && 0 == blen ) {
+    res = build_pr("",
+		   a->first > b->first ? a->first : b->first,
+		   a->last  < b->last  ? a->last  : b->last);
+    return pr_normalize(res);
+  }
+
+  gp = __greater_prefix(a->prefix, b->prefix, alen, blen);
+  gplen = strlen(gp);
+
+  if( gplen != alen && gplen != blen ) {
+    return build_pr("", 0, 0);
+  }
+
+  if( gplen == alen && 0 == alen ) {
+    if( a->first <= b->prefix[0] && b->prefix[0] <= a->last ) {      
+      res = build_pr(b->prefix, b->first, b->last);
+    }
+    else
+      res = build_pr("", 0, 0);
+  }
+  else if( gplen == blen && 0 == blen ) {
+    if( b->first <= a->prefix[0] && a->prefix[0] <= b->last ) {      
+      res = build_pr(a->prefix, a->first, a->last);
+    }
+    else
+      res = build_pr("", 0, 0);
+  }
+  else if( gplen == alen && alen == blen ) {
+    res = build_pr(gp,
+		   a->first > b->first ? a->first : b->first,
+		   a->last  > b->last  ? a->last  : b->last);
+
+#ifdef DEBUG_INTER
+    elog(NOTICE, "inter a: %s %d %d", a->prefix, a->first, a->last);
+    elog(NOTICE, "inter b: %s %d %d", b->prefix, b->first, b->last);
+    elog(NOTICE, "inter r: %s %d %d", res->prefix, res->first, res->last);
+#endif
+  }
+  else if( gplen == alen ) {
+    Assert(gplen < blen);
+    res = build_pr(b->prefix, b->first, b->last);
+  }
+  else if( gplen == blen ) {
+    Assert(gplen < alen);
+    res = build_pr(a->prefix, a->first, a->last);
+  }
+
+  return pr_normalize(res);
+}
+
+/**
+ * true if ranges have at least one common element
+ *
+ * Called for each candidate of a GiST && scan, as when checking an
+ * EXCLUDE USING gist (prefix WITH &&) constraint, so we avoid computing
+ * pr_inter(): either a prefix is a prefix of the other one or the ranges
+ * are disjoint, and then it's about the next character.
+ */
+static inline
+bool pr_overlaps(prefix_range *a, prefix_range *b) {
+  prefix_range *tmp;
+  int i;
+
+  for(i=0; a->prefix[i] != 0 && a->prefix[i] == b->prefix[i]; i++);
+
+  if( a->prefix[i] != 0 && b->prefix[i] != 0 )
+    return false;
+
+  /* make a the range with the shortest prefix */
+  if( a->prefix[i] != 0 ) {
+    tmp = a;
+    a = b;
+    b = tmp;
+  }
+
+  if( a->first == 0 )
+    return true;
+
+  if( b->prefix[i] != 0 )
+    return a->first <= b->prefix[i] && b->prefix[i] <= a->last;
+
+  return b->first == 0 || (a->first <= b->last && b->first <= a->last);
+}
+
+static inline
+float __pr_penalty(prefix_range *orig, prefix_range *new)
+{
+  float penalty;
+  int  nlen, olen, gplen, dist = 0;
+  char tmp;
+
+  olen  = strlen(orig->prefix);
+  nlen  = strlen(new->prefix);
+  for(gplen=0; gplen<olen && gplen<nlen
+	&& orig->prefix[gplen] == new->prefix[gplen]; gplen++);
+
+  dist  = 1;
+
+  if( 0 == olen && 0 == nlen ) {
+    if( orig->last >= new->first )
+      dist = 0;
+    else
+      dist = new->first - orig->last;
+  }
+  else if( 0 == olen ) {
+    /**
+     * penalty('[a-b]', 'xyz');
+     */
+    if( orig->first != 0 ) {
+      tmp = new->prefix[0];
+
+      if( orig->first <= tmp && tmp <= orig->last ) {
+	gplen = 1;
+
+	dist = 1 + (int)tmp - (int)orig->first;
+	if( (1 + (int)orig->last - (int)tmp) < dist )
+	  dist = 1 + (int)orig->last - (int)tmp;
+      }
+      else
+	dist = (orig->first > tmp ? orig->first - tmp  : tmp - orig->last );
+    }
+  }
+  else if( 0 == nlen ) {
+    /**
+     * penalty('abc', '[x-y]');
+     */
+    if( new->first != 0 ) {
+      tmp = orig->prefix[0];
+
+      if( new->first <= tmp && tmp <= new->last ) {
+	gplen = 1;
+
+	dist = 1 + (int)tmp - (int)new->first;
+	if( (1 + (int)new->last - (int)tmp) < dist )
+	  dist = 1 + (int)new->last - (int)tmp;
+      }
+      else
+	dist = (new->first > tmp ? new->first - tmp  : tmp - new->last );
+    }
+  }
+  else {
+    /**
+     * General case
+     */
+
+    if( gplen > 0 ) {
+      if( olen > gplen && nlen == gplen && new->first != 0 ) {
+	/**
+	 * gpr_penalty('abc[f-l]', 'ab[x-y]')
+	 */
+	if( new->first <= orig->prefix[gplen]
+	    && orig->prefix[gplen] <= new->last ) {
+
+	  dist   = 1 + (int)orig->prefix[gplen] - (int)new->first;	  
+	  if( (1 + (int)new->last - (int)orig->prefix[gplen]) < dist )
+	    dist = 1 + (int)new->last - (int)orig->prefix[gplen];
+
+	  gplen += 1;
+	}
+	else {
+	  dist += 1;
+	}
+      }
+      else if( nlen > gplen && olen == gplen && orig->first != 0 ) {
+	/**
+	 * gpr_penalty('ab[f-l]', 'abc[x-y]')
+	 */
+	if( orig->first <= new->prefix[gplen]
+	    && new->prefix[gplen] <= orig->last ) {
+
+	  dist   = 1 + (int)new->prefix[gplen] - (int)orig->first;
+	  if( (1 + (int)orig->last - (int)new->prefix[gplen]) < dist )
+	    dist = 1 + (int)orig->last - (int)new->prefix[gplen];
+
+	  gplen += 1;
+	}
+	else {
+	  dist += 1;
+	}
+      }	
+    }
+    /**
+     * penalty('abc[f-l]', 'xyz[g-m]'), nothing common
+     * dist = 1, gplen = 0, penalty = 1
+     */
+  }
+  /*
+   * dist / 256^gplen, without calling powf() for each key. powf() used to
+   * overflow from a common prefix of 16 on, where all the penalties were
+   * 0, these stay nonzero and ordered by gplen until they underflow:
+   * that change of the insert placement of long prefixes is intended.
+   */
+  penalty = ldexpf((float)dist, -8 * gplen);
+
+#ifdef DEBUG_PENALTY
+  elog(NOTICE, "__pr_penalty(%s, %s) == %d/(256^%d) == %g", 
+       pr_to_str(orig), pr_to_str(new),
+       dist, gplen, penalty);
+#endif
+
+  return penalty;
+}
+
+/**
+ * GiST picksplit kernel: splits the entries ent[1..maxoff], taken in the
+ * sort order when it's not NULL, into the left and right lists of
+ * offsets, each with room for maxoff of them, and sets the union of
+ * each side. Offsets start at 1, as GiST's FirstOffsetNumber, so that
+ * gpr_picksplit() can use the lists as they are.
+ */
+static inline
+void pr_split(prefix_range **ent, uint16 maxoff, const uint16 *sort,
+	      uint16 *left, int *nleft, uint16 *right, int *nright,
+	      prefix_range **unionLp, prefix_range **unionRp) {
+    uint16 offl, offr;
+    prefix_range *curl, *curr, *tmp_union;
+    prefix_range *unionL;
+    prefix_range *unionR;
+
+    /**
+     * Keeping track of penalties to insert into ListL or ListR, for
+     * both the leftmost and the rightmost element of the remaining
+     * list.
+     */
+    float pll, plr, prl, prr;
+
+    *nleft = *nright = 0;
+
+    offl = 1;
+    offr = maxoff;
+
+    unionL = ent[offl];
+    unionR = ent[offr];
+
+    left[(*nleft)++]   = offl;
+    right[(*nright)++] = offr;
+
+    offl++;
+    offr--;
+
+    while( offl < offr ) {
+
+      if( sort != NULL ) {
+	curl = ent[sort[offl]];
+	curr = ent[sort[offr]];
+      }
+      else {
+	curl = ent[offl];
+	curr = ent[offr];
+      }
+
+#ifdef DEBUG_PICKSPLIT
+      elog(NOTICE, "gpr_picksplit: ent[%3d] = '%s' \tent[%3d] = '%s'",
+	   offl, pr_to_str(curl), offr, pr_to_str(curr));
+#endif
+
+      Assert(curl != NULL && curr != NULL);
+
+      pll = __pr_penalty(unionL, curl);
+      plr = __pr_penalty(unionR, curl);
+      prl = __pr_penalty(unionL, curr);
+      prr = __pr_penalty(unionR, curr);
+
+      if( pll <= plr && prl >= prr ) {
+	/**
+	 * curl should go to left and curr to right, unless they share
+	 * a non-empty common prefix, in which case we place both curr
+	 * and curl on the same side. Arbitrarily the left one.
+	 */
+	if( pll == plr && prl == prr ) {
+	  tmp_union = pr_union(curl, curr);
+
+	  if( strlen(tmp_union->prefix) > 0 ) {
+	    unionL = pr_union(unionL, tmp_union);
+	    left[(*nleft)++] = offl;
+	    left[(*nleft)++] = offr;
+
+	    offl++;
+	    offr--;
+	    continue;
+	  }
+	}
+	/**
+	 * here pll <= plr and prl >= prr and (pll != plr || prl != prr)
+	 */
+	unionL = pr_union(unionL, curl);
+	unionR = pr_union(unionR, curr);
+
+	left[(*nleft)++]   = offl;
+	right[(*nright)++] = offr;
+
+	offl++;
+	offr--;
+      }
+      else if( pll > plr && prl >= prr ) {
+	/**
+	 * Current rightmost entry is added to listL
+	 */
+	unionR = pr_union(unionR, curr);
+	right[(*nright)++] = offr;
+	offr--;
+      }
+      else if( pll <= plr && prl < prr ) {
+	/**
+	 * Current leftmost entry is added to listL
+	 */
+	unionL = pr_union(unionL, curl);
+	left[(*nleft)++] = offl;
+	offl++;
+      }
+      else if( (pll - plr) < (prr - prl) ) {
+	/**
+	 * All entries still in the list go into listL
+	 */
+	for(; offl <= offr; offl++) {
+	  curl   = ent[offl];
+	  unionL = pr_union(unionL, curl);
+	  left[(*nleft)++] = offl;
+	}
+      }
+      else {
+	/**
+	 * All entries still in the list go into listR
+	 */
+	for(; offr >= offl; offr--) {
+	  curr   = ent[offr];
+	  unionR = pr_union(unionR, curr);
+	  right[(*nright)++] = offr;
+	}
+      }
+    }
+
+    /**
+     * The for loop continues while offl < offr. If maxoff is odd, it
+     * could be that there's a last value to process. Here we choose
+     * where to add it.
+     */
+    if( offl == offr ) {
+      curl = ent[offl];
+
+      pll  = __pr_penalty(unionL, curl);
+      plr  = __pr_penalty(unionR, curl);
+
+      if( pll < plr || (pll == plr && *nleft < *nright) ) {
+	unionL = pr_union(unionL, curl);
+	left[(*nleft)++] = offl;
+      }
+      else {
+	unionR = pr_union(unionR, curl);
+	right[(*nright)++] = offl;
+      }
+    }
+
+    *unionLp = unionL;
+    *unionRp = unionR;
+}
+
+/**
+ * Compiled trie
+ *
+ * prefix_trie_build() compiles a prefix_range column into a trie stored
+ * in a single flat buffer, made of offsets rather than pointers, so that
+ * it can be kept in a bytea or a file, and used straight from where it
+ * was read or mapped:
+ *
+ *   pr_trie_header | pr_trie_node[nnodes] | pr_trie_entry[nentries] | labels[nnodes]
+ *
+ * Nodes are numbered breadth first, so that the children of a node are
+ * consecutive, sorted on their label, the byte leading to them. The
+ * entries of a node are the prefix_range values whose prefix is the path
+ * to the node, the one without a range first, then sorted on first and
+ * on last descending, so that the last matching one is the narrowest.
+ * Each entry has the int4 value given with its prefix, such as a route
+ * id, so that a lookup needs no query to act on the match. The labels
+ * come last, so that the nodes and entries are aligned.
+ */
+#define PR_TRIE_MAGIC  "PRT1"
+#define PR_TRIE_ORDER  0x01020304    /* byte order check */
+
+typedef struct {
+  char magic[4];
+  uint32 order;
+  uint32 nnodes;
+  uint32 nentries;
+} pr_trie_header;
+
+typedef struct {
+  uint32 first_child;
+  uint32 first_entry;
+  uint16 nchild;
+  uint16 nentry;
+} pr_trie_node;
+
+typedef struct {
+  int32 value;
+  char first;
+  char last;
+} pr_trie_entry;
+
+/**
+ * Size of a trie, or 0 when it would not fit in a size_t, which can be
+ * 32 bits wide, and so can't match the size of any buffer.
+ */
+static inline
+size_t pr_trie_size(uint32 nnodes, uint32 nentries) {
+  size_t max = ((size_t) -1) - sizeof(pr_trie_header);
+
+  if( nnodes > max / (sizeof(pr_trie_node) + 1) )
+    return 0;
+  max -= nnodes * (sizeof(pr_trie_node) + 1);
+
+  if( nentries > max / sizeof(pr_trie_entry) )
+    return 0;
+
+  return sizeof(pr_trie_header) + nnodes * (sizeof(pr_trie_node) + 1)
+    + nentries * sizeof(pr_trie_entry);
+}
+
+static inline
+bool pr_trie_header_ok(const char *trie, size_t len) {
+  const pr_trie_header *h = (const pr_trie_header *) trie;
+
+  return len >= sizeof(pr_trie_header)
+    && memcmp(h->magic, PR_TRIE_MAGIC, 4) == 0
+    && h->order == PR_TRIE_ORDER
+    && h->nnodes > 0
+    && len == pr_trie_size(h->nnodes, h->nentries);
+}
+
+/**
+ * Checks the whole trie, where pr_trie_lookup() only checks the nodes it
+ * walks through: the children and entries of every node are within the
+ * buffer, the children come after their parent, as in breadth first
+ * order, with increasing labels, and the ranges are not reversed.
+ */
+static inline
+bool pr_trie_check(const char *trie, size_t len) {
+  const pr_trie_header *h = (const pr_trie_header *) trie;
+  const pr_trie_node *nodes, *node;
+  const unsigned char *labels;
+  const pr_trie_entry *entries, *e;
+  uint32 n, i;
+
+  if( !pr_trie_header_ok(trie, len) )
+    return false;
+
+  nodes   = (const pr_trie_node *) (trie + sizeof(pr_trie_header));
+  entries = (const pr_trie_entry *) (nodes + h->nnodes);
+  labels  = (const unsigned char *) (entries + h->nentries);
+
+  for(n = 0; n < h->nnodes; n++) {
+    node = &nodes[n];
+
+    if( node->first_entry > h->nentries
+	|| node->nentry > h->nentries - node->first_entry )
+      return false;
+
+    for(i = 0; i < node->nentry; i++) {
+      e = &entries[node->first_entry + i];
+      if( (e->first == 0) != (e->last == 0)
+	  || (unsigned char) e->first > (unsigned char) e->last )
+	return false;
+    }
+
+    if( node->nchild == 0 )
+      continue;
+
+    if( node->first_child <= n
+	|| node->first_child > h->nnodes
+	|| node->nchild > h->nnodes - node->first_child )
+      return false;
+
+    for(i = 1; i < node->nchild; i++)
+      if( labels[node->first_child + i - 1] >= labels[node->first_child + i] )
+	return false;
+  }
+  return true;
+}
+
+/**
+ * Longest prefix match of num in the trie: returns the length of the
+ * matched prefix and sets *match to the range, or -1 when nothing
+ * matches, and -2 when the trie is not valid. Each node and entry is
+ * checked to be within the buffer as we walk down, so that a damaged
+ * trie can't get us out of it.
+ */
+static inline
+int pr_trie_lookup(const char *trie, size_t len,
+		   const char *num, int nlen, pr_trie_entry *match) {
+  const pr_trie_header *h = (const pr_trie_header *) trie;
+  const pr_trie_node *nodes, *node;
+  const unsigned char *labels;
+  const pr_trie_entry *entries, *e;
+  unsigned char c;
+  uint32 lo, hi, mid, i;
+  int depth, result = -1;
+
+  if( !pr_trie_header_ok(trie, len) )
+    return -2;
+
+  nodes   = (const pr_trie_node *) (trie + sizeof(pr_trie_header));
+  entries = (const pr_trie_entry *) (nodes + h->nnodes);
+  labels  = (const unsigned char *) (entries + h->nentries);
+  node    = nodes;
+
+  for(depth = 0; ; depth++) {
+    /* no addition, which could wrap around */
+    if( node->first_entry > h->nentries
+	|| node->nentry > h->nentries - node->first_entry )
+      return -2;
+
+    for(i = 0; i < node->nentry; i++) {
+      e = &entries[node->first_entry + i];
+
+      /* unsigned, as prefix_trie_build() sorts them */
+      if( e->first == 0
+	  || (depth < nlen
+	      && (unsigned char) e->first <= (unsigned char) num[depth]
+	      && (unsigned char) num[depth] <= (unsigned char) e->last) ) {
+	*match = *e;
+	result = depth;
+      }
+    }
+
+    if( depth == nlen || node->nchild == 0 )
+      break;
+
+    if( node->first_child > h->nnodes
+	|| node->nchild > h->nnodes - node->first_child )
+      return -2;
+
+    /* binary search of the child labeled num[depth] */
+    c  = (unsigned char) num[depth];
+    lo = node->first_child;
+    hi = node->first_child + node->nchild;
+
+    while( lo < hi ) {
+      mid = lo + (hi - lo) / 2;
+      if( labels[mid] < c )
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+
+    if( lo == node->first_child + node->nchild || labels[lo] != c )
+      break;
+
+    node = &nodes[lo];
+  }
+  return result;
+}
+
+#endif /* PREFIX_H */
@@ -0,0 +1,460 @@
+/**
+ * Micro-benchmark of the prefix_range kernels from prefix.h, outside of
+ * PostgreSQL, so that changes to the GiST support code can be timed
+ * without the noise of a backend.
+ *
+ *   make bench
+ *   ./prefix_bench [-c] [prefixes.fr.csv|- [iterations]]
+ *
+ * Without a file (or with -) we work on random digits prefixes, a
+ * fourth of them having a [x-y] range. With a CSV file we take the
+ * first column, as in the prefixes.fr.csv file shipped with the sources.
+ *
+ * With -c we time nothing and check instead that the optimized kernels
+ * give the same results as the reference implementations below, on as
+ * many random pairs as iterations, and that pr_split() keeps every
+ * entry, exiting with 1 on a mismatch.
+ */
+#define PREFIX_STANDALONE
+#include "prefix.h"
+
+#include <stdio.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_CYCLES() __rdtsc()
+#else
+#define BENCH_CYCLES() 0
+#endif
+
+#define BENCH_NPREFIX  10000
+#define BENCH_NPAIRS   4096
+#define BENCH_ITER     1000000
+#define BENCH_SPLIT    128           /* entries per picksplit call */
+
+static prefix_range **prs;
+static int npr;
+static int pairs[BENCH_NPAIRS][2];
+
+/**
+ * the pr_overlaps() implementation we had before it was made
+ * allocation-free, kept here to compare against
+ */
+static bool ref_overlaps(prefix_range *a, prefix_range *b) {
+  prefix_range *inter = pr_inter(a, b);
+  bool res = strlen(inter->prefix) > 0
+    || (inter->first != 0 && inter->last != 0);
+
+  pfree(inter);
+  return res;
+}
+
+/**
+ * Reference semantics for the checks: a prefix_range is the set of the
+ * strings starting with one of its concrete prefixes, prefix followed by
+ * each char of [first-last], or prefix alone when there's no range.
+ * Plain loops over those, slow and obviously right.
+ */
+static int concrete(prefix_range *pr, char **out) {
+  int len = strlen(pr->prefix), n = 0, c;
+
+  if( pr->first == 0 ) {
+    out[n] = (char *) malloc(len + 1);
+    memcpy(out[n++], pr->prefix, len + 1);
+    return n;
+  }
+  for(c = (unsigned char) pr->first; c <= (unsigned char) pr->last; c++) {
+    out[n] = (char *) malloc(len + 2);
+    memcpy(out[n], pr->prefix, len);
+    out[n][len] = (char) c;
+    out[n++][len + 1] = 0;
+  }
+  return n;
+}
+
+static bool starts_with(const char *s, const char *p) {
+  return strncmp(s, p, strlen(p)) == 0;
+}
+
+static bool ref_exact(prefix_range *a, prefix_range *b, bool contains) {
+  char *ca[256], *cb[256];
+  int na = concrete(a, ca), nb = concrete(b, cb), i, j;
+  bool res = contains, found;
+
+  for(j=0; j<nb; j++) {
+    found = false;
+    for(i=0; i<na && !found; i++)
+      found = starts_with(cb[j], ca[i])
+	|| (!contains && starts_with(ca[i], cb[j]));
+
+    if( contains && !found )
+      res = false;
+    if( !contains && found )
+      res = true;
+  }
+
+  for(i=0; i<na; i++) free(ca[i]);
+  for(j=0; j<nb; j++) free(cb[j]);
+  return res;
+}
+
+/**
+ * the __pr_penalty() implementation we had before it computed
+ * dist / 256^gplen with ldexpf(), kept to check against. Both agree as
+ * long as the common prefix is shorter than 16: from there powf()
+ * overflows and this one returns 0, where the ldexpf() one is still
+ * nonzero, on purpose.
+ */
+static float ref_penalty(prefix_range *orig, prefix_range *new) {
+  char *gp;
+  int  nlen, olen, gplen, dist = 0;
+  char tmp;
+
+  olen  = strlen(orig->prefix);
+  nlen  = strlen(new->prefix);
+  gp    = __greater_prefix(orig->prefix, new->prefix, olen, nlen);
+  gplen = strlen(gp);
+  pfree(gp);
+
+  dist  = 1;
+
+  if( 0 == olen && 0 == nlen ) {
+    if( orig->last >= new->first )
+      dist = 0;
+    else
+      dist = new->first - orig->last;
+  }
+  else if( 0 == olen ) {
+    if( orig->first != 0 ) {
+      tmp = new->prefix[0];
+
+      if( orig->first <= tmp && tmp <= orig->last ) {
+	gplen = 1;
+
+	dist = 1 + (int)tmp - (int)orig->first;
+	if( (1 + (int)orig->last - (int)tmp) < dist )
+	  dist = 1 + (int)orig->last - (int)tmp;
+      }
+      else
+	dist = (orig->first > tmp ? orig->first - tmp  : tmp - orig->last );
+    }
+  }
+  else if( 0 == nlen ) {
+    if( new->first != 0 ) {
+      tmp = orig->prefix[0];
+
+      if( new->first <= tmp && tmp <= new->last ) {
+	gplen = 1;
+
+	dist = 1 + (int)tmp - (int)new->first;
+	if( (1 + (int)new->last - (int)tmp) < dist )
+	  dist = 1 + (int)new->last - (int)tmp;
+      }
+      else
+	dist = (new->first > tmp ? new->first - tmp  : tmp - new->last );
+    }
+  }
+  else if( gplen > 0 ) {
+    if( olen > gplen && nlen == gplen && new->first != 0 ) {
+      if( new->first <= orig->prefix[gplen]
+	  && orig->prefix[gplen] <= new->last ) {
+
+	dist   = 1 + (int)orig->prefix[gplen] - (int)new->first;
+	if( (1 + (int)new->last - (int)orig->prefix[gplen]) < dist )
+	  dist = 1 + (int)new->last - (int)orig->prefix[gplen];
+
+	gplen += 1;
+      }
+      else
+	dist += 1;
+    }
+    else if( nlen > gplen && olen == gplen && orig->first != 0 ) {
+      if( orig->first <= new->prefix[gplen]
+	  && new->prefix[gplen] <= orig->last ) {
+
+	dist   = 1 + (int)new->prefix[gplen] - (int)orig->first;
+	if( (1 + (int)orig->last - (int)new->prefix[gplen]) < dist )
+	  dist = 1 + (int)orig->last - (int)new->prefix[gplen];
+
+	gplen += 1;
+      }
+      else
+	dist += 1;
+    }
+  }
+  return ((float)dist) / powf(256, gplen);
+}
+
+static unsigned int bench_seed = 2463534242U;
+
+static unsigned int bench_rand(void) {
+  bench_seed ^= bench_seed << 13;
+  bench_seed ^= bench_seed >> 17;
+  bench_seed ^= bench_seed << 5;
+  return bench_seed;
+}
+
+static void load_random(void) {
+  char buf[16];
+  char first, last;
+  int i, j, len;
+
+  npr = BENCH_NPREFIX;
+  prs = (prefix_range **) malloc(npr * sizeof(prefix_range *));
+
+  for(i=0; i<npr; i++) {
+    len = 1 + bench_rand() % 8;
+    for(j=0; j<len; j++)
+      buf[j] = '0' + bench_rand() % 10;
+    buf[len] = 0;
+
+    first = last = 0;
+    if( bench_rand() % 4 == 0 ) {
+      first = '0' + bench_rand() % 10;
+      last  = '0' + bench_rand() % 10;
+    }
+    prs[i] = pr_normalize(build_pr(buf, first, last));
+  }
+}
+
+static int load_csv(const char *filename) {
+  FILE *f = fopen(filename, "r");
+  char line[1024];
+  char *p, *q;
+  int size = 1024;
+
+  if( f == NULL ) {
+    perror(filename);
+    return -1;
+  }
+  npr = 0;
+  prs = (prefix_range **) malloc(size * sizeof(prefix_range *));
+
+  while( fgets(line, sizeof(line), f) != NULL ) {
+    p = line[0] == '"' ? line + 1 : line;
+    for(q=p; *q && *q != '"' && *q != ';' && *q != '\n'; q++);
+    *q = 0;
+
+    if( npr == size ) {
+      size *= 2;
+      prs = (prefix_range **) realloc(prs, size * sizeof(prefix_range *));
+    }
+    prs[npr++] = build_pr(p, 0, 0);
+  }
+  fclose(f);
+  return npr;
+}
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * Runs the given expression over the pairs, iter times in total, and
+ * prints the time and cycles spent per call. The results are summed
+ * into a volatile so that the calls are not optimized away.
+ */
+#define BENCH(name, expr)						\
+  do {									\
+    volatile double sink = 0;						\
+    prefix_range *a, *b;						\
+    double t0, t1;							\
+    unsigned long long c0, c1;						\
+    int i;								\
+									\
+    t0 = now_ns();							\
+    c0 = BENCH_CYCLES();						\
+    for(i=0; i<iter; i++) {						\
+      a = prs[pairs[i % BENCH_NPAIRS][0]];				\
+      b = prs[pairs[i % BENCH_NPAIRS][1]];				\
+      sink += (expr);							\
+    }									\
+    c1 = BENCH_CYCLES();						\
+    t1 = now_ns();							\
+    printf("%-24s %10.2f ns %10.1f cycles\n", name,			\
+	   (t1 - t0) / iter, (double)(c1 - c0) / iter);			\
+    (void) sink; (void) b;						\
+  } while(0)
+
+static double free_pr(prefix_range *pr) {
+  double res = pr->first;
+  pfree(pr);
+  return res;
+}
+
+static double free_str(char *str) {
+  double res = str[0];
+  pfree(str);
+  return res;
+}
+
+/**
+ * Picks a random pair, half of the time sharing their first char, so
+ * that we don't only exercise the early exits.
+ */
+static void random_pair(int *a, int *b, bool common) {
+  int j, k;
+
+  *a = bench_rand() % npr;
+  *b = bench_rand() % npr;
+
+  if( common ) {
+    for(j=0; j<64; j++) {
+      k = bench_rand() % npr;
+      if( prs[k]->prefix[0] == prs[*a]->prefix[0] ) {
+	*b = k;
+	break;
+      }
+    }
+  }
+}
+
+/**
+ * Checks a split: every entry on exactly one side, and contained in the
+ * union of its side.
+ */
+static bool check_split(prefix_range **ent, int maxoff,
+			uint16 *left, int nleft, uint16 *right, int nright,
+			prefix_range *unionL, prefix_range *unionR) {
+  char seen[BENCH_SPLIT + 1];
+  int i;
+
+  if( nleft + nright != maxoff )
+    return false;
+
+  memset(seen, 0, sizeof(seen));
+  for(i=0; i<nleft; i++) {
+    if( left[i] < 1 || left[i] > maxoff || seen[left[i]]++
+	|| !pr_contains(unionL, ent[left[i]], true) )
+      return false;
+  }
+  for(i=0; i<nright; i++) {
+    if( right[i] < 1 || right[i] > maxoff || seen[right[i]]++
+	|| !pr_contains(unionR, ent[right[i]], true) )
+      return false;
+  }
+  return true;
+}
+
+static void split_entries(prefix_range **ent) {
+  int i;
+
+  for(i=1; i<=BENCH_SPLIT; i++)
+    ent[i] = prs[bench_rand() % npr];
+}
+
+static int run_check(int iter) {
+  prefix_range *ent[BENCH_SPLIT + 1], *unionL, *unionR;
+  uint16 left[BENCH_SPLIT], right[BENCH_SPLIT];
+  prefix_range *a, *b;
+  int nleft, nright, ia, ib, i, glen;
+  long bad = 0;
+
+#define CHECK(name, ok)							\
+  do {									\
+    if( !(ok) ) {							\
+      if( bad++ < 10 ) {						\
+	char *sa = pr_to_str(a), *sb = pr_to_str(b);			\
+	printf("%s mismatch on %s, %s\n", name, sa, sb);		\
+	pfree(sa); pfree(sb);						\
+      }									\
+    }									\
+  } while(0)
+
+  for(i=0; i<iter; i++) {
+    random_pair(&ia, &ib, i % 2 == 0);
+    a = prs[ia];
+    b = prs[ib];
+
+    CHECK("pr_overlaps", pr_overlaps(a, b) == ref_exact(a, b, false));
+    CHECK("pr_contains", pr_contains(a, b, true) == ref_exact(a, b, true));
+
+    for(glen=0; a->prefix[glen] && a->prefix[glen] == b->prefix[glen]; glen++);
+    if( glen < 16 )
+      CHECK("__pr_penalty", __pr_penalty(a, b) == ref_penalty(a, b));
+  }
+
+  /* one split for every BENCH_SPLIT pairs checked */
+  for(i=0; i<iter / BENCH_SPLIT; i++) {
+    split_entries(ent);
+    pr_split(ent, BENCH_SPLIT, NULL, left, &nleft, right, &nright,
+	     &unionL, &unionR);
+
+    if( !check_split(ent, BENCH_SPLIT, left, nleft, right, nright,
+		     unionL, unionR) ) {
+      if( bad++ < 10 )
+	printf("pr_split mismatch\n");
+    }
+  }
+
+  printf("%d pairs, %d splits checked, %ld mismatches\n",
+	 iter, iter / BENCH_SPLIT, bad);
+
+  return bad == 0 ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+  prefix_range *ent[BENCH_SPLIT + 1], *unionL, *unionR;
+  uint16 left[BENCH_SPLIT], right[BENCH_SPLIT];
+  int iter = BENCH_ITER;
+  bool check = false;
+  int nleft, nright, nsplit, i;
+  double t0, t1;
+
+  if( argc > 1 && strcmp(argv[1], "-c") == 0 ) {
+    check = true;
+    argc--;
+    argv++;
+  }
+
+  if( argc > 1 && strcmp(argv[1], "-") != 0 ) {
+    if( load_csv(argv[1]) <= 0 )
+      return 1;
+  }
+  else
+    load_random();
+
+  if( argc > 2 )
+    iter = atoi(argv[2]);
+
+  if( check )
+    return run_check(iter);
+
+  for(i=0; i<BENCH_NPAIRS; i++)
+    random_pair(&pairs[i][0], &pairs[i][1], i % 2 == 0);
+
+  printf("%d prefixes, %d pairs, %d iterations\n\n",
+	 npr, BENCH_NPAIRS, iter);
+
+  BENCH("pr_eq",              pr_eq(a, b));
+  BENCH("pr_cmp",             pr_cmp(a, b));
+  BENCH("pr_contains",        pr_contains(a, b, true));
+  BENCH("pr_overlaps",        pr_overlaps(a, b));
+  BENCH("pr_overlaps (inter)", ref_overlaps(a, b));
+  BENCH("pr_union",           free_pr(pr_union(a, b)));
+  BENCH("pr_inter",           free_pr(pr_inter(a, b)));
+  BENCH("__pr_penalty",       __pr_penalty(a, b));
+  BENCH("__pr_penalty (powf)", ref_penalty(a, b));
+  BENCH("pr_to_str",          free_str(pr_to_str(a)));
+
+  /**
+   * The unions pr_split() builds are left to the memory context in the
+   * backend, so we only run a split per thousand iterations here.
+   */
+  nsplit = iter / 1000 > 0 ? iter / 1000 : 1;
+  split_entries(ent);
+
+  t0 = now_ns();
+  for(i=0; i<nsplit; i++)
+    pr_split(ent, BENCH_SPLIT, NULL, left, &nleft, right, &nright,
+	     &unionL, &unionR);
+  t1 = now_ns();
+
+  printf("%-24s %10.2f ns per split of %d entries\n", "pr_split",
+	 (t1 - t0) / nsplit, BENCH_SPLIT);
+
+  return 0;
+}
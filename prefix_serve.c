@@ -0,0 +1,316 @@
+/**
+ * Longest prefix match server, for the callers which can't afford a
+ * query per lookup, see prefix_serve.h for the protocol.
+ *
+ *   prefix_serve socket trie
+ *
+ * The trie is a file written by prefix_trie_write(), mapped in memory
+ * and searched with pr_trie_lookup() from prefix.h. To keep it in sync
+ * with the table, have a cron job or a LISTEN session write the file
+ * again once the changes are committed, see README.txt: it's checked for
+ * a change every second, and on SIGHUP, and a new trie is only used once
+ * it's been validated. A single process serves
+ * all the connections with poll().
+ */
+#define PREFIX_STANDALONE
+#include "prefix.h"
+#include "prefix_serve.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define PR_SERVE_MAXCLIENTS 1024
+#define PR_SERVE_INSIZE     (sizeof(uint16_t) + PR_SERVE_MAXLEN)
+#define PR_SERVE_OUTSIZE    (256 * sizeof(pr_serve_response))
+
+typedef struct {
+  int fd;
+  size_t inlen;
+  size_t outlen;
+  char in[PR_SERVE_INSIZE];
+  char out[PR_SERVE_OUTSIZE];
+} pr_serve_client;
+
+typedef struct {
+  const char *path;
+  char *trie;
+  size_t size;
+  /* the file we last looked at, whether we're using it or not */
+  dev_t dev;
+  ino_t ino;
+  off_t fsize;
+  time_t mtime;
+} pr_serve_trie;
+
+static volatile sig_atomic_t reload_requested = 0;
+static volatile sig_atomic_t stop_requested = 0;
+
+static void on_sighup(int sig) {
+  reload_requested = 1;
+}
+
+static void on_stop(int sig) {
+  stop_requested = 1;
+}
+
+/**
+ * Maps the trie file again when it changed, or when forced. On error we
+ * go on with the trie we have, if any.
+ */
+static int trie_reload(pr_serve_trie *t, bool force) {
+  struct stat st;
+  char *trie;
+  int fd;
+
+  if( stat(t->path, &st) < 0 ) {
+    perror(t->path);
+    return -1;
+  }
+
+  if( !force && t->trie != NULL && st.st_dev == t->dev && st.st_ino == t->ino
+      && st.st_mtime == t->mtime && st.st_size == t->fsize )
+    return 0;
+
+  t->dev   = st.st_dev;
+  t->ino   = st.st_ino;
+  t->fsize = st.st_size;
+  t->mtime = st.st_mtime;
+
+  if( (fd = open(t->path, O_RDONLY)) < 0 ) {
+    perror(t->path);
+    return -1;
+  }
+  if( fstat(fd, &st) < 0 || st.st_size == 0 ) {
+    fprintf(stderr, "%s: empty trie file\n", t->path);
+    close(fd);
+    return -1;
+  }
+  trie = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if( trie == MAP_FAILED ) {
+    perror(t->path);
+    return -1;
+  }
+
+  if( !pr_trie_check(trie, st.st_size) ) {
+    fprintf(stderr, "%s: invalid prefix trie\n", t->path);
+    munmap(trie, st.st_size);
+    return -1;
+  }
+
+  if( t->trie != NULL )
+    munmap(t->trie, t->size);
+
+  t->trie = trie;
+  t->size = st.st_size;
+
+  fprintf(stderr, "%s: loaded, %lu bytes\n", t->path, (unsigned long) t->size);
+  return 0;
+}
+
+static int listen_on(const char *path) {
+  struct sockaddr_un addr;
+  int fd;
+
+  if( strlen(path) >= sizeof(addr.sun_path) ) {
+    fprintf(stderr, "%s: socket path too long\n", path);
+    return -1;
+  }
+  if( (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ) {
+    perror("socket");
+    return -1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  unlink(path);
+
+  if( bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0
+      || listen(fd, 128) < 0 ) {
+    perror(path);
+    close(fd);
+    return -1;
+  }
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+
+  return fd;
+}
+
+/**
+ * Answers the complete requests in the input buffer, as long as there's
+ * room for the responses. Returns -1 on a protocol error.
+ */
+static int client_process(pr_serve_client *c, pr_serve_trie *t) {
+  pr_serve_response res;
+  pr_trie_entry match;
+  size_t pos = 0;
+  uint16_t len;
+  int depth;
+
+  while( c->inlen - pos >= sizeof(uint16_t)
+	 && c->outlen + sizeof(pr_serve_response) <= PR_SERVE_OUTSIZE ) {
+    memcpy(&len, c->in + pos, sizeof(uint16_t));
+
+    if( len > PR_SERVE_MAXLEN )
+      return -1;
+
+    if( c->inlen - pos < sizeof(uint16_t) + len )
+      break;
+
+    depth = pr_trie_lookup(t->trie, t->size,
+			   c->in + pos + sizeof(uint16_t), len, &match);
+
+    res.depth = depth >= 0 ? depth : -1;
+    res.first = depth >= 0 ? match.first : 0;
+    res.last  = depth >= 0 ? match.last : 0;
+    res.value = depth >= 0 ? match.value : 0;
+
+    memcpy(c->out + c->outlen, &res, sizeof(pr_serve_response));
+    c->outlen += sizeof(pr_serve_response);
+    pos += sizeof(uint16_t) + len;
+  }
+
+  memmove(c->in, c->in + pos, c->inlen - pos);
+  c->inlen -= pos;
+
+  return 0;
+}
+
+/**
+ * Writes what it can of the output buffer, returns -1 on error.
+ */
+static int client_flush(pr_serve_client *c) {
+  ssize_t n;
+
+  while( c->outlen > 0 ) {
+    if( (n = write(c->fd, c->out, c->outlen)) < 0 ) {
+      if( errno == EINTR )
+	continue;
+      return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+    memmove(c->out, c->out + n, c->outlen - n);
+    c->outlen -= n;
+  }
+  return 0;
+}
+
+/**
+ * Answers and writes as long as there are complete requests and the
+ * client reads the responses. Requests left in the buffer are answered
+ * when we can write again, so a pipelining client isn't left waiting.
+ */
+static int client_serve(pr_serve_client *c, pr_serve_trie *t) {
+  size_t inlen;
+
+  do {
+    inlen = c->inlen;
+
+    if( client_process(c, t) < 0 || client_flush(c) < 0 )
+      return -1;
+  } while( c->outlen == 0 && c->inlen < inlen );
+
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  static pr_serve_client clients[PR_SERVE_MAXCLIENTS];
+  static struct pollfd fds[PR_SERVE_MAXCLIENTS + 1];
+  pr_serve_trie t;
+  pr_serve_client *c;
+  struct sigaction sa;
+  time_t checked;
+  ssize_t n;
+  int lfd, fd, nclients = 0, i;
+
+  if( argc != 3 ) {
+    fprintf(stderr, "usage: %s socket trie\n", argv[0]);
+    return 1;
+  }
+
+  memset(&t, 0, sizeof(t));
+  t.path = argv[2];
+  if( trie_reload(&t, true) < 0 )
+    return 1;
+
+  if( (lfd = listen_on(argv[1])) < 0 )
+    return 1;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_sighup;
+  sigaction(SIGHUP, &sa, NULL);
+  sa.sa_handler = on_stop;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  sa.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &sa, NULL);
+
+  checked = time(NULL);
+
+  while( !stop_requested ) {
+    fds[0].fd     = lfd;
+    fds[0].events = nclients < PR_SERVE_MAXCLIENTS ? POLLIN : 0;
+
+    for(i = 0; i < nclients; i++) {
+      fds[i + 1].fd     = clients[i].fd;
+      fds[i + 1].events = clients[i].outlen > 0 ? POLLOUT : POLLIN;
+    }
+
+    if( poll(fds, nclients + 1, 1000) < 0 && errno != EINTR ) {
+      perror("poll");
+      break;
+    }
+
+    if( reload_requested || time(NULL) != checked ) {
+      trie_reload(&t, reload_requested);
+      reload_requested = 0;
+      checked = time(NULL);
+    }
+
+    /* clients are removed by moving the last one in their slot */
+    for(i = nclients - 1; i >= 0; i--) {
+      c = &clients[i];
+
+      if( fds[i + 1].revents == 0 )
+	continue;
+
+      if( fds[i + 1].revents & POLLIN ) {
+	n = read(c->fd, c->in + c->inlen, PR_SERVE_INSIZE - c->inlen);
+
+	if( n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN) ) {
+	  close(c->fd);
+	  *c = clients[--nclients];
+	  continue;
+	}
+	if( n > 0 )
+	  c->inlen += n;
+      }
+
+      if( (fds[i + 1].revents & (POLLERR | POLLNVAL))
+	  || client_serve(c, &t) < 0 ) {
+	close(c->fd);
+	*c = clients[--nclients];
+      }
+    }
+
+    if( fds[0].revents & POLLIN ) {
+      while( nclients < PR_SERVE_MAXCLIENTS
+	     && (fd = accept(lfd, NULL, NULL)) >= 0 ) {
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	c = &clients[nclients++];
+	c->fd     = fd;
+	c->inlen  = 0;
+	c->outlen = 0;
+      }
+    }
+  }
+
+  unlink(argv[1]);
+  return 0;
+}
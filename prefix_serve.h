@@ -0,0 +1,124 @@
+/**
+ * prefix_serve protocol and client
+ *
+ * prefix_serve answers longest prefix match requests over a local
+ * stream socket, from a trie written by prefix_trie_write(). Both ends
+ * are on the same host, so the integers are in host byte order:
+ *
+ *   request:  uint16 length, then length bytes of the number
+ *   response: int16 depth, char first, char last, int32 value
+ *
+ * depth is the length of the matching prefix, the first depth bytes of
+ * the number followed by [first-last] when first is not 0, or -1 when no
+ * prefix matches. value is the one given to prefix_trie_build() with the
+ * matching prefix, such as a route id, 0 when there's no match. Requests may be pipelined, the responses come in the
+ * same order. A request longer than PR_SERVE_MAXLEN closes the
+ * connection.
+ *
+ * The client side is these few inline functions, include this file and
+ * use pr_serve_connect() then pr_serve_lookup().
+ */
+#ifndef PREFIX_SERVE_H
+#define PREFIX_SERVE_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define PR_SERVE_MAXLEN 1024
+
+typedef struct {
+  int16_t depth;
+  char first;
+  char last;
+  int32_t value;
+} pr_serve_response;
+
+static inline
+int pr_serve_write(int fd, const void *buf, size_t len) {
+  const char *p = (const char *) buf;
+  ssize_t n;
+
+  while( len > 0 ) {
+    if( (n = write(fd, p, len)) < 0 ) {
+      if( errno == EINTR )
+	continue;
+      return -1;
+    }
+    p   += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static inline
+int pr_serve_read(int fd, void *buf, size_t len) {
+  char *p = (char *) buf;
+  ssize_t n;
+
+  while( len > 0 ) {
+    if( (n = read(fd, p, len)) <= 0 ) {
+      if( n < 0 && errno == EINTR )
+	continue;
+      return -1;
+    }
+    p   += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/**
+ * Returns the connected socket, or -1 with errno set.
+ */
+static inline
+int pr_serve_connect(const char *path) {
+  struct sockaddr_un addr;
+  int fd;
+
+  if( strlen(path) >= sizeof(addr.sun_path) ) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  if( (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 )
+    return -1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  if( connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/**
+ * One request and its response, returns 0, or -1 on error after which
+ * the connection is not usable any more.
+ */
+static inline
+int pr_serve_lookup(int fd, const char *num, int len, pr_serve_response *res) {
+  char req[sizeof(uint16_t) + PR_SERVE_MAXLEN];
+  uint16_t l = (uint16_t) len;
+
+  if( len < 0 || len > PR_SERVE_MAXLEN ) {
+    errno = EINVAL;
+    return -1;
+  }
+  memcpy(req, &l, sizeof(uint16_t));
+  memcpy(req + sizeof(uint16_t), num, len);
+
+  if( pr_serve_write(fd, req, sizeof(uint16_t) + len) < 0
+      || pr_serve_read(fd, res, sizeof(pr_serve_response)) < 0 )
+    return -1;
+
+  return 0;
+}
+
+#endif /* PREFIX_SERVE_H */
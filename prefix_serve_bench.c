@@ -0,0 +1,194 @@
+/**
+ * Load generator for prefix_serve: opens a number of connections, each
+ * in its own thread doing one lookup after the other, and prints the
+ * throughput and the latency distribution of the lookups.
+ *
+ *   make serve
+ *   ./prefix_serve_bench socket [numbers.csv|- [count [connections]]]
+ *
+ * Without a file (or with -) we send random 10 digits numbers. With a
+ * CSV file we take the first column, as prefix_bench does.
+ */
+#include "prefix_serve.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_NNUMBERS 10000
+#define BENCH_COUNT    100000
+#define BENCH_CONNS    4
+
+static char **numbers;
+static int nnumbers;
+
+static const char *socket_path;
+static int count = BENCH_COUNT;
+static int nconns = BENCH_CONNS;
+
+static double *latencies;
+static long matched;
+static pthread_mutex_t matched_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int bench_seed = 2463534242U;
+
+static unsigned int bench_rand(void) {
+  bench_seed ^= bench_seed << 13;
+  bench_seed ^= bench_seed >> 17;
+  bench_seed ^= bench_seed << 5;
+  return bench_seed;
+}
+
+static void load_random(void) {
+  int i, j;
+
+  nnumbers = BENCH_NNUMBERS;
+  numbers  = (char **) malloc(nnumbers * sizeof(char *));
+
+  for(i=0; i<nnumbers; i++) {
+    numbers[i] = (char *) malloc(11);
+    for(j=0; j<10; j++)
+      numbers[i][j] = '0' + bench_rand() % 10;
+    numbers[i][10] = 0;
+  }
+}
+
+static int load_csv(const char *filename) {
+  FILE *f = fopen(filename, "r");
+  char line[1024];
+  char *p, *q;
+  int size = 1024;
+
+  if( f == NULL ) {
+    perror(filename);
+    return -1;
+  }
+  nnumbers = 0;
+  numbers  = (char **) malloc(size * sizeof(char *));
+
+  while( fgets(line, sizeof(line), f) != NULL ) {
+    p = line[0] == '"' ? line + 1 : line;
+    for(q=p; *q && *q != '"' && *q != ';' && *q != '\n'; q++);
+    *q = 0;
+
+    if( nnumbers == size ) {
+      size *= 2;
+      numbers = (char **) realloc(numbers, size * sizeof(char *));
+    }
+    numbers[nnumbers++] = strdup(p);
+  }
+  fclose(f);
+  return nnumbers;
+}
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/**
+ * Each connection does its share of the lookups and records their
+ * latency in its own slice of the latencies array.
+ */
+static void *run_conn(void *arg) {
+  long conn = (long) arg;
+  int from = conn * count / nconns, to = (conn + 1) * count / nconns;
+  unsigned int seed = 2463534242U + conn;
+  pr_serve_response res;
+  double t0;
+  long found = 0;
+  char *num;
+  int fd, i;
+
+  if( (fd = pr_serve_connect(socket_path)) < 0 ) {
+    perror(socket_path);
+    exit(1);
+  }
+
+  for(i=from; i<to; i++) {
+    num = numbers[rand_r(&seed) % nnumbers];
+    t0  = now_ns();
+
+    if( pr_serve_lookup(fd, num, strlen(num), &res) < 0 ) {
+      perror("lookup");
+      exit(1);
+    }
+    latencies[i] = now_ns() - t0;
+
+    if( res.depth >= 0 )
+      found++;
+  }
+  close(fd);
+
+  pthread_mutex_lock(&matched_lock);
+  matched += found;
+  pthread_mutex_unlock(&matched_lock);
+
+  return NULL;
+}
+
+static double percentile(double p) {
+  int i = (int) (p * (count - 1));
+  return latencies[i] / 1000;
+}
+
+int main(int argc, char **argv) {
+  pthread_t *threads;
+  double t0, t1;
+  long i;
+
+  if( argc < 2 ) {
+    fprintf(stderr,
+	    "usage: %s socket [numbers.csv|- [count [connections]]]\n",
+	    argv[0]);
+    return 1;
+  }
+  socket_path = argv[1];
+
+  if( argc > 2 && strcmp(argv[2], "-") != 0 ) {
+    if( load_csv(argv[2]) <= 0 )
+      return 1;
+  }
+  else
+    load_random();
+
+  if( argc > 3 )
+    count = atoi(argv[3]);
+  if( argc > 4 )
+    nconns = atoi(argv[4]);
+
+  if( count <= 0 || nconns <= 0 || nconns > count ) {
+    fprintf(stderr, "%s: bad count or connections\n", argv[0]);
+    return 1;
+  }
+
+  latencies = (double *) malloc(count * sizeof(double));
+  threads   = (pthread_t *) malloc(nconns * sizeof(pthread_t));
+
+  t0 = now_ns();
+  for(i=0; i<nconns; i++)
+    pthread_create(&threads[i], NULL, run_conn, (void *) i);
+  for(i=0; i<nconns; i++)
+    pthread_join(threads[i], NULL);
+  t1 = now_ns();
+
+  qsort(latencies, count, sizeof(double), cmp_double);
+
+  printf("%d lookups, %d connections, %d numbers, %ld matched\n\n",
+	 count, nconns, nnumbers, matched);
+  printf("%-12s %10.0f lookups/s\n", "throughput", count / ((t1 - t0) / 1e9));
+  printf("%-12s %10.1f us\n", "p50",   percentile(0.50));
+  printf("%-12s %10.1f us\n", "p90",   percentile(0.90));
+  printf("%-12s %10.1f us\n", "p99",   percentile(0.99));
+  printf("%-12s %10.1f us\n", "p99.9", percentile(0.999));
+  printf("%-12s %10.1f us\n", "max",   latencies[count - 1] / 1000);
+
+  return 0;
+}